@@ -0,0 +1,342 @@
+/*
+    This file is part of g15daemon.
+
+    g15daemon is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    g15daemon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with g15daemon; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+    (c) 2006-2008 Mike Lampard, Philip Lawatsch, and others
+
+    $Revision$ -  $Date$ $Author$
+
+    This daemon listens on localhost port 15550 for client connections,
+    and arbitrates LCD display.  Allows for multiple simultaneous clients.
+    Client screens can be cycled through by pressing the 'L1' key.
+
+
+    g15_arbiter.c
+    foreground arbitration.  every screen has a priority class, and the screens of each class are kept on a
+    ring in the order they joined it, so that each decision looks only at the head of a ring or at the
+    cycle key's route, whatever the number of screens.
+
+    - a new screen waits for its first frame, so an empty screen is never drawn.  it then takes the lcd if
+      "New Screens Take Foreground" is on, or if only background screens were showing.
+    - background screens are shown only when there are no normal screens or alerts.
+    - an alert takes the lcd for "Alert Time (seconds)".  it is then made a normal screen, and the next
+      alert is shown, or else the screen the alerts took the lcd from.  the cycle key dismisses an alert
+      early.  a screen which asks for the lcd while an alert is showing gets it after the alerts.
+    - with "Rotate Screens Every (seconds)" set, or a screen's own interval, the next screen on the cycle
+      key's route is brought in once the screen showing has been up that long.
+
+    timed changes are made by a thread which sleeps until the next is due.
+*/
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <config.h>
+#include "g15daemon.h"
+
+static void arbiter_link(g15_arbiter_t *arb, lcdnode_t *node)
+{
+    lcdnode_t **ring = &arb->classes[node->lcd->priority];
+
+    if(*ring == NULL) {
+        node->class_prev = node->class_next = node;
+        *ring = node;
+    } else {
+        node->class_next = *ring;
+        node->class_prev = (*ring)->class_prev;
+        (*ring)->class_prev->class_next = node;
+        (*ring)->class_prev = node;
+    }
+    arb->counts[node->lcd->priority]++;
+}
+
+static void arbiter_unlink(g15_arbiter_t *arb, lcdnode_t *node)
+{
+    lcdnode_t **ring = &arb->classes[node->lcd->priority];
+
+    if(node->class_next == node)
+        *ring = NULL;
+    else {
+        node->class_prev->class_next = node->class_next;
+        node->class_next->class_prev = node->class_prev;
+        if(*ring == node)
+            *ring = node->class_next;
+    }
+    node->class_prev = node->class_next = NULL;
+    arb->counts[node->lcd->priority]--;
+}
+
+static void arbiter_set_class(g15daemon_t *masterlist, lcdnode_t *node, unsigned int priority)
+{
+    arbiter_unlink(&masterlist->arbiter, node);
+    node->lcd->priority = priority;
+    arbiter_link(&masterlist->arbiter, node);
+    /* background screens become selectable, or stop being, as the other classes empty & fill */
+    ll_relink_cycle(masterlist);
+}
+
+static unsigned long long arbiter_rotate_at(g15daemon_t *masterlist, unsigned long long now)
+{
+    lcd_t *lcd = masterlist->current->lcd;
+    unsigned int dwell = lcd->rotate_msecs ? lcd->rotate_msecs : masterlist->arbiter.rotate_msecs;
+
+    if(lcd->priority != G15_PRIORITY_NORMAL || !dwell)
+        return 0;
+    return now + dwell * G15_NSEC_PER_MSEC;
+}
+
+/* start the clocks for the screen just brought to the front, and have the thread wait for them */
+static void arbiter_arm(g15daemon_t *masterlist)
+{
+    g15_arbiter_t *arb = &masterlist->arbiter;
+    unsigned long long now = g15daemon_time_ns();
+
+    if(masterlist->current->lcd->priority == G15_PRIORITY_ALERT)
+        arb->alert_end = now + arb->alert_msecs * G15_NSEC_PER_MSEC;
+    else
+        arb->alert_end = 0;
+    arb->rotate_at = arbiter_rotate_at(masterlist, now);
+    if(arb->running)
+        uf_mailbox_post(&arb->wake);
+}
+
+/* bring 'node' to the front.  the screen losing the lcd is told so unless it is being removed */
+static void arbiter_show(g15daemon_t *masterlist, lcdnode_t *node, int tell_old)
+{
+    lcdnode_t *old = masterlist->current;
+
+    if(node != old) {
+        old->lcd->usr_foreground = 0;
+        if(tell_old)
+            g15daemon_send_event(old->lcd, G15_EVENT_VISIBILITY_CHANGED, SCR_HIDDEN);
+        uf_lcdnode_set_current(masterlist, node);
+        node->lcd->state_changed = 1;
+        g15daemon_send_event(node->lcd, G15_EVENT_VISIBILITY_CHANGED, SCR_VISIBLE);
+    }
+    arbiter_arm(masterlist);
+}
+
+/* the screen to show when the one showing goes, or its alert is over */
+static lcdnode_t *arbiter_next(g15daemon_t *masterlist)
+{
+    g15_arbiter_t *arb = &masterlist->arbiter;
+    lcdnode_t *next;
+
+    if(arb->classes[G15_PRIORITY_ALERT])
+        return arb->classes[G15_PRIORITY_ALERT];
+    next = arb->preempted;
+    arb->preempted = NULL;
+    if(next)
+        return next;
+    /* the newest selectable screen */
+    return masterlist->tail->cycle_next;
+}
+
+static void arbiter_end_alert(g15daemon_t *masterlist)
+{
+    arbiter_set_class(masterlist, masterlist->current, G15_PRIORITY_NORMAL);
+    arbiter_show(masterlist, arbiter_next(masterlist), 1);
+}
+
+void uf_arbiter_add(g15daemon_t *masterlist, lcdnode_t *node)
+{
+    g15_arbiter_t *arb = &masterlist->arbiter;
+
+    node->lcd->node = node;
+    node->lcd->priority = G15_PRIORITY_NORMAL;
+    arbiter_link(arb, node);
+    if(arb->new_to_front || masterlist->current->lcd->priority == G15_PRIORITY_BACKGROUND)
+        node->lcd->wants_foreground = 1;
+    ll_relink_cycle(masterlist);
+}
+
+void uf_arbiter_remove(g15daemon_t *masterlist, lcdnode_t *node)
+{
+    g15_arbiter_t *arb = &masterlist->arbiter;
+
+    arbiter_unlink(arb, node);
+    if(arb->preempted == node)
+        arb->preempted = NULL;
+    ll_relink_cycle(masterlist);
+    if(masterlist->current == node)
+        arbiter_show(masterlist, arbiter_next(masterlist), 0);
+}
+
+void uf_arbiter_request(g15daemon_t *masterlist, lcdnode_t *node)
+{
+    if(masterlist->current->lcd->priority == G15_PRIORITY_ALERT) {
+        /* alerts wait their turn on the ring */
+        if(node->lcd->priority != G15_PRIORITY_ALERT)
+            masterlist->arbiter.preempted = node;
+        return;
+    }
+    arbiter_show(masterlist, node, 1);
+}
+
+void uf_arbiter_selected(g15daemon_t *masterlist, lcdnode_t *node)
+{
+    arbiter_arm(masterlist);
+}
+
+int uf_arbiter_dismiss(g15daemon_t *masterlist)
+{
+    if(masterlist->current->lcd->priority != G15_PRIORITY_ALERT)
+        return 0;
+    arbiter_end_alert(masterlist);
+    return 1;
+}
+
+void uf_arbiter_first_frame(lcd_t *lcd)
+{
+    g15daemon_t *masterlist = lcd->masterlist;
+
+    pthread_mutex_lock(&masterlist->lcdlist_mutex);
+    if(lcd->wants_foreground) {
+        lcd->wants_foreground = 0;
+        uf_arbiter_request(masterlist, lcd->node);
+    }
+    pthread_mutex_unlock(&masterlist->lcdlist_mutex);
+}
+
+int g15daemon_lcd_set_priority(lcd_t *lcd, unsigned int priority)
+{
+    g15daemon_t *masterlist = lcd->masterlist;
+    g15_arbiter_t *arb = &masterlist->arbiter;
+    lcdnode_t *node = lcd->node;
+    int showing, alert_showing;
+
+    if(priority >= G15_PRIORITY_CLASSES)
+        return -1;
+    pthread_mutex_lock(&masterlist->lcdlist_mutex);
+    if(priority != lcd->priority) {
+        showing = masterlist->current == node;
+        if(showing && lcd->priority == G15_PRIORITY_ALERT) {
+            /* an alert made something else before its time is up */
+            arbiter_set_class(masterlist, node, priority);
+            arbiter_show(masterlist, arbiter_next(masterlist), 1);
+        } else {
+            alert_showing = masterlist->current->lcd->priority == G15_PRIORITY_ALERT;
+            arbiter_set_class(masterlist, node, priority);
+            if(priority == G15_PRIORITY_ALERT) {
+                /* alerts already showing keep the lcd until they are over, then this one gets it */
+                if(!alert_showing) {
+                    arb->preempted = masterlist->current;
+                    arbiter_show(masterlist, node, 1);
+                }
+            } else if(showing && priority == G15_PRIORITY_BACKGROUND && !ll_selectable(masterlist, node))
+                arbiter_show(masterlist, arbiter_next(masterlist), 1);
+        }
+    }
+    pthread_mutex_unlock(&masterlist->lcdlist_mutex);
+    return 0;
+}
+
+void g15daemon_lcd_set_rotation(lcd_t *lcd, unsigned int msecs)
+{
+    g15daemon_t *masterlist = lcd->masterlist;
+
+    pthread_mutex_lock(&masterlist->lcdlist_mutex);
+    lcd->rotate_msecs = msecs;
+    if(masterlist->current == lcd->node) {
+        masterlist->arbiter.rotate_at = arbiter_rotate_at(masterlist, g15daemon_time_ns());
+        if(masterlist->arbiter.running)
+            uf_mailbox_post(&masterlist->arbiter.wake);
+    }
+    pthread_mutex_unlock(&masterlist->lcdlist_mutex);
+}
+
+/* end the alert showing, or rotate to the next screen, if it's time.  returns the milliseconds until the
+   next change is due, or -1 if none is.  lcdlist_mutex must be held */
+static int arbiter_tick(g15daemon_t *masterlist)
+{
+    g15_arbiter_t *arb = &masterlist->arbiter;
+    unsigned long long now = g15daemon_time_ns(), due;
+    lcdnode_t *next;
+
+    if(arb->alert_end && now >= arb->alert_end) {
+        G15_INFO("Alert time is up");
+        arbiter_end_alert(masterlist);
+    } else if(arb->rotate_at && now >= arb->rotate_at) {
+        next = masterlist->current->cycle_next;
+        /* plugins may have set never_select on a screen since the route was worked out */
+        if(!ll_selectable(masterlist, next)) {
+            ll_relink_cycle(masterlist);
+            next = masterlist->current->cycle_next;
+        }
+        arbiter_show(masterlist, next, 1);
+    }
+
+    due = arb->alert_end;
+    if(arb->rotate_at && (!due || arb->rotate_at < due))
+        due = arb->rotate_at;
+    if(!due)
+        return -1;
+    now = g15daemon_time_ns();
+    return due > now ? (due - now + G15_NSEC_PER_MSEC - 1) / G15_NSEC_PER_MSEC : 0;
+}
+
+static void *arbiter_thread_func(void *arg)
+{
+    g15daemon_t *masterlist = arg;
+    g15_arbiter_t *arb = &masterlist->arbiter;
+    int timeout = -1;
+
+    while(!arb->stop) {
+        uf_mailbox_wait(&arb->wake, timeout);
+        pthread_mutex_lock(&masterlist->lcdlist_mutex);
+        timeout = arbiter_tick(masterlist);
+        pthread_mutex_unlock(&masterlist->lcdlist_mutex);
+    }
+    return NULL;
+}
+
+int uf_arbiter_start(g15daemon_t *masterlist)
+{
+    g15_arbiter_t *arb = &masterlist->arbiter;
+    pthread_attr_t attr;
+
+    if(uf_mailbox_init(&arb->wake) < 0)
+        return -1;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, 64 * 1024);
+    if(pthread_create(&arb->thread, &attr, arbiter_thread_func, masterlist) != 0) {
+        g15daemon_log(LOG_WARNING, "Unable to create arbiter thread.  Alerts won't time out, and screens won't rotate");
+        uf_mailbox_close(&arb->wake);
+        return -1;
+    }
+    pthread_mutex_lock(&masterlist->lcdlist_mutex);
+    arb->running = 1;
+    /* pick up any clocks started before now */
+    uf_mailbox_post(&arb->wake);
+    pthread_mutex_unlock(&masterlist->lcdlist_mutex);
+    return 0;
+}
+
+void uf_arbiter_exit(g15daemon_t *masterlist)
+{
+    g15_arbiter_t *arb = &masterlist->arbiter;
+
+    if(!arb->running)
+        return;
+    arb->stop = 1;
+    uf_mailbox_post(&arb->wake);
+    pthread_join(arb->thread, NULL);
+    pthread_mutex_lock(&masterlist->lcdlist_mutex);
+    arb->running = 0;
+    pthread_mutex_unlock(&masterlist->lcdlist_mutex);
+    uf_mailbox_close(&arb->wake);
+}
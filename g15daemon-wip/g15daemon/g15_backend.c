@@ -0,0 +1,828 @@
+/*
+    This file is part of g15daemon.
+
+    g15daemon is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    g15daemon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with g15daemon; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+    (c) 2006-2008 Mike Lampard, Philip Lawatsch, and others
+
+    $Revision$ -  $Date$ $Author$
+
+    This daemon listens on localhost port 15550 for client connections,
+    and arbitrates LCD display.  Allows for multiple simultaneous clients.
+    Client screens can be cycled through by pressing the 'L1' key.
+
+    g15_backend.c
+    device backends - everything the daemon does to a keyboard goes through the backend given for it
+    with --backend, once for each keyboard.  "libg15" drives real hardware, the others let the daemon,
+    its plugins and the network server run without a keyboard attached:
+
+      null[:usecs]     accept frames, taking 'usecs' microseconds per write to simulate the usb bus
+      record:file      append each frame written to 'file' as a timestamped P4 pbm image
+      script:file      replay the key events listed in 'file', one "<msecs> <keys>" pair per line
+*/
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+
+#include <config.h>
+#include <libg15.h>
+#include "g15daemon.h"
+
+#ifndef LIBG15_VERSION
+#define LIBG15_VERSION 1000
+#endif
+
+extern volatile int leaving;
+extern unsigned int g15daemon_debug;
+
+typedef struct g15_backend_s g15_backend_t;
+
+typedef struct g15_backend_s
+{
+    char *name;
+    /* 'arg' is the text following the ':' in the backend spec, or NULL */
+    int (*init)(g15_device_t *dev, char *arg);
+    int (*reinit)(g15_device_t *dev);
+    void (*exit)(g15_device_t *dev);
+    int (*write_lcd)(g15_device_t *dev, unsigned char *buf);
+    int (*read_keys)(g15_device_t *dev, unsigned int *keypresses, unsigned int timeout);
+    int (*set_lcd_brightness)(g15_device_t *dev, unsigned int level);
+    int (*set_lcd_contrast)(g15_device_t *dev, unsigned int level);
+    int (*set_leds)(g15_device_t *dev, unsigned int leds);
+    int (*set_kb_brightness)(g15_device_t *dev, unsigned int level);
+} g15_backend_s;
+
+/* the device thread.  once started, every call into the backend is made from this one thread, so
+   frame writes never queue behind a blocking key read (or the other way around) on a shared lock.
+   frame writes and settings arrive on a lock-free multiple producer queue, and the keyboard is read
+   in short slices between them, key changes being passed to the keyboard thread through a ring.
+   every keyboard has a thread, queue & ring of its own, so a slow keyboard holds up nobody else */
+
+/* a key read is made at least this often (in ms) while commands are queued, and for at most this
+   long when there are none, so commands never wait longer than this for a key read to finish */
+#define DEV_KEY_SLICE 5
+#define DEV_KEYRING_SIZE 64
+
+enum {
+    DEVCMD_WRITE_LCD = 0,
+    DEVCMD_SET,
+    DEVCMD_REINIT
+};
+
+/* shadow of the device's control registers.  clients and screen switches set the same values over
+   and over - only real changes are sent to the device.  only touched by the device thread */
+enum {
+    HW_LCD_BRIGHTNESS = 0,
+    HW_LCD_CONTRAST,
+    HW_LEDS,
+    HW_KB_BRIGHTNESS,
+    HW_REGISTERS
+};
+
+typedef struct g15_devcmd_s g15_devcmd_t;
+
+struct g15_devcmd_s
+{
+    g15_devcmd_t * volatile next;
+    int type;
+    int reg;
+    unsigned int value;
+    unsigned char *buf;
+    int retval;
+    volatile int done;
+};
+
+typedef struct script_event_s
+{
+    unsigned long long when;
+    unsigned int keys;
+} script_event_t;
+
+struct g15_device_s
+{
+    g15_backend_t *backend;
+    char *arg;
+    /* the lcd panel, from the text following the '@' in the backend spec */
+    const g15_geometry_t *geometry;
+
+    /* null, record & script backends */
+    unsigned long long null_latency;
+    FILE *record_file;
+    unsigned long long record_start;
+    unsigned long record_frames;
+    script_event_t *script_events;
+    unsigned int script_len;
+    unsigned int script_pos;
+    unsigned long long script_start;
+
+    struct {
+        unsigned int value[HW_REGISTERS];
+        /* bitmask of registers whose value is known */
+        unsigned int valid;
+        unsigned long written;
+        unsigned long suppressed;
+    } hwstate;
+
+    /* intrusive mpsc queue (after Dmitry Vyukov).  producers swap themselves in at head, the device
+       thread pops from tail */
+    struct {
+        g15_devcmd_t * volatile head;
+        g15_devcmd_t *tail;
+        g15_devcmd_t stub;
+        g15_mailbox_t wake;
+    } devqueue;
+
+    /* key changes seen by the device thread, for uf_read_keypresses(), each stamped with the time it was read */
+    struct {
+        volatile unsigned int head;
+        volatile unsigned int tail;
+        struct {
+            int retval;
+            unsigned int keys;
+            unsigned long long time;
+        } ev[DEV_KEYRING_SIZE];
+        unsigned long dropped;
+        g15_mailbox_t wake;
+    } keyring;
+    unsigned int lastkeys;
+
+    pthread_t devthread;
+    volatile int devthread_running;
+    volatile int devthread_stop;
+    /* serialises calls into the backend until the device thread starts */
+    pthread_mutex_t lock;
+    /* commands sleep here until the device thread has carried them out */
+    pthread_mutex_t devdone_mutex;
+    pthread_cond_t devdone_cond;
+};
+
+/* libg15 - real hardware.  libg15 drives a single keyboard, so only one device may use it */
+
+static int libg15_claimed = 0;
+
+static int libg15_init(g15_device_t *dev, char *arg)
+{
+    if(dev->geometry != uf_geometry_default()) {
+        g15daemon_log(LOG_ERR, "libg15 only drives the g15's own %ix%i lcd, not a %s panel", LCD_WIDTH, LCD_HEIGHT,
+                      dev->geometry->name);
+        return G15_ERROR_OPENING_USB_DEVICE;
+    }
+    if(__sync_lock_test_and_set(&libg15_claimed, 1)) {
+        g15daemon_log(LOG_ERR, "libg15 can only drive one keyboard - use another backend for the rest");
+        return G15_ERROR_OPENING_USB_DEVICE;
+    }
+#if LIBG15_VERSION >= 1200
+    /* set libg15 debugging to our debug setting */
+    libg15Debug(g15daemon_debug);
+#endif
+    return initLibG15();
+}
+
+static int libg15_reinit(g15_device_t *dev)
+{
+#if LIBG15_VERSION >= 1200
+    return re_initLibG15();
+#else
+    return initLibG15();
+#endif
+}
+
+static void libg15_exit(g15_device_t *dev)
+{
+#if LIBG15_VERSION >= 1100
+    exitLibG15();
+#endif
+}
+
+static int libg15_write_lcd(g15_device_t *dev, unsigned char *buf)
+{
+    return writePixmapToLCD(buf);
+}
+
+static int libg15_read_keys(g15_device_t *dev, unsigned int *keypresses, unsigned int timeout)
+{
+    return getPressedKeys(keypresses, timeout);
+}
+
+static int libg15_set_lcd_brightness(g15_device_t *dev, unsigned int level)
+{
+    return setLCDBrightness(level);
+}
+
+static int libg15_set_lcd_contrast(g15_device_t *dev, unsigned int level)
+{
+    return setLCDContrast(level);
+}
+
+static int libg15_set_leds(g15_device_t *dev, unsigned int leds)
+{
+    return setLEDs(leds);
+}
+
+static int libg15_set_kb_brightness(g15_device_t *dev, unsigned int level)
+{
+#if LIBG15_VERSION >= 1200
+    return setKBBrightness(level);
+#else
+    return G15_NO_ERROR;
+#endif
+}
+
+/* null - a keyboard with no keys, whose lcd accepts anything */
+
+static int null_init(g15_device_t *dev, char *arg)
+{
+    if(arg != NULL)
+        dev->null_latency = strtoull(arg, NULL, 10);
+    g15daemon_log(LOG_INFO, "Simulating %lluus per lcd write", dev->null_latency);
+    return G15_NO_ERROR;
+}
+
+static int null_reinit(g15_device_t *dev)
+{
+    return G15_NO_ERROR;
+}
+
+static void null_exit(g15_device_t *dev)
+{
+}
+
+static int null_write_lcd(g15_device_t *dev, unsigned char *buf)
+{
+    if(dev->null_latency)
+        uf_sleep_until_us(uf_gettime_us() + dev->null_latency);
+    return G15_NO_ERROR;
+}
+
+static int null_read_keys(g15_device_t *dev, unsigned int *keypresses, unsigned int timeout)
+{
+    uf_sleep_until_us(uf_gettime_us() + timeout * 1000ULL);
+    return G15_ERROR_TIMEOUT;
+}
+
+static int null_set_level(g15_device_t *dev, unsigned int level)
+{
+    return G15_NO_ERROR;
+}
+
+/* record - the null keyboard, keeping a copy of every frame.  the file is a stream of P4 pbm
+   images, each preceded by a comment holding its frame number and time since startup */
+
+static int record_init(g15_device_t *dev, char *arg)
+{
+    if(arg == NULL || *arg == 0) {
+        g15daemon_log(LOG_ERR, "The record backend needs a filename (record:filename)");
+        return G15_ERROR_OPENING_USB_DEVICE;
+    }
+    if((dev->record_file = fopen(arg, "ab")) == NULL) {
+        g15daemon_log(LOG_ERR, "Unable to open %s for recording: %s", arg, strerror(errno));
+        return G15_ERROR_OPENING_USB_DEVICE;
+    }
+    dev->record_start = uf_gettime_us();
+    g15daemon_log(LOG_INFO, "Recording lcd frames to %s", arg);
+    return G15_NO_ERROR;
+}
+
+static void record_exit(g15_device_t *dev)
+{
+    if(dev->record_file != NULL) {
+        fclose(dev->record_file);
+        dev->record_file = NULL;
+    }
+    g15daemon_log(LOG_INFO, "%lu frames recorded", dev->record_frames);
+}
+
+static int record_write_lcd(g15_device_t *dev, unsigned char *buf)
+{
+    unsigned long long now = uf_gettime_us() - dev->record_start;
+
+    fprintf(dev->record_file, "P4\n# frame %lu at %llu.%06llus\n%i %i\n", dev->record_frames++,
+            now / 1000000, now % 1000000, dev->geometry->width, dev->geometry->height);
+    if(fwrite(buf, dev->geometry->rowbytes, dev->geometry->height, dev->record_file) != dev->geometry->height
+       || fflush(dev->record_file) != 0)
+        return G15_ERROR_WRITING_PIXMAP;
+    return G15_NO_ERROR;
+}
+
+/* script - the null keyboard, pressing keys on cue.  each line of the script holds a delay in
+   milliseconds from the previous line, then the keys held down from that point - either a number
+   or key names joined by '+', eg "500 M1+G3".  "none" releases everything, '#' starts a comment.
+   once the script runs out the keyboard goes quiet */
+
+static const struct {
+    char *name;
+    unsigned int key;
+} script_keynames[] = {
+    {"G1",G15_KEY_G1}, {"G2",G15_KEY_G2}, {"G3",G15_KEY_G3}, {"G4",G15_KEY_G4}, {"G5",G15_KEY_G5},
+    {"G6",G15_KEY_G6}, {"G7",G15_KEY_G7}, {"G8",G15_KEY_G8}, {"G9",G15_KEY_G9}, {"G10",G15_KEY_G10},
+    {"G11",G15_KEY_G11}, {"G12",G15_KEY_G12}, {"G13",G15_KEY_G13}, {"G14",G15_KEY_G14},
+    {"G15",G15_KEY_G15}, {"G16",G15_KEY_G16}, {"G17",G15_KEY_G17}, {"G18",G15_KEY_G18},
+    {"M1",G15_KEY_M1}, {"M2",G15_KEY_M2}, {"M3",G15_KEY_M3}, {"MR",G15_KEY_MR},
+    {"L1",G15_KEY_L1}, {"L2",G15_KEY_L2}, {"L3",G15_KEY_L3}, {"L4",G15_KEY_L4}, {"L5",G15_KEY_L5},
+    {"LIGHT",G15_KEY_LIGHT}, {"none",0}, {NULL,0}
+};
+
+/* parse a key list, returning 0 if it contains an unknown key name */
+static int script_parse_keys(char *text, unsigned int *keys)
+{
+    char *name, *saveptr = NULL;
+    int i;
+
+    *keys = 0;
+    if(isdigit(text[0])) {
+        *keys = strtoul(text, NULL, 0);
+        return 1;
+    }
+    for(name = strtok_r(text, "+", &saveptr); name != NULL; name = strtok_r(NULL, "+", &saveptr)) {
+        for(i = 0; script_keynames[i].name != NULL; i++)
+            if(strcasecmp(name, script_keynames[i].name) == 0)
+                break;
+        if(script_keynames[i].name == NULL)
+            return 0;
+        *keys |= script_keynames[i].key;
+    }
+    return 1;
+}
+
+static int script_init(g15_device_t *dev, char *arg)
+{
+    FILE *f;
+    char line[256], keytext[128];
+    unsigned long delay;
+    unsigned long long when;
+    unsigned int lineno = 0, size = 0;
+
+    if(arg == NULL || *arg == 0) {
+        g15daemon_log(LOG_ERR, "The script backend needs a filename (script:filename)");
+        return G15_ERROR_OPENING_USB_DEVICE;
+    }
+    if((f = fopen(arg, "r")) == NULL) {
+        g15daemon_log(LOG_ERR, "Unable to open key script %s: %s", arg, strerror(errno));
+        return G15_ERROR_OPENING_USB_DEVICE;
+    }
+    /* delays run from the moment the daemon starts reading keys, so times are kept relative for now */
+    when = 0;
+    while(fgets(line, sizeof(line), f) != NULL) {
+        char *hash = strchr(line, '#');
+        lineno++;
+        if(hash != NULL)
+            *hash = 0;
+        if(sscanf(line, "%lu %127s", &delay, keytext) != 2)
+            continue;
+        if(dev->script_len == size) {
+            size = size ? size * 2 : 64;
+            dev->script_events = realloc(dev->script_events, size * sizeof(script_event_t));
+        }
+        when += delay * 1000ULL;
+        if(!script_parse_keys(keytext, &dev->script_events[dev->script_len].keys)) {
+            g15daemon_log(LOG_WARNING, "%s line %u: unknown key in \"%s\" - line ignored", arg, lineno, keytext);
+            continue;
+        }
+        dev->script_events[dev->script_len++].when = when;
+    }
+    fclose(f);
+    g15daemon_log(LOG_INFO, "Loaded %u key events from %s", dev->script_len, arg);
+    return G15_NO_ERROR;
+}
+
+static void script_exit(g15_device_t *dev)
+{
+    if(dev->script_pos < dev->script_len)
+        g15daemon_log(LOG_INFO, "Key script stopped after %u of %u events", dev->script_pos, dev->script_len);
+    free(dev->script_events);
+    dev->script_events = NULL;
+    dev->script_len = dev->script_pos = 0;
+}
+
+static int script_read_keys(g15_device_t *dev, unsigned int *keypresses, unsigned int timeout)
+{
+    unsigned long long now = uf_gettime_us(), due;
+    script_event_t *next = dev->script_pos < dev->script_len ? &dev->script_events[dev->script_pos] : NULL;
+
+    if(dev->script_start == 0)
+        dev->script_start = now;
+    due = now + timeout * 1000ULL;
+    if(next && dev->script_start + next->when < due)
+        due = dev->script_start + next->when;
+    uf_sleep_until_us(due);
+
+    if(next && dev->script_start + next->when <= uf_gettime_us()) {
+        *keypresses = next->keys;
+        dev->script_pos++;
+        G15_DEBUG("Script event %u: keys 0x%x", dev->script_pos, *keypresses);
+        return G15_NO_ERROR;
+    }
+    return G15_ERROR_TIMEOUT;
+}
+
+static g15_backend_t backends[] = {
+    {"libg15", libg15_init, libg15_reinit, libg15_exit, libg15_write_lcd, libg15_read_keys,
+        libg15_set_lcd_brightness, libg15_set_lcd_contrast, libg15_set_leds, libg15_set_kb_brightness},
+    {"null", null_init, null_reinit, null_exit, null_write_lcd, null_read_keys,
+        null_set_level, null_set_level, null_set_level, null_set_level},
+    {"record", record_init, null_reinit, record_exit, record_write_lcd, null_read_keys,
+        null_set_level, null_set_level, null_set_level, null_set_level},
+    {"script", script_init, null_reinit, script_exit, null_write_lcd, script_read_keys,
+        null_set_level, null_set_level, null_set_level, null_set_level},
+    {NULL}
+};
+
+static int hw_set(g15_device_t *dev, int reg, unsigned int value)
+{
+    int retval = G15_NO_ERROR;
+
+    if((dev->hwstate.valid & (1 << reg)) && dev->hwstate.value[reg] == value) {
+        dev->hwstate.suppressed++;
+        return retval;
+    }
+    switch(reg) {
+        case HW_LCD_BRIGHTNESS:
+            retval = dev->backend->set_lcd_brightness(dev, value);
+            break;
+        case HW_LCD_CONTRAST:
+            retval = dev->backend->set_lcd_contrast(dev, value);
+            break;
+        case HW_LEDS:
+            retval = dev->backend->set_leds(dev, value);
+            break;
+        case HW_KB_BRIGHTNESS:
+            retval = dev->backend->set_kb_brightness(dev, value);
+            break;
+    }
+    dev->hwstate.written++;
+    /* if the transfer failed, the next attempt goes through whatever the value */
+    if(retval == G15_NO_ERROR) {
+        dev->hwstate.value[reg] = value;
+        dev->hwstate.valid |= 1 << reg;
+    } else
+        dev->hwstate.valid &= ~(1 << reg);
+    return retval;
+}
+
+void uf_backend_control_stats(g15_device_t *dev, unsigned long *written, unsigned long *suppressed)
+{
+    *written = dev->hwstate.written;
+    *suppressed = dev->hwstate.suppressed;
+}
+
+static void devqueue_push(g15_device_t *dev, g15_devcmd_t *cmd)
+{
+    g15_devcmd_t *prev;
+
+    cmd->next = NULL;
+    __sync_synchronize();
+    prev = __sync_lock_test_and_set(&dev->devqueue.head, cmd);
+    prev->next = cmd;
+}
+
+/* returns NULL if the queue is empty, or a push is half done */
+static g15_devcmd_t *devqueue_pop(g15_device_t *dev)
+{
+    g15_devcmd_t *tail = dev->devqueue.tail;
+    g15_devcmd_t *next = tail->next;
+
+    if(tail == &dev->devqueue.stub) {
+        if(next == NULL)
+            return NULL;
+        dev->devqueue.tail = tail = next;
+        next = next->next;
+    }
+    if(next != NULL) {
+        dev->devqueue.tail = next;
+        return tail;
+    }
+    if(tail != dev->devqueue.head)
+        return NULL;
+    devqueue_push(dev, &dev->devqueue.stub);
+    if((next = tail->next) != NULL) {
+        dev->devqueue.tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+static int dev_execute(g15_device_t *dev, g15_devcmd_t *cmd)
+{
+    switch(cmd->type) {
+        case DEVCMD_WRITE_LCD:
+            return dev->backend->write_lcd(dev, cmd->buf);
+        case DEVCMD_SET:
+            return hw_set(dev, cmd->reg, cmd->value);
+        case DEVCMD_REINIT: {
+            int retval = dev->backend->reinit(dev);
+            /* a device which has been away has lost its settings */
+            if(retval == G15_NO_ERROR)
+                dev->hwstate.valid = 0;
+            return retval;
+        }
+    }
+    return G15_ERROR_UNSUPPORTED;
+}
+
+static void dev_complete(g15_device_t *dev, g15_devcmd_t *cmd, int retval)
+{
+    cmd->retval = retval;
+    pthread_mutex_lock(&dev->devdone_mutex);
+    cmd->done = 1;
+    pthread_cond_broadcast(&dev->devdone_cond);
+    pthread_mutex_unlock(&dev->devdone_mutex);
+}
+
+/* run 'cmd' on the device thread, and wait for the result */
+static int dev_submit(g15_device_t *dev, g15_devcmd_t *cmd)
+{
+    struct timespec wait;
+    int retval;
+
+    cmd->done = 0;
+    if(!dev->devthread_running) {
+        pthread_mutex_lock(&dev->lock);
+        retval = dev_execute(dev, cmd);
+        pthread_mutex_unlock(&dev->lock);
+        return retval;
+    }
+    devqueue_push(dev, cmd);
+    uf_mailbox_post(&dev->devqueue.wake);
+
+    pthread_mutex_lock(&dev->devdone_mutex);
+    while(!cmd->done) {
+        clock_gettime(CLOCK_REALTIME, &wait);
+        wait.tv_sec++;
+        pthread_cond_timedwait(&dev->devdone_cond, &dev->devdone_mutex, &wait);
+        /* the device thread has gone away under us - nothing else is popping, so fail whatever is left */
+        if(!dev->devthread_running) {
+            g15_devcmd_t *left;
+            while((left = devqueue_pop(dev)) != NULL) {
+                left->retval = G15_ERROR_WRITING_BUFFER;
+                left->done = 1;
+            }
+            pthread_cond_broadcast(&dev->devdone_cond);
+        }
+    }
+    pthread_mutex_unlock(&dev->devdone_mutex);
+    return cmd->retval;
+}
+
+static void keyring_push(g15_device_t *dev, int retval, unsigned int keys, unsigned long long time)
+{
+    unsigned int head = dev->keyring.head;
+
+    if(head - dev->keyring.tail >= DEV_KEYRING_SIZE) {
+        dev->keyring.dropped++;
+        return;
+    }
+    dev->keyring.ev[head % DEV_KEYRING_SIZE].retval = retval;
+    dev->keyring.ev[head % DEV_KEYRING_SIZE].keys = keys;
+    dev->keyring.ev[head % DEV_KEYRING_SIZE].time = time;
+    __sync_synchronize();
+    dev->keyring.head = head + 1;
+    uf_mailbox_post(&dev->keyring.wake);
+}
+
+/* read the keyboard for up to 'timeout' ms, passing on any change.  returns 0 if the device has gone */
+static int dev_read_keys(g15_device_t *dev, unsigned int timeout)
+{
+    unsigned int keys = 0;
+    unsigned long long now;
+    int retval;
+
+    retval = dev->backend->read_keys(dev, &keys, timeout);
+    /* every 2nd packet contains the codes we want.. immediately try again */
+    while(retval == G15_ERROR_TRY_AGAIN)
+        retval = dev->backend->read_keys(dev, &keys, timeout);
+    now = uf_gettime_us();
+
+    if(retval == G15_NO_ERROR && keys != dev->lastkeys) {
+        keyring_push(dev, retval, keys, now);
+        dev->lastkeys = keys;
+    } else if(retval == -ENODEV) {
+        keyring_push(dev, retval, 0, now);
+        return 0;
+    }
+    return 1;
+}
+
+static void *device_thread(void *arg)
+{
+    g15_device_t *dev = arg;
+    g15_devcmd_t *cmd;
+    unsigned long long next_read = 0;
+    int have_device = 1;
+
+    while(!dev->devthread_stop) {
+        while((cmd = devqueue_pop(dev)) != NULL) {
+            int retval = dev_execute(dev, cmd);
+            if(cmd->type == DEVCMD_REINIT && retval == G15_NO_ERROR)
+                have_device = 1;
+            /* cmd belongs to the caller once completed */
+            dev_complete(dev, cmd, retval);
+            /* don't let a stream of frames starve the keyboard */
+            if(have_device && !leaving && uf_gettime_us() >= next_read) {
+                have_device = dev_read_keys(dev, 1);
+                next_read = uf_gettime_us() + DEV_KEY_SLICE * 1000;
+            }
+        }
+        /* nobody reads keys once we're leaving, and a missing keyboard can only be reattached by command */
+        if(have_device && !leaving) {
+            have_device = dev_read_keys(dev, DEV_KEY_SLICE);
+            next_read = uf_gettime_us() + DEV_KEY_SLICE * 1000;
+        } else
+            uf_mailbox_wait(&dev->devqueue.wake, 100);
+    }
+    return NULL;
+}
+
+/* start the device thread.  until then (and after uf_backend_exit()) the backend is called directly,
+   serialised by the device's lock */
+int uf_backend_start(g15_device_t *dev)
+{
+    pthread_attr_t attr;
+
+    dev->devqueue.head = dev->devqueue.tail = &dev->devqueue.stub;
+    dev->devqueue.stub.next = NULL;
+    if(uf_mailbox_init(&dev->devqueue.wake) < 0 || uf_mailbox_init(&dev->keyring.wake) < 0)
+        return -1;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr,128*1024);
+    dev->devthread_stop = 0;
+    dev->devthread_running = 1;
+    if(pthread_create(&dev->devthread, &attr, device_thread, dev) != 0) {
+        g15daemon_log(LOG_ERR,"Unable to create device thread.");
+        dev->devthread_running = 0;
+        return -1;
+    }
+    return 0;
+}
+
+g15_device_t *uf_backend_new(char *spec)
+{
+    g15_device_t *dev;
+    const g15_geometry_t *geometry = uf_geometry_default();
+    size_t len = strcspn(spec, ":@"), panel_len;
+    char *rest = spec + len;
+    int i;
+
+    for(i = 0; backends[i].name != NULL; i++)
+        if(strlen(backends[i].name) == len && strncmp(spec, backends[i].name, len) == 0)
+            break;
+    if(backends[i].name == NULL)
+        return NULL;
+    if(*rest == '@') {
+        panel_len = strcspn(++rest, ":");
+        if((geometry = uf_geometry_find(rest, panel_len)) == NULL)
+            return NULL;
+        rest += panel_len;
+    }
+    dev = g15daemon_xmalloc(sizeof(g15_device_t));
+    dev->backend = &backends[i];
+    dev->arg = *rest == ':' ? rest + 1 : NULL;
+    dev->geometry = geometry;
+    pthread_mutex_init(&dev->lock, NULL);
+    pthread_mutex_init(&dev->devdone_mutex, NULL);
+    pthread_cond_init(&dev->devdone_cond, NULL);
+    return dev;
+}
+
+const g15_geometry_t *uf_backend_geometry(g15_device_t *dev)
+{
+    return dev->geometry;
+}
+
+const char *uf_backend_name(g15_device_t *dev)
+{
+    return dev->backend->name;
+}
+
+/* list the available backends on stdout, for --help */
+void uf_backend_list()
+{
+    int i;
+
+    for(i = 0; backends[i].name != NULL; i++)
+        printf("%s%s", i ? ", " : "", backends[i].name);
+}
+
+int uf_backend_init(g15_device_t *dev)
+{
+    g15daemon_log(LOG_INFO, "Using %s device backend", dev->backend->name);
+    dev->hwstate.valid = 0;
+    return dev->backend->init(dev, dev->arg);
+}
+
+int uf_backend_reinit(g15_device_t *dev)
+{
+    g15_devcmd_t cmd;
+
+    cmd.type = DEVCMD_REINIT;
+    return dev_submit(dev, &cmd);
+}
+
+void uf_backend_exit(g15_device_t *dev)
+{
+    if(dev->devthread_running) {
+        dev->devthread_stop = 1;
+        uf_mailbox_post(&dev->devqueue.wake);
+        pthread_join(dev->devthread, NULL);
+        dev->devthread_running = 0;
+        /* wake anybody who slipped a command in at the last moment */
+        pthread_mutex_lock(&dev->devdone_mutex);
+        pthread_cond_broadcast(&dev->devdone_cond);
+        pthread_mutex_unlock(&dev->devdone_mutex);
+        if(dev->keyring.dropped)
+            g15daemon_log(LOG_WARNING, "%lu key events were dropped", dev->keyring.dropped);
+        uf_mailbox_close(&dev->devqueue.wake);
+        uf_mailbox_close(&dev->keyring.wake);
+    }
+    dev->backend->exit(dev);
+}
+
+void uf_backend_free(g15_device_t *dev)
+{
+    pthread_mutex_destroy(&dev->lock);
+    pthread_mutex_destroy(&dev->devdone_mutex);
+    pthread_cond_destroy(&dev->devdone_cond);
+    free(dev);
+}
+
+int uf_write_buf_to_g15(g15_device_t *dev, unsigned char *buf)
+{
+    g15_devcmd_t cmd;
+
+    cmd.type = DEVCMD_WRITE_LCD;
+    cmd.buf = buf;
+    return dev_submit(dev, &cmd);
+}
+
+int uf_read_keypresses(g15_device_t *dev, unsigned int *keypresses, unsigned long long *time, unsigned int timeout)
+{
+    unsigned int tail = dev->keyring.tail;
+    int retval;
+
+    if(!dev->devthread_running) {
+        pthread_mutex_lock(&dev->lock);
+        retval = dev->backend->read_keys(dev, keypresses, timeout);
+        pthread_mutex_unlock(&dev->lock);
+        *time = uf_gettime_us();
+        return retval;
+    }
+
+    if(tail == dev->keyring.head)
+        uf_mailbox_wait(&dev->keyring.wake, timeout);
+    if(tail == dev->keyring.head)
+        return G15_ERROR_TIMEOUT;
+    __sync_synchronize();
+    retval = dev->keyring.ev[tail % DEV_KEYRING_SIZE].retval;
+    *keypresses = dev->keyring.ev[tail % DEV_KEYRING_SIZE].keys;
+    *time = dev->keyring.ev[tail % DEV_KEYRING_SIZE].time;
+    __sync_synchronize();
+    dev->keyring.tail = tail + 1;
+    return retval;
+}
+
+static int dev_set(g15_device_t *dev, int reg, unsigned int value)
+{
+    g15_devcmd_t cmd;
+
+    cmd.type = DEVCMD_SET;
+    cmd.reg = reg;
+    cmd.value = value;
+    return dev_submit(dev, &cmd);
+}
+
+int uf_set_lcd_brightness(g15_device_t *dev, unsigned int level)
+{
+    return dev_set(dev, HW_LCD_BRIGHTNESS, level);
+}
+
+int uf_set_lcd_contrast(g15_device_t *dev, unsigned int level)
+{
+    return dev_set(dev, HW_LCD_CONTRAST, level);
+}
+
+int g15daemon_set_mleds(g15daemon_t *masterlist, unsigned int leds)
+{
+    return dev_set(masterlist->device, HW_LEDS, leds);
+}
+
+int g15daemon_set_kb_backlight(g15daemon_t *masterlist, unsigned int level)
+{
+    return dev_set(masterlist->device, HW_KB_BRIGHTNESS, level);
+}
@@ -0,0 +1,269 @@
+/*
+    This file is part of g15daemon.
+
+    g15daemon is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    g15daemon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with g15daemon; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+    (c) 2006-2008 Mike Lampard, Philip Lawatsch, and others
+
+    $Revision$ -  $Date$ $Author$
+
+    This daemon listens on localhost port 15550 for client connections,
+    and arbitrates LCD display.  Allows for multiple simultaneous clients.
+    Client screens can be cycled through by pressing the 'L1' key.
+
+
+    g15_capture.c
+    frame capture.  the lcd thread copies frames into a small ring and carries on; a capture thread
+    saves screenshots as binary pbm files, and, if a "Capture File" is configured, appends every frame
+    written to the lcd to it, run-length coded against the frame before (see g15daemon.h for the format,
+    and g15capture for a decoder).
+*/
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+
+#include <config.h>
+#include "g15daemon.h"
+
+/* room for the visible rows of any panel's frame */
+#define CAPTURE_FRAMESIZE G15_MAX_BUFSIZE
+/* frames the capture thread may fall behind by.  must be a power of two */
+#define CAPTURE_SLOTS 16
+
+enum {
+    CAPTURE_RECORD = 1,
+    CAPTURE_SCREENSHOT = 2
+};
+
+typedef struct capture_slot_s
+{
+    unsigned char buf[CAPTURE_FRAMESIZE];
+    unsigned long long time;
+    unsigned int what;
+} capture_slot_t;
+
+/* written by the lcd thread (head) and the capture thread (tail) only */
+static capture_slot_t slots[CAPTURE_SLOTS];
+static volatile unsigned int head = 0;
+static volatile unsigned int tail = 0;
+static g15_mailbox_t wake;
+static pthread_t capture_thread;
+static int capture_running = 0;
+static volatile int capture_stop = 0;
+static volatile int screenshot_wanted = 0;
+
+/* the panel of the keyboard being captured */
+static const g15_geometry_t *capture_geometry = NULL;
+static FILE *capture_file = NULL;
+static unsigned long long capture_last = 0;
+static unsigned char capture_prev[CAPTURE_FRAMESIZE];
+static unsigned long capture_recorded = 0;
+static unsigned long capture_dropped = 0;
+
+static void put_le(unsigned char *p, unsigned long long value, int bytes)
+{
+    while(bytes--) {
+        *p++ = value & 0xff;
+        value >>= 8;
+    }
+}
+
+static unsigned char *put_varint(unsigned char *p, unsigned long long value)
+{
+    while(value >= 0x80) {
+        *p++ = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    *p++ = value;
+    return p;
+}
+
+int uf_capture_open(const g15_geometry_t *geometry, char *path)
+{
+    unsigned char header[19];
+    struct timeval tv;
+
+    capture_geometry = geometry;
+    if(path == NULL || *path == 0)
+        return 0;
+    if((capture_file = fopen(path, "ab")) == NULL) {
+        g15daemon_log(LOG_WARNING, "Unable to open capture file %s: %s", path, strerror(errno));
+        return -1;
+    }
+    gettimeofday(&tv, NULL);
+    memcpy(header, G15_CAPTURE_MAGIC, 6);
+    header[6] = G15_CAPTURE_VERSION;
+    put_le(header + 7, geometry->width, 2);
+    put_le(header + 9, geometry->height, 2);
+    put_le(header + 11, tv.tv_sec * 1000000ULL + tv.tv_usec, 8);
+    fwrite(header, sizeof(header), 1, capture_file);
+    fflush(capture_file);
+    capture_last = uf_gettime_us();
+    memset(capture_prev, 0, sizeof(capture_prev));
+    g15daemon_log(LOG_INFO, "Recording lcd frames to %s", path);
+    return 0;
+}
+
+/* append 'buf' to the capture file as the runs of bytes which differ from the previous frame */
+static void capture_record(unsigned char *buf, unsigned long long time)
+{
+    /* worst case is a varint pair in front of every other byte */
+    unsigned char out[1 + 10 + CAPTURE_FRAMESIZE * 3];
+    unsigned char *p = out;
+    unsigned int framesize = capture_geometry->framesize, pos = 0, start, n;
+
+    *p++ = 'F';
+    p = put_varint(p, time > capture_last ? time - capture_last : 0);
+    capture_last = time;
+    while(pos < framesize) {
+        start = pos;
+        while(pos < framesize && buf[pos] == capture_prev[pos])
+            pos++;
+        p = put_varint(p, pos - start);
+        /* a single unchanged byte costs less to send than to end the run for */
+        start = pos;
+        while(pos < framesize && (buf[pos] != capture_prev[pos] ||
+              (pos + 1 < framesize && buf[pos + 1] != capture_prev[pos + 1])))
+            pos++;
+        p = put_varint(p, pos - start);
+        for(n = start; n < pos; n++)
+            *p++ = buf[n] ^ capture_prev[n];
+    }
+    memcpy(capture_prev, buf, framesize);
+    if(fwrite(out, p - out, 1, capture_file) != 1) {
+        g15daemon_log(LOG_WARNING, "Unable to write to capture file: %s.  Recording stopped", strerror(errno));
+        fclose(capture_file);
+        capture_file = NULL;
+        return;
+    }
+    capture_recorded++;
+}
+
+static void capture_screenshot(unsigned char *buf)
+{
+    static int scr_num = 0;
+    char filename[128];
+
+    sprintf(filename, "/tmp/g15daemon-sc-%i.pbm", scr_num++);
+    if(uf_screendump_pbm(capture_geometry, buf, filename) == 0)
+        g15daemon_log(LOG_INFO, "Screenshot saved to %s", filename);
+}
+
+static void capture_drain()
+{
+    int wrote = 0;
+
+    while(tail != head) {
+        capture_slot_t *slot = &slots[tail & (CAPTURE_SLOTS - 1)];
+
+        __sync_synchronize();
+        if((slot->what & CAPTURE_RECORD) && capture_file) {
+            capture_record(slot->buf, slot->time);
+            wrote = 1;
+        }
+        if(slot->what & CAPTURE_SCREENSHOT)
+            capture_screenshot(slot->buf);
+        __sync_synchronize();
+        tail++;
+    }
+    /* a batch at a time, so a crash loses little of the recording */
+    if(wrote && capture_file)
+        fflush(capture_file);
+}
+
+static void *capture_thread_func(void *arg)
+{
+    while(!capture_stop) {
+        uf_mailbox_wait(&wake, 500);
+        capture_drain();
+    }
+    capture_drain();
+    return NULL;
+}
+
+int uf_capture_start()
+{
+    pthread_attr_t attr;
+
+    if(uf_mailbox_init(&wake) < 0)
+        return -1;
+    pthread_attr_init(&attr);
+    /* capture_record() keeps a worst case frame on the stack */
+    pthread_attr_setstacksize(&attr, 64 * 1024);
+    if(pthread_create(&capture_thread, &attr, capture_thread_func, NULL) != 0) {
+        g15daemon_log(LOG_WARNING, "Unable to create capture thread.  Screenshots and recording disabled");
+        uf_mailbox_close(&wake);
+        return -1;
+    }
+    capture_running = 1;
+    return 0;
+}
+
+void uf_capture_exit()
+{
+    if(capture_running) {
+        capture_stop = 1;
+        uf_mailbox_post(&wake);
+        pthread_join(capture_thread, NULL);
+        uf_mailbox_close(&wake);
+        capture_running = 0;
+    }
+    if(capture_file) {
+        fclose(capture_file);
+        capture_file = NULL;
+        g15daemon_log(LOG_INFO, "%lu frames recorded, %lu lost", capture_recorded, capture_dropped);
+    }
+}
+
+void uf_capture_screenshot()
+{
+    screenshot_wanted = 1;
+}
+
+void uf_capture_frame(unsigned char *buf, unsigned long long written)
+{
+    unsigned int what = 0;
+    capture_slot_t *slot;
+
+    if(!capture_running || capture_geometry == NULL)
+        return;
+    if(written && capture_file)
+        what |= CAPTURE_RECORD;
+    if(screenshot_wanted && __sync_bool_compare_and_swap(&screenshot_wanted, 1, 0))
+        what |= CAPTURE_SCREENSHOT;
+    if(!what)
+        return;
+    if(head - tail >= CAPTURE_SLOTS) {
+        capture_dropped++;
+        return;
+    }
+    slot = &slots[head & (CAPTURE_SLOTS - 1)];
+    memcpy(slot->buf, buf, capture_geometry->framesize);
+    slot->time = written;
+    slot->what = what;
+    __sync_synchronize();
+    head++;
+    uf_mailbox_post(&wake);
+}
+
+void uf_capture_stats(unsigned long *recorded, unsigned long *dropped)
+{
+    *recorded = capture_recorded;
+    *dropped = capture_dropped;
+}
@@ -0,0 +1,332 @@
+/*
+    This file is part of g15daemon.
+
+    g15daemon is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    g15daemon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with g15daemon; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+    (c) 2006-2008 Mike Lampard, Philip Lawatsch, and others
+
+    $Revision$ -  $Date$ $Author$
+
+    This daemon listens on localhost port 15550 for client connections,
+    and arbitrates LCD display.  Allows for multiple simultaneous clients.
+    Client screens can be cycled through by pressing the 'L1' key.
+
+
+    g15_compositor.c
+    overlay layers.  a screen may have up to G15_LAYERS layers drawn over its frame - a volume bar, say, or
+    a popup - each with its own pixels, position, clip rectangle and raster op, and optionally a time at
+    which it goes away.  the lcd thread keeps each screen's frame with its layers drawn over it.  when only
+    a layer has changed, just the part of the screen the layer covers (or covered) is redrawn: the frame is
+    copied back there, and the layers which overlap it are drawn again.  clients can change an overlay
+    without sending a whole frame, and the overlay costs only its own pixels.
+
+    layers are packed like the lcd buffer, leftmost pixel in bit 7, and are drawn 32 pixels at a time.
+    the blit is built for each panel in G15_GEOMETRIES, with the panel's row length a constant.
+*/
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <config.h>
+#include "g15daemon.h"
+
+#define G15_INLINE static inline __attribute__((always_inline))
+
+/* 32 pixels of a packed row, starting 'bit' pixels in, leftmost pixel in the top bit.  pixels outside
+   the row's 'nbytes' bytes read as unlit */
+static unsigned int blit_fetch(const unsigned char *row, int nbytes, int bit)
+{
+    int byte = bit >= 0 ? bit / 8 : -((7 - bit) / 8), shift = bit - byte * 8, i;
+    unsigned long long word = 0;
+
+    if(shift == 0 && byte >= 0 && byte + 4 <= nbytes)
+        return (unsigned int)row[byte] << 24 | row[byte + 1] << 16 | row[byte + 2] << 8 | row[byte + 3];
+    for(i = 0; i < 5; i++, byte++)
+        word = word << 8 | (byte >= 0 && byte < nbytes ? row[byte] : 0);
+    return (unsigned int)(word >> (8 - shift));
+}
+
+/* the 32 pixels of a screen row 'rowbytes' long starting at byte 'byte'.  bytes past the end of the row read as 0 */
+G15_INLINE unsigned int blit_load(const unsigned char *row, int rowbytes, int byte)
+{
+    unsigned int word = 0;
+    int i;
+
+    for(i = 0; i < 4; i++, byte++)
+        word = word << 8 | (byte < rowbytes ? row[byte] : 0);
+    return word;
+}
+
+G15_INLINE void blit_store(unsigned char *row, int rowbytes, int byte, unsigned int word)
+{
+    int i;
+
+    for(i = 0; i < 4; i++, byte++)
+        if(byte < rowbytes)
+            row[byte] = word >> (24 - i * 8);
+}
+
+/* draw the part of 'layer' within screen pixels x0..x1, y0..y1 (exclusive) onto 'screen', whose rows are
+   'rowbytes' long */
+G15_INLINE void blit_layer(unsigned char *screen, int rowbytes, g15_layer_t *layer, int x0, int y0, int x1, int y1)
+{
+    unsigned int mask, src, dst;
+    int x, y, byte, lo, hi;
+
+    /* clip to the layer itself, and to its clip rectangle */
+    if(x0 < layer->x) x0 = layer->x;
+    if(y0 < layer->y) y0 = layer->y;
+    if(x1 > layer->x + (int)layer->width) x1 = layer->x + layer->width;
+    if(y1 > layer->y + (int)layer->height) y1 = layer->y + layer->height;
+    if(x0 < layer->clip_x0) x0 = layer->clip_x0;
+    if(y0 < layer->clip_y0) y0 = layer->clip_y0;
+    if(x1 > layer->clip_x1) x1 = layer->clip_x1;
+    if(y1 > layer->clip_y1) y1 = layer->clip_y1;
+    if(x0 >= x1 || y0 >= y1)
+        return;
+
+    for(y = y0; y < y1; y++) {
+        const unsigned char *srcrow = layer->pixels + (y - layer->y) * layer->rowbytes;
+        unsigned char *dstrow = screen + y * rowbytes;
+
+        for(byte = x0 / 8; byte * 8 < x1; byte += 4) {
+            x = byte * 8;
+            /* the pixels of this word inside x0..x1 */
+            lo = x0 > x ? x0 - x : 0;
+            hi = x1 - x < 32 ? x1 - x : 32;
+            mask = (0xffffffffU >> lo) & ~(hi < 32 ? 0xffffffffU >> hi : 0);
+            src = blit_fetch(srcrow, layer->rowbytes, x - layer->x) & mask;
+            dst = blit_load(dstrow, rowbytes, byte);
+            switch(layer->rop) {
+                case G15_ROP_COPY:
+                    dst = (dst & ~mask) | src;
+                    break;
+                case G15_ROP_OR:
+                    dst |= src;
+                    break;
+                case G15_ROP_XOR:
+                    dst ^= src;
+                    break;
+                case G15_ROP_ANDNOT:
+                    dst &= ~src;
+                    break;
+            }
+            blit_store(dstrow, rowbytes, byte, dst);
+        }
+    }
+}
+
+#define BLIT_KERNEL(id, name, width, height, format, bufsize) \
+void uf_blit_##id(unsigned char *screen, g15_layer_t *layer, int x0, int y0, int x1, int y1) \
+{ \
+    blit_layer(screen, (width) / 8, layer, x0, y0, x1, y1); \
+}
+G15_GEOMETRIES(BLIT_KERNEL)
+
+/* add screen pixels x0..x1, y0..y1 (exclusive) to the part of the screen to redraw.  layers_lock must be held */
+static void layers_damage(lcd_t *lcd, int x0, int y0, int x1, int y1)
+{
+    const g15_geometry_t *geometry = lcd->masterlist->geometry;
+
+    if(x0 < 0) x0 = 0;
+    if(y0 < 0) y0 = 0;
+    if(x1 > (int)geometry->width) x1 = geometry->width;
+    if(y1 > (int)geometry->height) y1 = geometry->height;
+    if(x0 >= x1 || y0 >= y1)
+        return;
+    /* whole bytes, so the frame can be copied back bytewise */
+    x0 &= ~7;
+    x1 = (x1 + 7) & ~7;
+    if(lcd->damage_x0 >= lcd->damage_x1) {
+        lcd->damage_x0 = x0;
+        lcd->damage_y0 = y0;
+        lcd->damage_x1 = x1;
+        lcd->damage_y1 = y1;
+        return;
+    }
+    if(x0 < lcd->damage_x0) lcd->damage_x0 = x0;
+    if(y0 < lcd->damage_y0) lcd->damage_y0 = y0;
+    if(x1 > lcd->damage_x1) lcd->damage_x1 = x1;
+    if(y1 > lcd->damage_y1) lcd->damage_y1 = y1;
+}
+
+static void layers_damage_layer(lcd_t *lcd, g15_layer_t *layer)
+{
+    int x0 = layer->x, y0 = layer->y, x1 = layer->x + layer->width, y1 = layer->y + layer->height;
+
+    if(x0 < layer->clip_x0) x0 = layer->clip_x0;
+    if(y0 < layer->clip_y0) y0 = layer->clip_y0;
+    if(x1 > layer->clip_x1) x1 = layer->clip_x1;
+    if(y1 > layer->clip_y1) y1 = layer->clip_y1;
+    layers_damage(lcd, x0, y0, x1, y1);
+}
+
+/* layers_lock must be held */
+static void layers_drop(lcd_t *lcd, unsigned int index)
+{
+    g15_layer_t *layer = lcd->layers[index];
+
+    layers_damage_layer(lcd, layer);
+    free(layer->pixels);
+    free(layer);
+    lcd->layers[index] = NULL;
+    lcd->nlayers--;
+}
+
+static void layers_changed(lcd_t *lcd)
+{
+    if(lcd->foreground)
+        uf_wake_lcd_thread(lcd->masterlist);
+}
+
+unsigned long long uf_layers_compose(lcd_t *lcd, unsigned char *base, int fresh, unsigned char *out)
+{
+    const g15_geometry_t *geometry = lcd->masterlist->geometry;
+    unsigned long long now = g15daemon_time_ns(), next_expiry = 0;
+    g15_layer_t *layer;
+    int i, y;
+
+    pthread_mutex_lock(&lcd->layers_lock);
+    for(i = 0; i < G15_LAYERS; i++) {
+        layer = lcd->layers[i];
+        if(layer && layer->expires) {
+            if(layer->expires <= now)
+                layers_drop(lcd, i);
+            else if(!next_expiry || layer->expires < next_expiry)
+                next_expiry = layer->expires;
+        }
+    }
+    if(lcd->composed == NULL)
+        lcd->composed = g15daemon_xmalloc(geometry->bufsize);
+    if(fresh || !lcd->composed_valid) {
+        memcpy(lcd->composed, base, geometry->bufsize);
+        lcd->damage_x0 = lcd->damage_y0 = 0;
+        lcd->damage_x1 = geometry->width;
+        lcd->damage_y1 = geometry->height;
+        lcd->composed_valid = 1;
+    } else {
+        /* put the frame back where the layers which changed were, or are now */
+        for(y = lcd->damage_y0; y < lcd->damage_y1; y++)
+            memcpy(lcd->composed + y * geometry->rowbytes + lcd->damage_x0 / 8,
+                   base + y * geometry->rowbytes + lcd->damage_x0 / 8, (lcd->damage_x1 - lcd->damage_x0) / 8);
+    }
+    if(lcd->damage_x0 < lcd->damage_x1) {
+        for(i = 0; i < G15_LAYERS; i++)
+            if(lcd->layers[i])
+                geometry->blit(lcd->composed, lcd->layers[i], lcd->damage_x0, lcd->damage_y0, lcd->damage_x1, lcd->damage_y1);
+        lcd->damage_x0 = lcd->damage_x1 = 0;
+    }
+    memcpy(out, lcd->composed, geometry->bufsize);
+    pthread_mutex_unlock(&lcd->layers_lock);
+    return next_expiry;
+}
+
+void uf_layers_free(lcd_t *lcd)
+{
+    int i;
+
+    for(i = 0; i < G15_LAYERS; i++)
+        if(lcd->layers[i]) {
+            free(lcd->layers[i]->pixels);
+            free(lcd->layers[i]);
+        }
+    free(lcd->composed);
+    pthread_mutex_destroy(&lcd->layers_lock);
+}
+
+int g15daemon_layer_set(lcd_t *lcd, unsigned int layer, int x, int y, unsigned int width, unsigned int height,
+                        unsigned int rop, const unsigned char *pixels, unsigned int expire_msecs)
+{
+    const g15_geometry_t *geometry = lcd->masterlist->geometry;
+    unsigned int rowbytes = (width + 7) / 8;
+    g15_layer_t *l;
+
+    if(layer < 1 || layer > G15_LAYERS || rop >= G15_ROPS || width < 1 || width > geometry->width || height < 1
+       || height > geometry->height)
+        return -1;
+    pthread_mutex_lock(&lcd->layers_lock);
+    if((l = lcd->layers[layer - 1]) == NULL) {
+        l = g15daemon_xmalloc(sizeof(g15_layer_t));
+        l->clip_x1 = geometry->width;
+        l->clip_y1 = geometry->height;
+        lcd->layers[layer - 1] = l;
+        /* the frame under the layers may have changed while there were none */
+        if(lcd->nlayers++ == 0)
+            lcd->composed_valid = 0;
+    } else
+        layers_damage_layer(lcd, l);
+    if(l->size < rowbytes * height) {
+        free(l->pixels);
+        l->size = rowbytes * height;
+        l->pixels = g15daemon_xmalloc(l->size);
+    }
+    memcpy(l->pixels, pixels, rowbytes * height);
+    l->x = x;
+    l->y = y;
+    l->width = width;
+    l->height = height;
+    l->rowbytes = rowbytes;
+    l->rop = rop;
+    l->expires = expire_msecs ? g15daemon_time_ns() + expire_msecs * G15_NSEC_PER_MSEC : 0;
+    layers_damage_layer(lcd, l);
+    pthread_mutex_unlock(&lcd->layers_lock);
+    layers_changed(lcd);
+    return 0;
+}
+
+int g15daemon_layer_clip(lcd_t *lcd, unsigned int layer, int x, int y, unsigned int width, unsigned int height)
+{
+    g15_layer_t *l;
+
+    if(layer < 1 || layer > G15_LAYERS)
+        return -1;
+    pthread_mutex_lock(&lcd->layers_lock);
+    if((l = lcd->layers[layer - 1]) == NULL) {
+        pthread_mutex_unlock(&lcd->layers_lock);
+        return -1;
+    }
+    layers_damage_layer(lcd, l);
+    if(width == 0 || height == 0) {
+        /* no clipping, beyond the screen's edges */
+        l->clip_x0 = l->clip_y0 = 0;
+        l->clip_x1 = lcd->masterlist->geometry->width;
+        l->clip_y1 = lcd->masterlist->geometry->height;
+    } else {
+        l->clip_x0 = x;
+        l->clip_y0 = y;
+        l->clip_x1 = x + width;
+        l->clip_y1 = y + height;
+    }
+    layers_damage_layer(lcd, l);
+    pthread_mutex_unlock(&lcd->layers_lock);
+    layers_changed(lcd);
+    return 0;
+}
+
+int g15daemon_layer_remove(lcd_t *lcd, unsigned int layer)
+{
+    if(layer < 1 || layer > G15_LAYERS)
+        return -1;
+    pthread_mutex_lock(&lcd->layers_lock);
+    if(lcd->layers[layer - 1] == NULL) {
+        pthread_mutex_unlock(&lcd->layers_lock);
+        return -1;
+    }
+    layers_drop(lcd, layer - 1);
+    pthread_mutex_unlock(&lcd->layers_lock);
+    layers_changed(lcd);
+    return 0;
+}
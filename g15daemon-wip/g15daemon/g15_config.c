@@ -0,0 +1,1125 @@
+/*
+    This file is part of g15daemon.
+
+    g15daemon is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    g15daemon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with g15daemon; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+    (c) 2006-2008 Mike Lampard, Philip Lawatsch, and others
+
+    $Revision$ -  $Date$ $Author$
+
+    This daemon listens on localhost port 15550 for client connections,
+    and arbitrates LCD display.  Allows for multiple simultaneous clients.
+    Client screens can be cycled through by pressing the 'L1' key.
+
+    g15_config.c
+    the configuration store.  sections and their keys are kept in file order on linked lists (for writing
+    back out), and indexed by open addressed hash tables, so a lookup is a hash and a probe or two and never
+    allocates.  key names are interned, and keys, values, items and sections all come from one arena which
+    is freed in one go.  int, float & bool values are parsed when set rather than on every read.
+    the store is guarded by a reader/writer lock, as the watcher thread merges edits to the file into it
+    while the daemon runs.
+*/
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <config.h>
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
+#include "g15daemon.h"
+
+extern volatile int leaving;
+
+#define CONFIG_ARENA_CHUNK 4096
+/* values are given a little room to change in place */
+#define CONFIG_VALUE_ROUND 16
+/* how often the file is checked for changes without inotify, and how long to let a burst of writes settle */
+#define CONFIG_POLL_MSECS 2000
+#define CONFIG_SETTLE_MSECS 100
+#ifndef IOV_MAX
+#define IOV_MAX 16
+#endif
+
+typedef struct config_slot_s
+{
+    unsigned int hash;
+    /* NULL if the slot is empty */
+    char *key;
+    void *ptr;
+} config_slot_s;
+
+typedef struct config_arena_s
+{
+    config_arena_t *next;
+    unsigned int used;
+    unsigned int size;
+    char data[];
+} config_arena_s;
+
+static void *config_alloc(configfile_t *config, unsigned int bytes)
+{
+    config_arena_t *chunk = config->arena;
+    void *ptr;
+
+    bytes = (bytes + 7) & ~7;
+    if(chunk == NULL || chunk->size - chunk->used < bytes) {
+        unsigned int size = bytes > CONFIG_ARENA_CHUNK ? bytes : CONFIG_ARENA_CHUNK;
+
+        chunk = g15daemon_xmalloc(sizeof(config_arena_t) + size);
+        chunk->size = size;
+        chunk->used = 0;
+        chunk->next = config->arena;
+        config->arena = chunk;
+    }
+    ptr = chunk->data + chunk->used;
+    chunk->used += bytes;
+    return ptr;
+}
+
+/* FNV-1a */
+static unsigned int config_hash(char *key)
+{
+    unsigned int hash = 2166136261u;
+
+    while(*key)
+        hash = (hash ^ (unsigned char)*key++) * 16777619u;
+    return hash;
+}
+
+static config_slot_t *config_index_find(config_index_t *index, char *key, unsigned int hash)
+{
+    config_slot_t *slot;
+    unsigned int i;
+
+    if(index->size == 0)
+        return NULL;
+    for(i = hash & (index->size - 1); ; i = (i + 1) & (index->size - 1)) {
+        slot = &index->slots[i];
+        if(slot->key == NULL)
+            return NULL;
+        if(slot->hash == hash && (slot->key == key || strcmp(slot->key, key) == 0))
+            return slot;
+    }
+}
+
+static void config_index_put(config_index_t *index, char *key, unsigned int hash, void *ptr)
+{
+    unsigned int i;
+
+    for(i = hash & (index->size - 1); index->slots[i].key != NULL; i = (i + 1) & (index->size - 1))
+        ;
+    index->slots[i].hash = hash;
+    index->slots[i].key = key;
+    index->slots[i].ptr = ptr;
+    index->used++;
+}
+
+/* add an entry, growing the table to keep it no more than 3/4 full */
+static void config_index_insert(config_index_t *index, char *key, unsigned int hash, void *ptr)
+{
+    if((index->used + 1) * 4 > index->size * 3) {
+        config_slot_t *old = index->slots;
+        unsigned int oldsize = index->size, i;
+
+        index->size = oldsize ? oldsize * 2 : 16;
+        index->slots = g15daemon_xmalloc(index->size * sizeof(config_slot_t));
+        index->used = 0;
+        for(i = 0; i < oldsize; i++)
+            if(old[i].key)
+                config_index_put(index, old[i].key, old[i].hash, old[i].ptr);
+        free(old);
+    }
+    config_index_put(index, key, hash, ptr);
+}
+
+/* remove an entry, moving back any which probed past it so that no tombstones are needed */
+static void config_index_remove(config_index_t *index, config_slot_t *slot)
+{
+    unsigned int mask = index->size - 1;
+    unsigned int hole = slot - index->slots, i, home;
+
+    for(i = (hole + 1) & mask; index->slots[i].key != NULL; i = (i + 1) & mask) {
+        home = index->slots[i].hash & mask;
+        /* move it if its home is not cyclically within (hole, i] */
+        if((i > hole && (home <= hole || home > i)) || (i < hole && home <= hole && home > i)) {
+            index->slots[hole] = index->slots[i];
+            hole = i;
+        }
+    }
+    index->slots[hole].key = NULL;
+    index->used--;
+}
+
+static char *config_intern(configfile_t *config, char *key, unsigned int hash)
+{
+    config_slot_t *slot = config_index_find(&config->keys, key, hash);
+    char *interned;
+
+    if(slot)
+        return slot->key;
+    interned = config_alloc(config, strlen(key) + 1);
+    strcpy(interned, key);
+    config_index_insert(&config->keys, interned, hash, interned);
+    return interned;
+}
+
+static void config_parse(config_items_t *item)
+{
+    item->ival = atoi(item->value);
+    item->fval = atof(item->value);
+    item->bval = strncmp(item->value, "On", 2) == 0;
+}
+
+/* cleanup whitespace */
+char * uf_remove_whitespace(char *str){
+    int z=0;
+    if(str==NULL)
+        return "";
+    while(isspace(str[z])&&str[z])
+        z++;
+    str+=z;
+    return str;
+}
+
+static configfile_t *config_new()
+{
+    configfile_t *config = g15daemon_xmalloc(sizeof(configfile_t));
+
+    pthread_rwlock_init(&config->lock, NULL);
+    return config;
+}
+
+static void config_free(configfile_t *config)
+{
+    config_section_t *section;
+    config_arena_t *chunk;
+
+    for(section = config->sections; section != NULL; section = section->next) {
+        free(section->index.slots);
+        free(section->text);
+    }
+    free(config->index.slots);
+    free(config->keys.slots);
+    while((chunk = config->arena) != NULL) {
+        config->arena = chunk->next;
+        free(chunk);
+    }
+    pthread_rwlock_destroy(&config->lock);
+    free(config);
+}
+
+/* the functions below, up to the public ones, expect the caller to hold config->lock (or to be the only
+   thread which can see the config) */
+
+static config_section_t *config_find_section(configfile_t *config, char *name)
+{
+    config_slot_t *slot = config_index_find(&config->index, name, config_hash(name));
+
+    return slot ? slot->ptr : NULL;
+}
+
+static config_items_t *config_find(config_section_t *section, char *key)
+{
+    config_slot_t *slot = config_index_find(&section->index, key, config_hash(key));
+
+    return slot ? slot->ptr : NULL;
+}
+
+static config_section_t *config_section(configfile_t *config, char *name)
+{
+    config_section_t *new = NULL;
+    unsigned int hash = config_hash(name);
+    config_slot_t *slot = config_index_find(&config->index, name, hash);
+
+    if(slot)
+        return slot->ptr;
+    new = config_alloc(config, sizeof(config_section_t));
+    memset(new, 0, sizeof(config_section_t));
+    new->head = new;
+    new->next = NULL;
+    new->config = config;
+    new->sectionname=config_intern(config, name, hash);
+    config_index_insert(&config->index, new->sectionname, hash, new);
+    if(!config->sections){
+        config->sections=new;
+        config->sections->head = new;
+    } else {
+        config->sections->head->next=new;
+        config->sections->head = new;
+    }
+    new->dirty = 1;
+    config->dirty = 1;
+    return new;
+}
+
+/* returns 1 if the value changed */
+static int config_write(config_section_t *section, char *key, char *val)
+{
+    config_items_t *new = NULL;
+    unsigned int hash, len;
+    config_slot_t *slot;
+
+    hash = config_hash(key);
+    len = strlen(val) + 1;
+    if((slot = config_index_find(&section->index, key, hash))){
+        new = slot->ptr;
+        if(strcmp(new->value, val) == 0)
+            return 0;
+        /* the old value stays in the arena, as a caller may still hold it */
+        if(len > new->capacity) {
+            new->capacity = (len + CONFIG_VALUE_ROUND - 1) & ~(CONFIG_VALUE_ROUND - 1);
+            new->value = config_alloc(section->config, new->capacity);
+        }
+        memcpy(new->value, val, len);
+    }else{
+        new=config_alloc(section->config, sizeof(config_items_t));
+        new->head=new;
+        new->next=NULL;
+
+        new->key=config_intern(section->config, key, hash);
+        new->capacity = (len + CONFIG_VALUE_ROUND - 1) & ~(CONFIG_VALUE_ROUND - 1);
+        new->value=config_alloc(section->config, new->capacity);
+        memcpy(new->value, val, len);
+        if(!section->items){
+            new->prev=NULL;
+            section->items=new;
+            section->items->head=new;
+        }else{
+            new->prev=section->items->head;
+            section->items->head->next=new;
+            section->items->head=new;
+        }
+        config_index_insert(&section->index, new->key, hash, new);
+    }
+    config_parse(new);
+    section->dirty = 1;
+    section->config->dirty = 1;
+    return 1;
+}
+
+/* the item itself stays in the arena until the config is freed.  returns 1 if there was such a key */
+static int config_remove(config_section_t *section, char *key)
+{
+    config_items_t *old = NULL;
+    config_slot_t *slot;
+
+    if((slot = config_index_find(&section->index, key, config_hash(key))) == NULL)
+        return 0;
+    old = slot->ptr;
+    config_index_remove(&section->index, slot);
+
+    /* the first item on the list keeps track of the last */
+    if(old->prev)
+        old->prev->next = old->next;
+    else if((section->items = old->next) != NULL)
+        section->items->head = old->head;
+    if(old->next)
+        old->next->prev = old->prev;
+    else if(section->items)
+        section->items->head = old->prev;
+    section->dirty = 1;
+    section->config->dirty = 1;
+    return 1;
+}
+
+/* FNV-1a over the contents of the file, to tell a real change from the daemon's own write */
+static unsigned int config_hash_bytes(unsigned int hash, char *buf, size_t len)
+{
+    while(len--)
+        hash = (hash ^ (unsigned char)*buf++) * 16777619u;
+    return hash;
+}
+
+/* read 'filename' into 'config', which nothing else can see yet */
+static int config_load(configfile_t *config, char *filename)
+{
+    char *buffer, *lines;
+    int config_fd=-1;
+    char *sect;
+    char *start;
+    char *bar = NULL;
+    int i;
+    struct stat stats;
+
+    if (lstat(filename, &stats) == -1)
+        return -1;
+    if ((config_fd = open(filename, O_RDONLY)) < 0)
+        return -1;
+
+    buffer = g15daemon_xmalloc(stats.st_size + 1);
+
+    if (read(config_fd, buffer, stats.st_size) != stats.st_size)
+    {
+        free(buffer);
+        close(config_fd);
+        return -1;
+    }
+    close(config_fd);
+    buffer[stats.st_size] = '\0';
+    config->hash = config_hash_bytes(2166136261u, buffer, stats.st_size);
+
+    lines=strtok_r(buffer,"\n",&bar);
+    config_section_t *section=NULL;
+    while(lines!=NULL){
+        sect=lines;
+
+        i=0;
+        while(isspace(sect[i])){
+            i++;
+        }
+        start=sect+i;
+        if(start[0]=='#'){
+	   /* header - ignore */
+           /* comments start with ; and can be produced like so:
+             g15daemon_cfg_write_string(noload_cfg,"; Plugins in this section will not be loaded on start","");
+             the value parameter must not be used.
+           */
+        } else if(strrchr(start,']')) { /* section title */
+            char sectiontitle[1024];
+            memset(sectiontitle,0,1024);
+            strncpy(sectiontitle,start+1,strlen(start)-2);
+            section = config_section(config,sectiontitle);
+        }else{
+            /*section keys */
+            if(section==NULL){
+                /* create an internal section "Global" which is the default for items not under a [section] header */
+                section=config_section(config,"Global");
+            }
+            char *foo=NULL;
+            char *key = uf_remove_whitespace( strtok_r(start,":=",&foo) );
+            char *val = uf_remove_whitespace( strtok_r(NULL,":=", &foo) );
+
+            config_write(section,key,val);
+        }
+        lines=strtok_r(NULL,"\n",&bar);
+    }
+
+    free(buffer);
+    return 0;
+}
+
+/* free all memory used by the config subsystem */
+void uf_conf_free(g15daemon_t *list)
+{
+    if(list->config == NULL)
+        return;
+    config_free(list->config);
+    list->config = NULL;
+}
+
+/* persistence.  each section keeps its text as it was last saved, and only sections changed since are
+   formatted again.  the whole file then goes out in one writev() to a temporary file, which is renamed
+   over the old one, so whenever the daemon stops the file on disk is complete.
+
+   the daemon runs as nobody, and the file belongs to root.  so that it can be saved while the daemon runs,
+   a writer process is forked before privileges are dropped.  it keeps root's, and does nothing but replace
+   the one file with whatever the daemon sends it over a socket: the length, then the text */
+
+static pthread_mutex_t config_save_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int config_writer_sock = -1;
+static pid_t config_writer_pid = -1;
+static char config_writer_file[1024];
+static char config_header[] = "# G15Daemon Configuration File\n# any items entered before a [section] header\n# will be in the Global config space\n# comments you wish to keep should start with a semicolon';'\n";
+
+/* config->lock must be held for writing, and config_save_mutex held, as the old text may be being written out */
+static void config_render(config_section_t *section)
+{
+    config_items_t *item;
+    unsigned int len = strlen(section->sectionname) + 4;
+    char *text;
+
+    for(item = section->items; item != NULL; item = item->next)
+        len += strlen(item->key) + strlen(item->value) + 3;
+    if(len + 1 > section->textsize) {
+        free(section->text);
+        section->textsize = (len + 1 + CONFIG_VALUE_ROUND - 1) & ~(CONFIG_VALUE_ROUND - 1);
+        section->text = g15daemon_xmalloc(section->textsize);
+    }
+    text = section->text;
+    text += sprintf(text, "\n[%s]\n", section->sectionname);
+    for(item = section->items; item != NULL; item = item->next) {
+        if(item->key[0]==';') // comment
+            text += sprintf(text, "%s\n", item->key);
+        else
+            text += sprintf(text, "%s: %s\n", item->key, item->value);
+    }
+    section->textlen = text - section->text;
+    section->dirty = 0;
+}
+
+/* 'sock' is set if 'fd' is the writer's socket, which is written without raising SIGPIPE */
+static int config_writev(int fd, struct iovec *iov, int count, int sock)
+{
+    struct msghdr msg;
+    ssize_t done;
+
+    while(count > 0) {
+        if(sock) {
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = count > IOV_MAX ? IOV_MAX : count;
+            done = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        } else
+            done = writev(fd, iov, count > IOV_MAX ? IOV_MAX : count);
+        if(done < 0) {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        /* step over whatever was written, in case it was cut short */
+        while(count > 0 && (size_t)done >= iov->iov_len) {
+            done -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if(count > 0) {
+            iov->iov_base = (char*)iov->iov_base + done;
+            iov->iov_len -= done;
+        }
+    }
+    return 0;
+}
+
+static int config_read(int fd, void *buf, size_t len)
+{
+    ssize_t done;
+
+    while(len > 0) {
+        if((done = read(fd, buf, len)) <= 0) {
+            if(done < 0 && errno == EINTR)
+                continue;
+            if(done == 0)
+                errno = EPIPE;
+            return -1;
+        }
+        buf = (char*)buf + done;
+        len -= done;
+    }
+    return 0;
+}
+
+/* replace 'filename' with the 'count' pieces of text in 'iov'.  returns -1 with errno set on failure */
+static int config_replace(const char *filename, struct iovec *iov, int count)
+{
+    char tmpname[1024], *dir;
+    int fd, retval = -1, err;
+
+    snprintf(tmpname, sizeof(tmpname), "%s.XXXXXX", filename);
+    if((fd = mkstemp(tmpname)) < 0)
+        return -1;
+    if(fchmod(fd, 0644) == 0 && config_writev(fd, iov, count, 0) == 0 && fsync(fd) == 0) {
+        close(fd);
+        fd = -1;
+        if(rename(tmpname, filename) == 0)
+            retval = 0;
+    }
+    if(retval < 0) {
+        err = errno;
+        if(fd >= 0)
+            close(fd);
+        unlink(tmpname);
+        errno = err;
+        return -1;
+    }
+    /* make the rename itself durable */
+    dir = strdup(filename);
+    if(strrchr(dir, '/'))
+        *strrchr(dir, '/') = 0;
+    else
+        strcpy(dir, ".");
+    if((fd = open(*dir ? dir : "/", O_RDONLY)) >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+    free(dir);
+    return 0;
+}
+
+/* the writer process.  answers each file it is sent with 0, or the errno it couldn't be saved for */
+static void config_writer(int sock, const char *filename)
+{
+    struct iovec iov;
+    unsigned int len;
+    int err;
+
+    while(config_read(sock, &len, sizeof(len)) == 0) {
+        if((iov.iov_base = malloc(len + 1)) == NULL || config_read(sock, iov.iov_base, len) < 0)
+            break;
+        iov.iov_len = len;
+        err = config_replace(filename, &iov, 1) < 0 ? errno : 0;
+        free(iov.iov_base);
+        if(send(sock, &err, sizeof(err), MSG_NOSIGNAL) != sizeof(err))
+            break;
+    }
+    _exit(0);
+}
+
+/* have the writer replace the file with the 'count' - 1 pieces of text from iov[1] on.  iov[0] is for the
+   length.  returns -1 with errno set on failure */
+static int config_send(struct iovec *iov, int count)
+{
+    unsigned int len = 0;
+    int i, err;
+
+    for(i = 1; i < count; i++)
+        len += iov[i].iov_len;
+    iov[0].iov_base = &len;
+    iov[0].iov_len = sizeof(len);
+    if(config_writev(config_writer_sock, iov, count, 1) < 0 || config_read(config_writer_sock, &err, sizeof(err)) < 0) {
+        err = errno;
+        g15daemon_log(LOG_WARNING,"Config writer has gone (%s) - saving the config directly",strerror(err));
+        close(config_writer_sock);
+        config_writer_sock = -1;
+        errno = err;
+        return -1;
+    }
+    errno = err;
+    return err ? -1 : 0;
+}
+
+int uf_conf_writer_start(char *filename)
+{
+    int sv[2], fd, maxfd;
+
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+        return -1;
+    strncpy(config_writer_file, filename, sizeof(config_writer_file) - 1);
+    if((config_writer_pid = fork()) < 0) {
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+    if(config_writer_pid == 0) {
+        /* it mustn't keep the keyboard or anything else of the daemon's open.  few files are open yet */
+        maxfd = sysconf(_SC_OPEN_MAX);
+        for(fd = 3; fd < maxfd && fd < 1024; fd++)
+            if(fd != sv[1])
+                close(fd);
+        /* signals to stop are for the daemon, which closes the socket once it has saved the config at exit */
+        signal(SIGINT, SIG_IGN);
+        signal(SIGTERM, SIG_IGN);
+        signal(SIGQUIT, SIG_IGN);
+        signal(SIGUSR1, SIG_IGN);
+        config_writer(sv[1], filename);
+    }
+    close(sv[1]);
+    fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+    config_writer_sock = sv[0];
+    return 0;
+}
+
+void uf_conf_writer_exit()
+{
+    if(config_writer_pid <= 0)
+        return;
+    if(config_writer_sock >= 0)
+        close(config_writer_sock);
+    config_writer_sock = -1;
+    waitpid(config_writer_pid, NULL, 0);
+    config_writer_pid = -1;
+}
+
+static int config_save(configfile_t *config, char *filename)
+{
+    config_section_t *section;
+    struct iovec *iov;
+    unsigned int hash = 2166136261u;
+    int count = 2, retval = -1, err = 0;
+
+    pthread_mutex_lock(&config_save_mutex);
+    pthread_rwlock_wrlock(&config->lock);
+    for(section = config->sections; section != NULL; section = section->next)
+        count++;
+    /* iov[0] is left for the length sent to the writer */
+    iov = g15daemon_xmalloc(count * sizeof(struct iovec));
+    iov[1].iov_base = config_header;
+    iov[1].iov_len = strlen(config_header);
+    hash = config_hash_bytes(hash, config_header, iov[1].iov_len);
+    for(count = 2, section = config->sections; section != NULL; section = section->next, count++) {
+        if(section->dirty || section->text == NULL)
+            config_render(section);
+        iov[count].iov_base = section->text;
+        iov[count].iov_len = section->textlen;
+        hash = config_hash_bytes(hash, section->text, section->textlen);
+    }
+    /* before the rename, so the watcher doesn't take our own write for an edit */
+    config->hash = hash;
+    config->dirty = 0;
+    pthread_rwlock_unlock(&config->lock);
+
+    /* the writer only ever writes the file it was started for.  other files, or this one if the writer
+       has gone, are written with the caller's own privileges */
+    if(config_writer_sock >= 0 && strcmp(filename, config_writer_file) == 0)
+        retval = config_send(iov, count);
+    if(config_writer_sock < 0 || strcmp(filename, config_writer_file) != 0)
+        retval = config_replace(filename, iov + 1, count - 1);
+    if(retval < 0) {
+        err = errno;
+        g15daemon_log(LOG_WARNING,"Unable to save %s: %s",filename,strerror(err));
+        pthread_rwlock_wrlock(&config->lock);
+        config->dirty = 1;
+        pthread_rwlock_unlock(&config->lock);
+    }
+    pthread_mutex_unlock(&config_save_mutex);
+    free(iov);
+    errno = err;
+    return retval;
+}
+
+/* write the config file with all keys/sections */
+int uf_conf_write(g15daemon_t *list,char *filename)
+{
+    return config_save(list->config, filename);
+}
+
+/* write the config back to the file it was read from, if anything has changed */
+int uf_conf_flush(g15daemon_t *list)
+{
+    configfile_t *config = list->config;
+    int dirty;
+
+    pthread_rwlock_rdlock(&config->lock);
+    dirty = config->dirty;
+    pthread_rwlock_unlock(&config->lock);
+    return dirty ? config_save(config, config->filename) : 0;
+}
+
+int g15daemon_cfg_save(g15daemon_t *masterlist)
+{
+    return uf_conf_flush(masterlist);
+}
+
+/* search for valid section name return pointer to section, or NULL otherwise */
+config_section_t* uf_search_confsection(g15daemon_t *list,char *sectionname){
+    config_section_t *section;
+
+    pthread_rwlock_rdlock(&list->config->lock);
+    section = config_find_section(list->config, sectionname);
+    pthread_rwlock_unlock(&list->config->lock);
+    return section;
+}
+
+/* search for valid key called "key" in section named "section" return pointer to item or NULL */
+config_items_t* uf_search_confitem(config_section_t *section, char *key){
+    config_items_t *item;
+
+    if(section==NULL)
+        return NULL;
+    pthread_rwlock_rdlock(&section->config->lock);
+    item = config_find(section, key);
+    pthread_rwlock_unlock(&section->config->lock);
+    return item;
+}
+
+/* return pointer to section, or create a new section if it doesnt exist.  sections are never freed before
+   the config is, so the pointer can be kept */
+config_section_t *g15daemon_cfg_load_section(g15daemon_t *masterlist,char *name) {
+
+    configfile_t *config = masterlist->config;
+    config_section_t *section;
+
+    pthread_rwlock_rdlock(&config->lock);
+    section = config_find_section(config, name);
+    pthread_rwlock_unlock(&config->lock);
+    if(section)
+        return section;
+    pthread_rwlock_wrlock(&config->lock);
+    section = config_section(config, name);
+    pthread_rwlock_unlock(&config->lock);
+    return section;
+}
+
+/* add a new key, or update the value of an already existing key, or return -1 if section doesnt exist */
+int g15daemon_cfg_write_string(config_section_t *section, char *key, char *val){
+
+    if(section==NULL)
+        return -1;
+
+    pthread_rwlock_wrlock(&section->config->lock);
+    config_write(section, key, val);
+    pthread_rwlock_unlock(&section->config->lock);
+    return 0;
+}
+
+/* remove a key/value pair from named section */
+int g15daemon_cfg_remove_key(config_section_t *section, char *key){
+
+    if(section==NULL)
+        return -1;
+
+    pthread_rwlock_wrlock(&section->config->lock);
+    config_remove(section, key);
+    pthread_rwlock_unlock(&section->config->lock);
+    return 0;
+}
+
+int g15daemon_cfg_write_int(config_section_t *section, char *key, int val) {
+    char tmp[1024];
+    snprintf(tmp,1024,"%i",val);
+    return g15daemon_cfg_write_string(section, key, tmp);
+}
+
+int g15daemon_cfg_write_float(config_section_t *section, char *key, double val) {
+    char tmp[1024];
+    snprintf(tmp,1024,"%f",val);
+    return g15daemon_cfg_write_string(section, key, tmp);
+}
+
+/* simply write value as On or Off depending on whether val>0 */
+int g15daemon_cfg_write_bool(config_section_t *section, char *key, unsigned int val) {
+    return g15daemon_cfg_write_string(section, key, val?"On":"Off");
+}
+
+/* the config read functions will either return a value from the config file, or the default value, which will be written to the config file if the key doesnt exist */
+
+/* return bool as int from key in sectionname */
+int g15daemon_cfg_read_bool(config_section_t *section, char *key, int defaultval) {
+
+    config_items_t *item;
+    int val = defaultval;
+
+    if(section==NULL)
+        return defaultval;
+    pthread_rwlock_rdlock(&section->config->lock);
+    if((item = config_find(section, key)))
+        val = item->bval;
+    pthread_rwlock_unlock(&section->config->lock);
+    if(item == NULL)
+        g15daemon_cfg_write_bool(section, key, defaultval);
+    return val;
+}
+
+/* return int from key in sectionname */
+int g15daemon_cfg_read_int(config_section_t *section, char *key, int defaultval) {
+
+    config_items_t *item;
+    int val = defaultval;
+
+    if(section==NULL)
+        return defaultval;
+    pthread_rwlock_rdlock(&section->config->lock);
+    if((item = config_find(section, key)))
+        val = item->ival;
+    pthread_rwlock_unlock(&section->config->lock);
+    if(item == NULL)
+        g15daemon_cfg_write_int(section, key, defaultval);
+    return val;
+}
+
+/* return float from key in sectionname */
+double g15daemon_cfg_read_float(config_section_t *section, char *key, double defaultval) {
+
+    config_items_t *item;
+    double val = defaultval;
+
+    if(section==NULL)
+        return defaultval;
+    pthread_rwlock_rdlock(&section->config->lock);
+    if((item = config_find(section, key)))
+        val = item->fval;
+    pthread_rwlock_unlock(&section->config->lock);
+    if(item == NULL)
+        g15daemon_cfg_write_float(section, key, defaultval);
+    return val;
+}
+
+/* return string value from key in sectionname.  the string stays valid until the config is freed, but
+   may be changed underneath the caller by a later write or reload */
+char* g15daemon_cfg_read_string(config_section_t *section, char *key, char *defaultval) {
+
+    config_items_t *item;
+    char *val = defaultval;
+
+    if(section==NULL)
+        return defaultval;
+    pthread_rwlock_rdlock(&section->config->lock);
+    if((item = config_find(section, key)))
+        val = item->value;
+    pthread_rwlock_unlock(&section->config->lock);
+    if(item == NULL)
+        g15daemon_cfg_write_string(section, key, defaultval);
+    return val;
+}
+
+
+int uf_conf_open(g15daemon_t *list, char *filename) {
+
+    configfile_t *config = config_new();
+    int retval;
+
+    list->config = config;
+    config->filename = config_alloc(config, strlen(filename) + 1);
+    strcpy(config->filename, filename);
+    retval = config_load(config, filename);
+    /* the file already says all this.  the sections have no text yet, so are still formatted when it is saved */
+    config->dirty = 0;
+    return retval;
+}
+
+/* live reload.  the watcher thread waits for the file to be replaced or written, reads it into a fresh
+   config, and merges what changed since it was last read into the running config under the write lock.
+   sections & items are changed in place rather than the whole config being swapped, as plugins keep
+   their section pointers, and settings the daemon itself changed since are left alone.  the same thread
+   saves the config every so often if it has been changed */
+
+static pthread_t watch_thread;
+static int watch_running = 0;
+static g15_mailbox_t watch_exit;
+static g15daemon_t *watch_list;
+static char watch_filename[1024];
+static void (*watch_changed)(g15daemon_t *masterlist);
+/* how often changes are saved (0 for only at exit), read from the config itself */
+static unsigned int watch_save_msecs;
+/* set once saving has failed for want of permission */
+static int watch_save_denied = 0;
+/* the file as it was last read */
+static configfile_t *watch_disk;
+
+/* merge the differences between the file as it was ('old') and is now ('fresh') into 'live'.
+   returns the number of keys changed */
+static int config_merge(configfile_t *live, configfile_t *old, configfile_t *fresh)
+{
+    config_section_t *section, *oldsection;
+    config_items_t *item, *olditem;
+    int changed = 0;
+
+    for(section = fresh->sections; section != NULL; section = section->next) {
+        oldsection = config_find_section(old, section->sectionname);
+        for(item = section->items; item != NULL; item = item->next) {
+            olditem = oldsection ? config_find(oldsection, item->key) : NULL;
+            if(olditem && strcmp(olditem->value, item->value) == 0)
+                continue;
+            changed += config_write(config_section(live, section->sectionname), item->key, item->value);
+        }
+    }
+    for(oldsection = old->sections; oldsection != NULL; oldsection = oldsection->next) {
+        config_section_t *livesection = config_find_section(live, oldsection->sectionname);
+
+        section = config_find_section(fresh, oldsection->sectionname);
+        for(olditem = oldsection->items; livesection && olditem != NULL; olditem = olditem->next)
+            if(section == NULL || config_find(section, olditem->key) == NULL)
+                changed += config_remove(livesection, olditem->key);
+    }
+    return changed;
+}
+
+static unsigned int config_save_msecs(g15daemon_t *masterlist)
+{
+    config_section_t *global_cfg = g15daemon_cfg_load_section(masterlist,"Global");
+
+    return g15daemon_cfg_read_int(global_cfg,"Save Config Every (seconds)",30) * 1000;
+}
+
+static void config_reload()
+{
+    configfile_t *live = watch_list->config;
+    configfile_t *fresh = config_new();
+    g15daemon_t *device;
+    unsigned int hash, d;
+    int changed, dirty;
+
+    if(config_load(fresh, watch_filename) < 0) {
+        /* most likely caught between an editor's unlink & rename - the next event will bring it back */
+        config_free(fresh);
+        return;
+    }
+    pthread_rwlock_rdlock(&live->lock);
+    hash = live->hash;
+    pthread_rwlock_unlock(&live->lock);
+    if(fresh->hash == hash) {
+        /* our own save.  later edits are to be compared with what it wrote */
+        config_free(watch_disk);
+        watch_disk = fresh;
+        return;
+    }
+    if(fresh->hash == watch_disk->hash) {
+        config_free(fresh);
+        return;
+    }
+
+    pthread_rwlock_wrlock(&live->lock);
+    dirty = live->dirty;
+    changed = config_merge(live, watch_disk, fresh);
+    /* the file already has these changes, so they needn't be saved.  the sections changed still have
+       their text formatted again when something else is */
+    live->dirty = dirty;
+    live->hash = fresh->hash;
+    if(changed)
+        live->generation++;
+    pthread_rwlock_unlock(&live->lock);
+    config_free(watch_disk);
+    watch_disk = fresh;
+    watch_save_msecs = config_save_msecs(watch_list);
+
+    g15daemon_log(LOG_WARNING,"%s changed: %i settings updated",watch_filename,changed);
+    if(changed == 0)
+        return;
+    if(watch_changed)
+        watch_changed(watch_list);
+    /* every keyboard shares the one config */
+    for(d = 0; (device = g15daemon_device(watch_list, d)) != NULL; d++)
+        uf_event_broadcast(device, G15_EVENT_CONFIG_CHANGED, live->generation);
+}
+
+static void *config_watch_thread(void *arg)
+{
+    struct pollfd fds[2];
+    int nfds = 1, timeout = CONFIG_POLL_MSECS;
+    unsigned long long next_save = g15daemon_time_ns() + watch_save_msecs * G15_NSEC_PER_MSEC;
+    time_t mtime = 0;
+    struct stat st;
+#ifdef HAVE_SYS_INOTIFY_H
+    char *dir = strdup(watch_filename), *base = strrchr(watch_filename, '/');
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    int ifd;
+
+    base = base ? base + 1 : watch_filename;
+    if(strrchr(dir, '/'))
+        *strrchr(dir, '/') = 0;
+    else
+        strcpy(dir, ".");
+    /* the directory is watched rather than the file, as editors replace the file rather than write to it */
+    if((ifd = inotify_init()) >= 0 && inotify_add_watch(ifd, dir, IN_CLOSE_WRITE|IN_MOVED_TO|IN_CREATE) < 0) {
+        close(ifd);
+        ifd = -1;
+    }
+    if(ifd >= 0) {
+        fds[1].fd = ifd;
+        fds[1].events = POLLIN;
+        nfds = 2;
+        timeout = -1;
+    } else
+        g15daemon_log(LOG_WARNING,"Unable to watch %s (%s), checking it every %is instead",dir,strerror(errno),CONFIG_POLL_MSECS/1000);
+    free(dir);
+#endif
+    fds[0].fd = watch_exit.fd[0];
+    fds[0].events = POLLIN;
+    if(stat(watch_filename, &st) == 0)
+        mtime = st.st_mtime;
+
+    while(!leaving) {
+        int changed = 0, wait = timeout;
+        unsigned long long now = g15daemon_time_ns();
+
+        if(watch_save_msecs) {
+            int left = next_save > now ? (next_save - now) / G15_NSEC_PER_MSEC + 1 : 0;
+
+            if(wait < 0 || left < wait)
+                wait = left;
+        }
+        if(poll(fds, nfds, wait) < 0 && errno != EINTR)
+            break;
+        if(fds[0].revents & POLLIN)
+            break;
+        /* changes are saved in batches, rather than as each is made */
+        if(watch_save_msecs && !watch_save_denied && (now = g15daemon_time_ns()) >= next_save) {
+            if(uf_conf_flush(watch_list) < 0 && (errno == EACCES || errno == EPERM)) {
+                /* the daemon only goes back to root once its threads have stopped, so this won't change */
+                g15daemon_log(LOG_WARNING,"%s can't be written by the daemon's user - changes will be saved at exit only",watch_filename);
+                watch_save_denied = 1;
+            }
+            next_save = now + watch_save_msecs * G15_NSEC_PER_MSEC;
+        }
+#ifdef HAVE_SYS_INOTIFY_H
+        if(nfds > 1 && (fds[1].revents & POLLIN)) {
+            int len = read(ifd, buf, sizeof(buf)), i;
+
+            for(i = 0; i < len; ) {
+                struct inotify_event *ev = (struct inotify_event*)(buf + i);
+
+                if(ev->len && strcmp(ev->name, base) == 0)
+                    changed = 1;
+                i += sizeof(struct inotify_event) + ev->len;
+            }
+        }
+#endif
+        if(nfds == 1 && stat(watch_filename, &st) == 0 && st.st_mtime != mtime) {
+            mtime = st.st_mtime;
+            changed = 1;
+        }
+        if(!changed)
+            continue;
+        /* let a burst of writes settle before reading the file */
+        if(uf_mailbox_wait(&watch_exit, CONFIG_SETTLE_MSECS))
+            break;
+#ifdef HAVE_SYS_INOTIFY_H
+        if(nfds > 1)
+            while(poll(&fds[1], 1, 0) > 0 && read(ifd, buf, sizeof(buf)) > 0)
+                ;
+#endif
+        config_reload();
+    }
+#ifdef HAVE_SYS_INOTIFY_H
+    if(ifd >= 0)
+        close(ifd);
+#endif
+    return NULL;
+}
+
+int uf_conf_watch_start(g15daemon_t *masterlist, char *filename, void (*changed)(g15daemon_t *masterlist))
+{
+    pthread_attr_t attr;
+
+    if(watch_running)
+        return 0;
+    watch_list = masterlist;
+    watch_changed = changed;
+    strncpy(watch_filename, filename, sizeof(watch_filename) - 1);
+    watch_save_msecs = config_save_msecs(masterlist);
+    watch_disk = config_new();
+    config_load(watch_disk, watch_filename);
+    if(uf_mailbox_init(&watch_exit) < 0) {
+        config_free(watch_disk);
+        return -1;
+    }
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr,128*1024);
+    if(pthread_create(&watch_thread, &attr, config_watch_thread, NULL) != 0) {
+        g15daemon_log(LOG_WARNING,"Unable to create config watch thread.");
+        uf_mailbox_close(&watch_exit);
+        config_free(watch_disk);
+        pthread_attr_destroy(&attr);
+        return -1;
+    }
+    pthread_attr_destroy(&attr);
+    watch_running = 1;
+    return 0;
+}
+
+void uf_conf_watch_exit()
+{
+    if(!watch_running)
+        return;
+    uf_mailbox_post(&watch_exit);
+    pthread_join(watch_thread, NULL);
+    uf_mailbox_close(&watch_exit);
+    config_free(watch_disk);
+    watch_running = 0;
+}
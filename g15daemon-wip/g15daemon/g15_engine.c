@@ -0,0 +1,557 @@
+/*
+    This file is part of g15daemon.
+
+    g15daemon is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    g15daemon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with g15daemon; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+    (c) 2006-2008 Mike Lampard, Philip Lawatsch, and others
+
+    $Revision$ -  $Date$ $Author$
+
+    This daemon listens on localhost port 15550 for client connections,
+    and arbitrates LCD display.  Allows for multiple simultaneous clients.
+    Client screens can be cycled through by pressing the 'L1' key.
+
+    g15_engine.c
+    plugin execution engine.  instead of a thread apiece, plugins are run by a small pool of worker threads,
+    no larger than the number of cpu cores.  a hierarchical timer wheel, turned by a thread of its own, hands
+    a plugin to the pool when its next run is due, and an event arriving on a plugin's ring hands it over
+    straight away.  a plugin is only ever run by one worker at a time, so plugins written for a thread of
+    their own run unchanged.
+*/
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <config.h>
+#include "g15daemon.h"
+
+extern volatile int leaving;
+
+/* four levels of 64 slots, turning once a millisecond, span 2^24ms (4.6 hours).  anything due later
+   than that waits in the top level, and is looked at again each time its slot comes round */
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4
+#define WHEEL_SPAN (1ULL << (WHEEL_BITS * WHEEL_LEVELS))
+#define WHEEL_TICK G15_NSEC_PER_MSEC
+#define WHEEL_NEVER (~0ULL)
+
+#define ENGINE_MAX_WORKERS 16
+
+typedef struct engine_task_s engine_task_t;
+
+typedef struct engine_task_s
+{
+    plugin_t *plugin;
+    /* passed to the plugin's functions - the screen for lcd clients, else the masterlist */
+    void *arg;
+    /* the ring the plugin's events arrive on, or NULL, and the keyboard it belongs to */
+    g15_evring_t *events;
+    g15daemon_t *list;
+    /* link in the timer wheel, and the tick at which the next run is due */
+    engine_task_t *wheel_next;
+    engine_task_t **wheel_pprev;
+    unsigned long long expires;
+    /* runs are due at a fixed period from here (ns), however long each takes */
+    unsigned long long next_run;
+    engine_task_t *queue_next;
+    engine_task_t *all_next;
+    /* changed only with engine_mutex held */
+    int queued;
+    int running;
+    int due;
+    int kicked;
+    /* set by uf_engine_remove() - the task is finished on its next run */
+    int stopping;
+    /* set once plugin_init has succeeded, so plugin_exit is owed */
+    int started;
+} engine_task_t;
+
+static pthread_mutex_t engine_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t engine_cond = PTHREAD_COND_INITIALIZER;
+static g15_mailbox_t engine_wake;
+static pthread_t engine_timer;
+static pthread_t engine_workers[ENGINE_MAX_WORKERS];
+static unsigned int engine_max_workers = 0;
+static unsigned int engine_nworkers = 0;
+static int engine_running = 0;
+static volatile int engine_stop = 0;
+
+/* everything below is protected by engine_mutex */
+static engine_task_t *wheel[WHEEL_LEVELS][WHEEL_SIZE];
+/* the next tick to be processed */
+static unsigned long long wheel_now = 0;
+/* the tick the timer thread is sleeping until */
+static unsigned long long wheel_sleep = WHEEL_NEVER;
+static engine_task_t *queue_head = NULL;
+static engine_task_t *queue_tail = NULL;
+static engine_task_t *engine_tasks = NULL;
+static unsigned int engine_ntasks = 0;
+static unsigned long engine_runs = 0;
+static g15_histogram_t engine_late;
+
+/* plugins are run on a fixed cadence, so the time a run takes doesn't push the next one back.  a plugin
+   which overruns its period starts again straight away rather than trying to catch up */
+unsigned long long uf_plugin_next_run(unsigned long long last_run, unsigned int msecs)
+{
+    unsigned long long now = g15daemon_time_ns();
+
+    last_run += msecs * G15_NSEC_PER_MSEC;
+    return last_run < now ? now : last_run;
+}
+
+static void wheel_insert(engine_task_t *task)
+{
+    unsigned long long expires = task->expires, delta;
+    engine_task_t **slot;
+    int level;
+
+    if(expires < wheel_now)
+        expires = wheel_now;
+    delta = expires - wheel_now;
+    if(delta >= WHEEL_SPAN) {
+        delta = WHEEL_SPAN - 1;
+        expires = wheel_now + delta;
+    }
+    for(level = 0; level < WHEEL_LEVELS - 1; level++)
+        if(delta < 1ULL << (WHEEL_BITS * (level + 1)))
+            break;
+    slot = &wheel[level][(expires >> (WHEEL_BITS * level)) & WHEEL_MASK];
+
+    task->wheel_next = *slot;
+    if(*slot)
+        (*slot)->wheel_pprev = &task->wheel_next;
+    task->wheel_pprev = slot;
+    *slot = task;
+}
+
+static void wheel_remove(engine_task_t *task)
+{
+    if(task->wheel_pprev == NULL)
+        return;
+    *task->wheel_pprev = task->wheel_next;
+    if(task->wheel_next)
+        task->wheel_next->wheel_pprev = task->wheel_pprev;
+    task->wheel_next = NULL;
+    task->wheel_pprev = NULL;
+}
+
+/* take every task out of a slot, calling 'func' on each */
+static void wheel_empty_slot(engine_task_t **slot, void (*func)(engine_task_t *task))
+{
+    engine_task_t *task = *slot, *next;
+
+    *slot = NULL;
+    for(; task; task = next) {
+        next = task->wheel_next;
+        task->wheel_next = NULL;
+        task->wheel_pprev = NULL;
+        func(task);
+    }
+}
+
+static void task_queue(engine_task_t *task)
+{
+    if(task->queued || task->running)
+        return;
+    task->queued = 1;
+    task->queue_next = NULL;
+    if(queue_tail)
+        queue_tail->queue_next = task;
+    else
+        queue_head = task;
+    queue_tail = task;
+    pthread_cond_signal(&engine_cond);
+}
+
+static void task_expire(engine_task_t *task)
+{
+    /* a task is only in level 0 if it is due this time round, but be sure */
+    if(task->expires > wheel_now) {
+        wheel_insert(task);
+        return;
+    }
+    task->due = 1;
+    task_queue(task);
+}
+
+/* process each tick up to and including 'tick', handing any tasks due to the workers.  the slots of
+   the higher levels are spread out over the levels below each time the level below wraps */
+static void wheel_advance(unsigned long long tick)
+{
+    int level;
+
+    while(wheel_now <= tick) {
+        for(level = 1; level < WHEEL_LEVELS; level++) {
+            if(wheel_now & ((1ULL << (WHEEL_BITS * level)) - 1))
+                break;
+            wheel_empty_slot(&wheel[level][(wheel_now >> (WHEEL_BITS * level)) & WHEEL_MASK], wheel_insert);
+        }
+        wheel_empty_slot(&wheel[0][wheel_now & WHEEL_MASK], task_expire);
+        wheel_now++;
+    }
+}
+
+/* the next tick at which the wheel has anything to do - either a task falls due, or a slot of a higher
+   level is to be spread out.  a slot is spread out when the wheel reaches the start of its block, so
+   the current block of each level has already been dealt with unless the wheel is at its very start */
+static unsigned long long wheel_next()
+{
+    unsigned long long next = WHEEL_NEVER, block, tick;
+    int level, shift, i, first;
+
+    for(level = 0; level < WHEEL_LEVELS; level++) {
+        shift = WHEEL_BITS * level;
+        block = wheel_now >> shift;
+        first = (wheel_now & ((1ULL << shift) - 1)) ? 1 : 0;
+        for(i = first; i < first + WHEEL_SIZE; i++) {
+            if(wheel[level][(block + i) & WHEEL_MASK]) {
+                tick = (block + i) << shift;
+                if(tick < next)
+                    next = tick;
+                break;
+            }
+        }
+    }
+    return next;
+}
+
+static void task_arm(engine_task_t *task)
+{
+    /* round up - a run may start a little late, but never early */
+    task->expires = (task->next_run + WHEEL_TICK - 1) / WHEEL_TICK;
+    wheel_insert(task);
+    if(task->expires < wheel_sleep)
+        uf_mailbox_post(&engine_wake);
+}
+
+static void *engine_timer_thread(void *arg)
+{
+    unsigned long long now, next;
+
+    pthread_mutex_lock(&engine_mutex);
+    while(!engine_stop) {
+        now = g15daemon_time_ns();
+        wheel_advance(now / WHEEL_TICK);
+        wheel_sleep = next = wheel_next();
+        pthread_mutex_unlock(&engine_mutex);
+
+        if(next == WHEEL_NEVER)
+            uf_mailbox_wait(&engine_wake, -1);
+        else if(next * WHEEL_TICK > now) {
+            /* poll() only counts whole milliseconds - sleep out the remainder */
+            if(next * WHEEL_TICK - now < G15_NSEC_PER_MSEC)
+                g15daemon_sleep_until_ns(next * WHEEL_TICK);
+            else
+                uf_mailbox_wait(&engine_wake, (next * WHEEL_TICK - now) / G15_NSEC_PER_MSEC);
+        }
+
+        pthread_mutex_lock(&engine_mutex);
+    }
+    pthread_mutex_unlock(&engine_mutex);
+    return NULL;
+}
+
+/* called by the keyboard thread when it publishes an event to the task's ring */
+static void engine_kick(void *arg)
+{
+    engine_task_t *task = (engine_task_t*)arg;
+
+    pthread_mutex_lock(&engine_mutex);
+    task->kicked = 1;
+    task_queue(task);
+    pthread_mutex_unlock(&engine_mutex);
+}
+
+static void task_unsubscribe(engine_task_t *task)
+{
+    if(task->events == NULL)
+        return;
+    pthread_mutex_lock(&task->list->lcdlist_mutex);
+    uf_evring_unsubscribe(task->events);
+    pthread_mutex_unlock(&task->list->lcdlist_mutex);
+}
+
+static void task_exit(engine_task_t *task)
+{
+    void (*plugin_exit)(void *args) = (void*)task->plugin->info->plugin_exit;
+
+    if(task->started && plugin_exit)
+        (*plugin_exit)(task->arg);
+    task->started = 0;
+}
+
+/* run the task's events, and then, if it is due, the plugin.  returns -1 if the plugin has finished */
+static int task_run(engine_task_t *task, int due)
+{
+    plugin_info_t *info = task->plugin->info;
+    int (*plugin_init)(void *args) = (void*)info->plugin_init;
+    int (*plugin_run)(void *args) = (void*)info->plugin_run;
+    int lcd_client = task->plugin->type == G15_PLUGIN_LCD_CLIENT;
+    int retval = G15_PLUGIN_OK;
+
+    if(task->next_run == 0) {
+        task->next_run = g15daemon_time_ns();
+        if(plugin_init)
+            retval = (*plugin_init)(task->arg);
+        /* advanced plugins which fail to start have nothing to clean up, screens always do */
+        if(retval != G15_PLUGIN_OK && !lcd_client)
+            return -1;
+        task->started = 1;
+        if(retval == G15_PLUGIN_QUIT)
+            return -1;
+    }
+
+    if(task->events && task->events->subscribed)
+        uf_evring_dispatch(task->events);
+
+    if(due && plugin_run) {
+        retval = (*plugin_run)(task->arg);
+        if(lcd_client ? retval == G15_PLUGIN_QUIT : retval != G15_PLUGIN_OK)
+            return -1;
+    }
+    return 0;
+}
+
+/* the plugin has quit of its own accord - take it down as its own thread would have */
+static void task_finish(engine_task_t *task)
+{
+    plugin_t *plugin = task->plugin;
+    void *handle = plugin->plugin_handle;
+    char *name = plugin->info->name;
+
+    task_unsubscribe(task);
+    task_exit(task);
+    if(plugin->type == G15_PLUGIN_LCD_CLIENT && !leaving)
+        g15daemon_lcdnode_remove((lcdnode_t*)plugin->args);
+    g15daemon_log(LOG_INFO,"Removed plugin %s",name);
+    g15daemon_dlclose_plugin(handle);
+    free(plugin);
+    free(task);
+}
+
+static void task_forget(engine_task_t *task)
+{
+    engine_task_t **t;
+
+    for(t = &engine_tasks; *t; t = &(*t)->all_next)
+        if(*t == task) {
+            *t = task->all_next;
+            engine_ntasks--;
+            break;
+        }
+}
+
+static void *engine_worker_thread(void *arg)
+{
+    engine_task_t *task;
+    unsigned long long start;
+    int due, stopping;
+
+    pthread_mutex_lock(&engine_mutex);
+    while(!engine_stop) {
+        if((task = queue_head) == NULL) {
+            pthread_cond_wait(&engine_cond, &engine_mutex);
+            continue;
+        }
+        if((queue_head = task->queue_next) == NULL)
+            queue_tail = NULL;
+        task->queued = 0;
+        task->running = 1;
+        due = task->due;
+        stopping = task->stopping;
+        task->due = task->kicked = 0;
+        pthread_mutex_unlock(&engine_mutex);
+
+        start = g15daemon_time_ns();
+        if(stopping || task_run(task, due) < 0) {
+            pthread_mutex_lock(&engine_mutex);
+            wheel_remove(task);
+            task_forget(task);
+            pthread_mutex_unlock(&engine_mutex);
+            task_finish(task);
+            pthread_mutex_lock(&engine_mutex);
+            continue;
+        }
+
+        pthread_mutex_lock(&engine_mutex);
+        task->running = 0;
+        if(due && task->plugin->info->plugin_run) {
+            plugin_info_t *info = task->plugin->info;
+
+            engine_runs++;
+            uf_hist_record(&engine_late, start > task->next_run ? (start - task->next_run) / 1000 : 0);
+            if(info->update_msecs < 50)
+                info->update_msecs = 50;
+            task->next_run = uf_plugin_next_run(task->next_run, info->update_msecs);
+            task_arm(task);
+        }
+        if(task->due || task->kicked || task->stopping)
+            task_queue(task);
+    }
+    pthread_mutex_unlock(&engine_mutex);
+    return NULL;
+}
+
+int uf_engine_start(unsigned int workers)
+{
+    pthread_attr_t attr;
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if(engine_running)
+        return 0;
+    if(workers == 0)
+        workers = cores > 0 ? cores : 1;
+    if(workers > ENGINE_MAX_WORKERS)
+        workers = ENGINE_MAX_WORKERS;
+    engine_max_workers = workers;
+
+    if(uf_mailbox_init(&engine_wake) < 0)
+        return -1;
+    wheel_now = g15daemon_time_ns() / WHEEL_TICK;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr,64*1024);
+    if(pthread_create(&engine_timer, &attr, engine_timer_thread, NULL) != 0) {
+        g15daemon_log(LOG_ERR,"Unable to create plugin timer thread.");
+        uf_mailbox_close(&engine_wake);
+        pthread_attr_destroy(&attr);
+        return -1;
+    }
+    pthread_attr_destroy(&attr);
+    engine_running = 1;
+    return 0;
+}
+
+/* workers are started as plugins are added, so a daemon with one plugin has one worker */
+static void engine_grow()
+{
+    pthread_attr_t attr;
+
+    if(engine_nworkers >= engine_max_workers || engine_nworkers >= engine_ntasks)
+        return;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr,64*1024); /* plugins were always run on a 64k stack */
+    if(pthread_create(&engine_workers[engine_nworkers], &attr, engine_worker_thread, NULL) != 0)
+        g15daemon_log(LOG_ERR,"Unable to create plugin worker thread.");
+    else
+        engine_nworkers++;
+    pthread_attr_destroy(&attr);
+}
+
+int uf_engine_add(plugin_t *plugin)
+{
+    plugin_info_t *info = plugin->info;
+    engine_task_t *task;
+
+    if(!engine_running)
+        return -1;
+
+    task = g15daemon_xmalloc(sizeof(engine_task_t));
+    task->plugin = plugin;
+    if(plugin->type == G15_PLUGIN_LCD_CLIENT) {
+        lcd_t *lcd = ((lcdnode_t*)plugin->args)->lcd;
+
+        task->arg = lcd;
+        task->list = lcd->masterlist;
+        if(info->event_handler)
+            task->events = lcd->events;
+    } else {
+        g15daemon_t *masterlist = (g15daemon_t*)plugin->args;
+
+        task->arg = masterlist;
+        task->list = masterlist;
+        if(info->event_handler && plugin->type == G15_PLUGIN_CORE_OS_KB)
+            task->events = &masterlist->kb_events;
+    }
+    /* events are handled on whichever worker runs the plugin next */
+    if(task->events)
+        uf_evring_subscribe_notify(task->list, task->events, info->event_handler, engine_kick, task);
+
+    pthread_mutex_lock(&engine_mutex);
+    task->all_next = engine_tasks;
+    engine_tasks = task;
+    engine_ntasks++;
+    engine_grow();
+    /* the first run initialises the plugin, and runs it straight away */
+    task->due = info->plugin_run != NULL;
+    task_queue(task);
+    pthread_mutex_unlock(&engine_mutex);
+
+    g15daemon_log(LOG_INFO,"Running plugin \"%s\" on the worker pool\n",info->name);
+    return 0;
+}
+
+int uf_engine_remove(char *name)
+{
+    engine_task_t *task;
+
+    pthread_mutex_lock(&engine_mutex);
+    for(task = engine_tasks; task; task = task->all_next)
+        if(!task->stopping && strcmp(task->plugin->info->name, name) == 0)
+            break;
+    if(task) {
+        task->stopping = 1;
+        task_queue(task);
+    }
+    pthread_mutex_unlock(&engine_mutex);
+    return task ? 0 : -1;
+}
+
+void uf_engine_exit()
+{
+    engine_task_t *task;
+    unsigned int i;
+
+    if(!engine_running)
+        return;
+
+    pthread_mutex_lock(&engine_mutex);
+    engine_stop = 1;
+    pthread_cond_broadcast(&engine_cond);
+    pthread_mutex_unlock(&engine_mutex);
+    uf_mailbox_post(&engine_wake);
+
+    /* workers finish the run they are in the middle of */
+    pthread_join(engine_timer, NULL);
+    for(i = 0; i < engine_nworkers; i++)
+        pthread_join(engine_workers[i], NULL);
+
+    while((task = engine_tasks) != NULL) {
+        engine_tasks = task->all_next;
+        task_unsubscribe(task);
+        task_exit(task);
+        g15daemon_log(LOG_INFO,"Removed plugin %s",task->plugin->info->name);
+        /* screens stay on the list until it is destroyed, so the plugin itself stays loaded */
+        free(task->plugin);
+        free(task);
+    }
+    engine_ntasks = 0;
+    uf_mailbox_close(&engine_wake);
+    engine_running = 0;
+}
+
+g15_histogram_t *uf_engine_stats(unsigned int *workers, unsigned int *plugins, unsigned long *runs)
+{
+    pthread_mutex_lock(&engine_mutex);
+    *workers = engine_nworkers;
+    *plugins = engine_ntasks;
+    *runs = engine_runs;
+    pthread_mutex_unlock(&engine_mutex);
+    return &engine_late;
+}
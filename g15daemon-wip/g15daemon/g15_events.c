@@ -0,0 +1,187 @@
+/*
+    This file is part of g15daemon.
+
+    g15daemon is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    g15daemon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with g15daemon; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+    (c) 2006-2008 Mike Lampard, Philip Lawatsch, and others
+
+    $Revision$ -  $Date$ $Author$
+
+    This daemon listens on localhost port 15550 for client connections,
+    and arbitrates LCD display.  Allows for multiple simultaneous clients.
+    Client screens can be cycled through by pressing the 'L1' key.
+
+    g15_events.c
+    event delivery.  every subscriber (a screen's plugin or net client, or the OS keyboard handler) has a
+    preallocated ring of events which it drains on its own thread.  the keyboard thread only copies the
+    event into each ring and posts the subscriber's mailbox (or hands a pooled plugin to a worker), so it
+    never allocates, and never waits for a plugin or a client socket.
+*/
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <config.h>
+#include "g15daemon.h"
+
+extern volatile int leaving;
+
+int uf_evring_subscribe(g15daemon_t *masterlist, g15_evring_t *ring, void *handler)
+{
+    if(ring->subscribed)
+        return ring->wake.fd[0];
+    if(uf_mailbox_init(&ring->wake) < 0)
+        return -1;
+    ring->handler = handler;
+    ring->notify = NULL;
+    /* anything published before now went straight to the handler */
+    ring->tail = ring->head;
+    pthread_mutex_lock(&masterlist->lcdlist_mutex);
+    ring->subscribed = 1;
+    pthread_mutex_unlock(&masterlist->lcdlist_mutex);
+    return ring->wake.fd[0];
+}
+
+int uf_evring_subscribe_notify(g15daemon_t *masterlist, g15_evring_t *ring, void *handler, void (*notify)(void *arg), void *arg)
+{
+    if(ring->subscribed)
+        return -1;
+    ring->wake.fd[0] = ring->wake.fd[1] = -1;
+    ring->handler = handler;
+    ring->notify = notify;
+    ring->notify_arg = arg;
+    ring->tail = ring->head;
+    pthread_mutex_lock(&masterlist->lcdlist_mutex);
+    ring->subscribed = 1;
+    pthread_mutex_unlock(&masterlist->lcdlist_mutex);
+    return 0;
+}
+
+void uf_evring_unsubscribe(g15_evring_t *ring)
+{
+    if(!ring->subscribed)
+        return;
+    ring->subscribed = 0;
+    ring->notify = NULL;
+    uf_mailbox_close(&ring->wake);
+}
+
+int uf_evring_publish(g15_evring_t *ring, lcd_t *lcd, unsigned int event, unsigned long value, unsigned long long timestamp)
+{
+    unsigned int head = ring->head;
+    plugin_event_t *slot;
+
+    if(!ring->subscribed)
+        return -1;
+    if(head - ring->tail >= G15_EVENT_RING) {
+        ring->lost++;
+        return -1;
+    }
+    slot = &ring->events[head & (G15_EVENT_RING - 1)];
+    slot->event = event;
+    slot->value = value;
+    slot->lcd = lcd;
+    slot->timestamp = timestamp;
+    /* the slot must be filled before the subscriber can see it */
+    __sync_synchronize();
+    ring->head = head + 1;
+    if(ring->notify)
+        ring->notify(ring->notify_arg);
+    else
+        uf_mailbox_post(&ring->wake);
+    return 0;
+}
+
+void uf_event_broadcast(g15daemon_t *masterlist, unsigned int event, unsigned long value)
+{
+    unsigned long long now = uf_gettime_us();
+    lcdnode_t *node;
+
+    pthread_mutex_lock(&masterlist->lcdlist_mutex);
+    node = masterlist->tail;
+    do {
+        /* screens which don't drain a ring are called from the keyboard thread only, so are left out */
+        if(node->lcd->events)
+            uf_evring_publish(node->lcd->events, node->lcd, event, value, now);
+        node = node->next;
+    } while(node != masterlist->tail);
+    uf_evring_publish(&masterlist->kb_events, masterlist->tail->lcd, event, value, now);
+    pthread_mutex_unlock(&masterlist->lcdlist_mutex);
+}
+
+int uf_evring_dispatch(g15_evring_t *ring)
+{
+    int *(*handler)(plugin_event_t *event) = (void*)ring->handler;
+    unsigned int tail = ring->tail, head;
+    int handled = 0;
+
+    if(ring->wake.fd[0] >= 0)
+        uf_mailbox_take(&ring->wake);
+    head = ring->head;
+    __sync_synchronize();
+    while(tail != head) {
+        plugin_event_t *event = &ring->events[tail & (G15_EVENT_RING - 1)];
+
+        if(handler)
+            (*handler)(event);
+        if(event->event == G15_EVENT_KEYPRESS)
+            uf_hist_record(&ring->latency, uf_gettime_us() - event->timestamp);
+        /* done with the slot - hand it back to the producer */
+        __sync_synchronize();
+        ring->tail = ++tail;
+        handled++;
+    }
+    return handled;
+}
+
+void uf_evring_wait_until(g15_evring_t *ring, unsigned long long deadline)
+{
+    unsigned long long now;
+
+    while(!leaving && (now = g15daemon_time_ns()) < deadline) {
+        /* poll() only counts whole milliseconds - sleep out the remainder */
+        if(deadline - now < G15_NSEC_PER_MSEC) {
+            g15daemon_sleep_until_ns(deadline);
+            break;
+        }
+        if(uf_mailbox_wait(&ring->wake, (deadline - now) / G15_NSEC_PER_MSEC))
+            uf_evring_dispatch(ring);
+    }
+}
+
+int g15daemon_event_subscribe(lcd_t *lcd)
+{
+    if(lcd->g15plugin->info == NULL || lcd->events == NULL)
+        return -1;
+    return uf_evring_subscribe(lcd->masterlist, lcd->events, lcd->g15plugin->info->event_handler);
+}
+
+int g15daemon_event_dispatch(lcd_t *lcd)
+{
+    if(lcd->events == NULL || !lcd->events->subscribed)
+        return 0;
+    return uf_evring_dispatch(lcd->events);
+}
+
+void g15daemon_event_unsubscribe(lcd_t *lcd)
+{
+    /* the keyboard thread publishes with the lock held, so mustn't see the mailbox go */
+    pthread_mutex_lock(&lcd->masterlist->lcdlist_mutex);
+    if(lcd->events)
+        uf_evring_unsubscribe(lcd->events);
+    pthread_mutex_unlock(&lcd->masterlist->lcdlist_mutex);
+}
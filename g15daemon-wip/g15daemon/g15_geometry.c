@@ -0,0 +1,238 @@
+/*
+    This file is part of g15daemon.
+
+    g15daemon is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    g15daemon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with g15daemon; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+    
+    (c) 2006-2008 Mike Lampard, Philip Lawatsch, and others
+
+    $Revision$ -  $Date$ $Author$
+    
+    This daemon listens on localhost port 15550 for client connections,
+    and arbitrates LCD display.  Allows for multiple simultaneous clients.
+    Client screens can be cycled through by pressing the 'L1' key.
+    
+    g15_geometry.c
+    panel geometries, and the frame pipeline's kernels for each.  the panels are listed once, in
+    G15_GEOMETRIES, and every kernel is written once as an inline function taking the panel's sizes, then
+    built for each panel with those sizes as constants.  so the g15's 160x43 kernels compile to the same
+    code as when 160x43 was the only size there was, and adding a panel costs nothing on the others' path.
+
+    pixel packing converts 1 byte per pixel client buffers into the packed format, which stores pixel (x,y)
+    at bit 7-(n%8) of byte n/8, where n = y*width+x.  as every width is a multiple of 8 rows never share a
+    byte, so the whole frame can be packed as one linear run, 8 pixels to a byte, in memory order.
+    the blit kernels are built in g15_compositor.c.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <config.h>
+#include <g15daemon.h>
+
+#if defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)) && (defined(__x86_64__) || defined(__i386__))
+#define G15_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+#define G15_INLINE static inline __attribute__((always_inline))
+
+typedef void (*pack_func_t)(unsigned char *dst, const unsigned char *src);
+
+/* packed rows must not share bytes, a frame buffer must hold a packed frame, and only MONO panels are drawn */
+#define GEOMETRY_CHECK(id, name, width, height, format, bufsize) \
+    typedef char geometry_check_##id[(width) % 8 == 0 && (bufsize) >= (width) / 8 * (height) && \
+                                     (format) == G15_PIXFMT_MONO ? 1 : -1];
+G15_GEOMETRIES(GEOMETRY_CHECK)
+
+/* portable version - any non-zero source byte is a lit pixel */
+G15_INLINE void pack_scalar(unsigned char *dst, const unsigned char *src, unsigned int pixels)
+{
+    unsigned int i;
+
+    for(i = 0; i < pixels; i += 8, src += 8)
+        *dst++ = (src[0] ? 0x80 : 0) | (src[1] ? 0x40 : 0) | (src[2] ? 0x20 : 0) | (src[3] ? 0x10 : 0) |
+                 (src[4] ? 0x08 : 0) | (src[5] ? 0x04 : 0) | (src[6] ? 0x02 : 0) | (src[7] ? 0x01 : 0);
+}
+
+#ifdef G15_X86_SIMD
+/* movemask returns the first pixel in bit 0, the lcd wants it in bit 7 */
+static unsigned char bitrev[256];
+
+static void bitrev_init()
+{
+    unsigned int i, b;
+
+    for(i = 0; i < 256; i++) {
+        unsigned char r = 0;
+        for(b = 0; b < 8; b++)
+            if(i & (1 << b))
+                r |= 0x80 >> b;
+        bitrev[i] = r;
+    }
+}
+
+/* 16 pixels per step.  SSE2 has no byte shuffle, so bit order is fixed up with a table.  any pixels left
+   over are packed by the portable version */
+__attribute__((target("sse2")))
+G15_INLINE void pack_sse2(unsigned char *dst, const unsigned char *src, unsigned int pixels)
+{
+    const __m128i zero = _mm_setzero_si128();
+    unsigned int i, unlit;
+
+    for(i = 0; i + 16 <= pixels; i += 16, src += 16, dst += 2) {
+        unlit = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)src), zero));
+        dst[0] = bitrev[~unlit & 0xff];
+        dst[1] = bitrev[(~unlit >> 8) & 0xff];
+    }
+    pack_scalar(dst, src, pixels - i);
+}
+
+/* 32 pixels per step.  each group of 8 pixels is reversed before the movemask so the bits 
+   come out msb-first, and the 32bit mask is stored as-is (little-endian) */
+__attribute__((target("avx2")))
+G15_INLINE void pack_avx2(unsigned char *dst, const unsigned char *src, unsigned int pixels)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i reverse = _mm256_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+                                             7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+    unsigned int i, lit;
+    __m256i px;
+
+    for(i = 0; i + 32 <= pixels; i += 32, src += 32, dst += 4) {
+        px = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)src), reverse);
+        lit = ~(unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(px, zero));
+        dst[0] = lit;
+        dst[1] = lit >> 8;
+        dst[2] = lit >> 16;
+        dst[3] = lit >> 24;
+    }
+    pack_scalar(dst, src, pixels - i);
+}
+#endif
+
+/* compare a packed lcd buffer with the shadow of the last frame sent to the keyboard.  only the 'height'
+   visible rows are checked, the remainder of the buffer is never displayed */
+G15_INLINE int damage_rows(const unsigned char *shadow, const unsigned char *buf, int *first_row, int *last_row,
+                           const int rowbytes, const int height)
+{
+    int first, last;
+
+    if(memcmp(shadow, buf, height * rowbytes) == 0)
+        return 0;
+
+    for(first = 0; first < height; first++)
+        if(memcmp(shadow + first * rowbytes, buf + first * rowbytes, rowbytes) != 0)
+            break;
+    for(last = height - 1; last > first; last--)
+        if(memcmp(shadow + last * rowbytes, buf + last * rowbytes, rowbytes) != 0)
+            break;
+
+    if(first_row)
+        *first_row = first;
+    if(last_row)
+        *last_row = last;
+
+    return last - first + 1;
+}
+
+/* the kernels of each panel */
+#ifdef G15_X86_SIMD
+#define GEOMETRY_PACK_SIMD(id, width, height) \
+    __attribute__((target("sse2"))) static void pack_sse2_##id(unsigned char *dst, const unsigned char *src) \
+        { pack_sse2(dst, src, (width) * (height)); } \
+    __attribute__((target("avx2"))) static void pack_avx2_##id(unsigned char *dst, const unsigned char *src) \
+        { pack_avx2(dst, src, (width) * (height)); }
+#else
+#define GEOMETRY_PACK_SIMD(id, width, height)
+#endif
+#define GEOMETRY_KERNELS(id, name, width, height, format, bufsize) \
+    static void pack_scalar_##id(unsigned char *dst, const unsigned char *src) \
+        { pack_scalar(dst, src, (width) * (height)); } \
+    GEOMETRY_PACK_SIMD(id, width, height) \
+    static int damage_##id(const unsigned char *shadow, const unsigned char *buf, int *first_row, int *last_row) \
+        { return damage_rows(shadow, buf, first_row, last_row, (width) / 8, (height)); }
+G15_GEOMETRIES(GEOMETRY_KERNELS)
+
+#define GEOMETRY_ENTRY(id, name, width, height, format, bufsize) \
+    { name, width, height, format, (width) / 8, (width) / 8 * (height), bufsize, \
+      pack_scalar_##id, damage_##id, uf_blit_##id },
+static g15_geometry_t geometries[] = { G15_GEOMETRIES(GEOMETRY_ENTRY) };
+#define NGEOMETRIES (sizeof(geometries) / sizeof(g15_geometry_t))
+
+#ifdef G15_X86_SIMD
+#define GEOMETRY_PACKERS(id, name, width, height, format, bufsize) { pack_sse2_##id, pack_avx2_##id },
+static const pack_func_t simd_packers[][2] = { G15_GEOMETRIES(GEOMETRY_PACKERS) };
+#endif
+
+/* select the best packing kernels for this cpu */
+void uf_geometry_init()
+{
+    const char *name = "scalar";
+    unsigned int i;
+
+#ifdef G15_X86_SIMD
+    int simd = -1;
+
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) {
+        simd = 1;
+        name = "AVX2";
+    } else if(__builtin_cpu_supports("sse2")) {
+        bitrev_init();
+        simd = 0;
+        name = "SSE2";
+    }
+    if(simd >= 0)
+        for(i = 0; i < NGEOMETRIES; i++)
+            geometries[i].pack = simd_packers[i][simd];
+#endif
+    g15daemon_log(LOG_INFO, "Using %s pixel packing", name);
+    for(i = 0; i < NGEOMETRIES; i++)
+        G15_DEBUG("Panel %s: %ux%u, %u byte frames", geometries[i].name, geometries[i].width, geometries[i].height,
+                  geometries[i].bufsize);
+}
+
+const g15_geometry_t *uf_geometry_find(const char *name, size_t len)
+{
+    unsigned int i;
+
+    for(i = 0; i < NGEOMETRIES; i++)
+        if(strlen(geometries[i].name) == len && strncmp(geometries[i].name, name, len) == 0)
+            return &geometries[i];
+    return NULL;
+}
+
+const g15_geometry_t *uf_geometry_default()
+{
+    return &geometries[0];
+}
+
+/* list the panels known, on stdout, for --help */
+void uf_geometry_list()
+{
+    unsigned int i;
+
+    for(i = 0; i < NGEOMETRIES; i++)
+        printf("%s%s (%ux%u)", i ? ", " : "", geometries[i].name, geometries[i].width, geometries[i].height);
+}
+
+/* takes a width*height byte (1byte==1pixel) buffer and packs it into the format of the screen's panel. */
+void g15daemon_convert_buf(lcd_t *lcd, unsigned char * orig_buf)
+{
+    const g15_geometry_t *geometry = lcd->masterlist->geometry;
+
+    geometry->pack(lcd->buf, orig_buf);
+    /* any bytes past the packed frame are never shown */
+    memset(lcd->buf + geometry->framesize, 0, geometry->bufsize - geometry->framesize);
+}
@@ -0,0 +1,166 @@
+/*
+    This file is part of g15daemon.
+
+    g15daemon is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    g15daemon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with g15daemon; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+    (c) 2006-2008 Mike Lampard, Philip Lawatsch, and others
+
+    $Revision$ -  $Date$ $Author$
+
+    g15_geometry_test.c
+    checks every pixel packing kernel this cpu can run, for every panel, against the per-pixel loop
+    g15daemon_convert_buf() used before the kernels.  the whole frame buffer must match byte for byte,
+    padding included.  run by "make check".
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+
+/* the kernels are static, so are tested from within */
+#include "g15_geometry.c"
+
+int g15daemon_loglevel = LOG_WARNING;
+
+int g15daemon_log (int priority, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+    return 0;
+}
+
+/* the compositor isn't linked in */
+#define BLIT_STUB(id, name, width, height, format, bufsize) \
+void uf_blit_##id(unsigned char *screen, g15_layer_t *layer, int x0, int y0, int x1, int y1) {}
+G15_GEOMETRIES(BLIT_STUB)
+
+#define SCALAR_PACKER(id, name, width, height, format, bufsize) pack_scalar_##id,
+static const pack_func_t scalar_packers[] = { G15_GEOMETRIES(SCALAR_PACKER) };
+
+/* the loop g15daemon_convert_buf() was, for any panel.  the client buffer was packed into a frame cleared
+   beforehand, so bytes past the packed frame are 0 */
+static void convert_reference(const g15_geometry_t *geometry, unsigned char *buf, const unsigned char *orig_buf)
+{
+    unsigned int x, y, val;
+
+    memset(buf, 0, geometry->bufsize);
+    for(x = 0; x < geometry->width; x++)
+        for(y = 0; y < geometry->height; y++) {
+            unsigned int pixel_offset = y * geometry->width + x;
+            unsigned int byte_offset = pixel_offset / 8;
+            unsigned int bit_offset = 7 - (pixel_offset % 8);
+
+            val = orig_buf[x + (y * geometry->width)];
+
+            if (val)
+                buf[byte_offset] = buf[byte_offset] | 1 << bit_offset;
+            else
+                buf[byte_offset] = buf[byte_offset] & ~(1 << bit_offset);
+        }
+}
+
+enum {
+    INPUT_ZERO = 0,
+    INPUT_ONE,
+    INPUT_RANDOM,
+    INPUT_WIDE,
+    INPUTS
+};
+
+static const char *input_names[INPUTS] = { "all 0", "all 1", "random 0/1", "random 0-255" };
+
+static void make_input(unsigned char *pixels, unsigned int n, int input)
+{
+    unsigned int i;
+
+    for(i = 0; i < n; i++)
+        switch(input) {
+            case INPUT_ZERO:
+                pixels[i] = 0;
+                break;
+            case INPUT_ONE:
+                pixels[i] = 1;
+                break;
+            case INPUT_RANDOM:
+                pixels[i] = rand() & 1;
+                break;
+            case INPUT_WIDE:
+                /* high bits set, and values other than 0 & 1, with plenty of 0s still */
+                pixels[i] = rand() & 1 ? 0x80 | rand() : rand() & 0x7e;
+                break;
+        }
+}
+
+/* pack through g15daemon_convert_buf() with 'pack' in the panel's place, into a frame full of junk */
+static int check_kernel(g15daemon_t *masterlist, lcd_t *lcd, unsigned int g, pack_func_t pack, const char *kernel)
+{
+    static unsigned char pixels[G15_MAX_PIXELS], want[G15_MAX_BUFSIZE];
+    const g15_geometry_t *geometry = &geometries[g];
+    int input, failed = 0;
+    unsigned int i;
+
+    geometries[g].pack = pack;
+    masterlist->geometry = geometry;
+    for(input = 0; input < INPUTS; input++) {
+        make_input(pixels, geometry->width * geometry->height, input);
+        convert_reference(geometry, want, pixels);
+        memset(lcd->buf, 0xa5, G15_MAX_BUFSIZE);
+        g15daemon_convert_buf(lcd, pixels);
+        for(i = 0; i < geometry->bufsize; i++)
+            if(lcd->buf[i] != want[i])
+                break;
+        if(i < geometry->bufsize) {
+            printf("FAIL: %s %s, %s input: byte %u is %02x, should be %02x\n", geometry->name, kernel,
+                   input_names[input], i, lcd->buf[i], want[i]);
+            failed = 1;
+        }
+    }
+    if(!failed)
+        printf("ok: %s %s\n", geometry->name, kernel);
+    return failed;
+}
+
+int main(int argc, char *argv[])
+{
+    g15daemon_t *masterlist = calloc(1, sizeof(g15daemon_t));
+    lcd_t *lcd = calloc(1, sizeof(lcd_t));
+    unsigned int g;
+    int failed = 0;
+
+    lcd->masterlist = masterlist;
+    lcd->buf = malloc(G15_MAX_BUFSIZE);
+    srand(15550);
+#ifdef G15_X86_SIMD
+    __builtin_cpu_init();
+    bitrev_init();
+#endif
+    for(g = 0; g < NGEOMETRIES; g++) {
+        failed |= check_kernel(masterlist, lcd, g, scalar_packers[g], "scalar");
+#ifdef G15_X86_SIMD
+        if(__builtin_cpu_supports("sse2"))
+            failed |= check_kernel(masterlist, lcd, g, simd_packers[g][0], "SSE2");
+        if(__builtin_cpu_supports("avx2"))
+            failed |= check_kernel(masterlist, lcd, g, simd_packers[g][1], "AVX2");
+#endif
+    }
+    free(lcd->buf);
+    free(lcd);
+    free(masterlist);
+    return failed;
+}
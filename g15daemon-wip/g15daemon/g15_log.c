@@ -0,0 +1,201 @@
+/*
+    This file is part of g15daemon.
+
+    g15daemon is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    g15daemon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with g15daemon; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+    (c) 2006-2008 Mike Lampard, Philip Lawatsch, and others
+
+    $Revision$ -  $Date$ $Author$
+
+    This daemon listens on localhost port 15550 for client connections,
+    and arbitrates LCD display.  Allows for multiple simultaneous clients.
+    Client screens can be cycled through by pressing the 'L1' key.
+
+
+    g15_log.c
+    logging.  the G15_LOG macros in g15daemon.h skip disabled messages before their arguments are
+    evaluated.  enabled messages are formatted into a lock-free ring and written to syslog (or stderr
+    when debugging) by a writer thread, so the lcd, keyboard & client threads never wait on syslog.
+    messages arriving while the ring is full are counted and dropped.
+*/
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include <config.h>
+#include "g15daemon.h"
+
+extern unsigned int g15daemon_debug;
+
+/* longest message kept, and the number of messages which may be waiting.  must be a power of two */
+#define LOG_MSGLEN 256
+#define LOG_SLOTS 128
+
+int g15daemon_loglevel = LOG_WARNING;
+
+/* bounded multi-producer queue after Dmitry Vyukov.  a slot is free to the producer claiming position
+   'pos' when its seq is pos, and ready for the writer when its seq is pos+1 */
+typedef struct log_slot_s
+{
+    volatile unsigned long seq;
+    int priority;
+    char msg[LOG_MSGLEN];
+} log_slot_t;
+
+static log_slot_t slots[LOG_SLOTS];
+static volatile unsigned long enqueue_pos = 0;
+/* only touched by the writer */
+static unsigned long dequeue_pos = 0;
+static volatile unsigned long log_lost = 0;
+static g15_mailbox_t wake;
+static pthread_t log_thread;
+static volatile int log_running = 0;
+static volatile int log_stop = 0;
+
+static void log_write(int priority, const char *msg)
+{
+    if(g15daemon_debug == 0)
+        syslog(priority, "%s", msg);
+    else
+        fprintf(stderr, "%s\n", msg);
+}
+
+static void log_drain()
+{
+    static unsigned long reported = 0;
+    unsigned long lost;
+
+    for(;;) {
+        log_slot_t *slot = &slots[dequeue_pos & (LOG_SLOTS - 1)];
+
+        if((long)(slot->seq - (dequeue_pos + 1)) < 0)
+            break;
+        __sync_synchronize();
+        log_write(slot->priority, slot->msg);
+        __sync_synchronize();
+        slot->seq = dequeue_pos + LOG_SLOTS;
+        dequeue_pos++;
+    }
+    if((lost = log_lost) != reported) {
+        char msg[64];
+        snprintf(msg, sizeof(msg), "%lu log messages lost", lost - reported);
+        log_write(LOG_WARNING, msg);
+        reported = lost;
+    }
+}
+
+static void *log_writer_thread(void *arg)
+{
+    while(!log_stop) {
+        uf_mailbox_wait(&wake, -1);
+        log_drain();
+    }
+    return NULL;
+}
+
+void uf_log_init(unsigned int debug)
+{
+    int i;
+
+    switch(debug) {
+        case 0:
+        case 1:
+            g15daemon_loglevel = LOG_WARNING;
+            break;
+        case 2:
+            g15daemon_loglevel = LOG_INFO;
+            break;
+        default:
+            g15daemon_loglevel = LOG_DEBUG;
+    }
+    for(i = 0; i < LOG_SLOTS; i++)
+        slots[i].seq = i;
+}
+
+int uf_log_start()
+{
+    pthread_attr_t attr;
+
+    if(uf_mailbox_init(&wake) < 0)
+        return -1;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, 64 * 1024);
+    if(pthread_create(&log_thread, &attr, log_writer_thread, NULL) != 0) {
+        uf_mailbox_close(&wake);
+        return -1;
+    }
+    log_running = 1;
+    return 0;
+}
+
+void uf_log_exit()
+{
+    if(!log_running)
+        return;
+    /* anything logged from here on is written directly */
+    log_running = 0;
+    log_stop = 1;
+    uf_mailbox_post(&wake);
+    pthread_join(log_thread, NULL);
+    log_drain();
+    /* the mailbox is left open - a detached thread may still be posting a message it queued just now */
+}
+
+/* syslog wrapper */
+int g15daemon_log (int priority, const char *fmt, ...) {
+    va_list argp;
+    unsigned long pos, seq;
+    log_slot_t *slot;
+    char msg[LOG_MSGLEN];
+
+    if(priority > g15daemon_loglevel)
+        return 0;
+
+    va_start(argp, fmt);
+    if(!log_running) {
+        vsnprintf(msg, sizeof(msg), fmt, argp);
+        va_end(argp);
+        log_write(priority, msg);
+        return 0;
+    }
+
+    /* claim a slot, or give up if the writer has fallen a whole ring behind */
+    pos = enqueue_pos;
+    for(;;) {
+        slot = &slots[pos & (LOG_SLOTS - 1)];
+        seq = slot->seq;
+        if(seq == pos) {
+            unsigned long prev = __sync_val_compare_and_swap(&enqueue_pos, pos, pos + 1);
+            if(prev == pos)
+                break;
+            pos = prev;
+        } else if((long)(seq - pos) < 0) {
+            va_end(argp);
+            __sync_add_and_fetch(&log_lost, 1);
+            return 0;
+        } else
+            pos = enqueue_pos;
+    }
+    slot->priority = priority;
+    vsnprintf(slot->msg, LOG_MSGLEN, fmt, argp);
+    va_end(argp);
+    __sync_synchronize();
+    slot->seq = pos + 1;
+    uf_mailbox_post(&wake);
+    return 0;
+}
@@ -24,7 +24,8 @@
     Client screens can be cycled through by pressing the 'L1' key.
     
     g15_plugin.c
-    simple plugin loader - loads each plugin and runs each one in it's own thread. a bit expensive probably 
+    simple plugin loader - loads each plugin and hands it to the worker pool (see g15_engine.c), or runs it
+    in it's own thread if it needs one.
 */
 
 #include <pthread.h>
@@ -51,36 +52,24 @@ extern volatile int leaving;
 void * g15daemon_dlopen_plugin(char *name,unsigned int library) {
 
     void * handle;
-    char * error;
     static int deepbind = 0;
         
     int mode = library==1?RTLD_GLOBAL:RTLD_LOCAL;
 #ifdef RTLD_DEEPBIND
     mode|=RTLD_DEEPBIND; /* set ordering of symbols so plugin uses its
                             own symbols in preference to ours */
-    if(!deepbind)
+    if(__sync_bool_compare_and_swap(&deepbind,0,1))
       g15daemon_log(LOG_INFO,"G15Daemon Plugin_Loader - DEEPBIND Flag available.  Using it.\n");
-    deepbind=1;
 #endif
 
-    g15daemon_log(LOG_INFO,"PRELOADING %s",name);
+    g15daemon_log(LOG_INFO,"LOADING %s",name);
     /* remove any pending errors */
     dlerror();
 
-    handle = dlopen (name,RTLD_LAZY | mode | RTLD_NODELETE);
-    dlclose(handle);
-    dlerror();
-    
-    handle = dlopen (name,RTLD_NOW | mode | RTLD_NOLOAD);
-    
-    if(!handle) { /* FIXME: retry once more if load failed */
-      dlerror();
-      g15daemon_log(LOG_ERR, "Initialisation Failed.  Retrying..");
-      handle = dlopen (name, RTLD_LAZY | mode );
-    }
-
-    if ((error = dlerror()) != NULL)  {
-        g15daemon_log (LOG_ERR, "Plugin_Loader - Error loading %s - %s\n", name, error);
+    /* resolve every symbol now, so a plugin with missing symbols fails here rather than part way through a run */
+    handle = dlopen (name,RTLD_NOW | mode);
+    if (handle == NULL)  {
+        g15daemon_log (LOG_ERR, "Plugin_Loader - Error loading %s - %s\n", name, dlerror());
         return(NULL);
     }
     
@@ -108,17 +97,27 @@ void run_lcd_client(plugin_t *plugin_args) {
     
     lcdnode_t *display = (lcdnode_t*)plugin_args->args;
     lcd_t *client_lcd = (lcd_t*)display->lcd;
+    unsigned long long next_run;
     
     if(plugin_init!=NULL) {
         plugin_retval=(*plugin_init)((void*)client_lcd);
     }
 
+    /* keypresses for the screen are handled on this thread, between runs */
+    if(info->event_handler)
+        uf_evring_subscribe(client_lcd->masterlist, client_lcd->events, info->event_handler);
+
     /* run the plugin thread every 'update_msecs' milliseconds */
+    next_run = g15daemon_time_ns();
     while(!leaving && (plugin_retval!=G15_PLUGIN_QUIT)){
         plugin_retval = (*plugin)((void*)client_lcd);
         if(info->update_msecs<50)
             info->update_msecs = 50;
-        g15daemon_msleep(info->update_msecs);
+        next_run = uf_plugin_next_run(next_run, info->update_msecs);
+        if(client_lcd->events->subscribed)
+            uf_evring_wait_until(client_lcd->events, next_run);
+        else
+            g15daemon_sleep_until_ns(next_run);
     }
     
     if(plugin_close!=NULL){
@@ -136,6 +135,9 @@ void run_advanced_client(plugin_t *plugin_args)
     int (*plugin_init)(void *client_args) = (void*)plugin_args->info->plugin_init;
     int (*plugin_run)(void *client_args) = (void*)plugin_args->info->plugin_run;
     int (*plugin_close)(void *client_args) = (void*)plugin_args->info->plugin_exit;
+    g15daemon_t *masterlist = NULL;
+    g15_evring_t *kb_events = NULL;
+    unsigned long long next_run;
 
     /*initialise */
     if(plugin_init){
@@ -143,24 +145,38 @@ void run_advanced_client(plugin_t *plugin_args)
             return;
     }
 
+    /* the OS keyboard handler is fed keypresses on this thread */
     if(plugin_args->info->event_handler && plugin_args->type==G15_PLUGIN_CORE_OS_KB){
-        g15daemon_t *masterlist = (g15daemon_t*)plugin_args->args;
-        pthread_mutex_lock(&lcdlist_mutex);
-        (masterlist->keyboard_handler) = (void*)plugin_args->info->event_handler;
-        pthread_mutex_unlock(&lcdlist_mutex);
+        masterlist = (g15daemon_t*)plugin_args->args;
+        if(uf_evring_subscribe(masterlist, &masterlist->kb_events, plugin_args->info->event_handler) >= 0)
+            kb_events = &masterlist->kb_events;
     }
 
+    next_run = g15daemon_time_ns();
     if(plugin_run) {
         while(((*plugin_run)(plugin_args->args))==G15_PLUGIN_OK && !leaving){
             if(info->update_msecs<50)
                 info->update_msecs = 50;
-            g15daemon_msleep(info->update_msecs);
+            next_run = uf_plugin_next_run(next_run, info->update_msecs);
+            if(kb_events)
+                uf_evring_wait_until(kb_events, next_run);
+            else
+                g15daemon_sleep_until_ns(next_run);
         }
     }else{
         while(!leaving){
-            g15daemon_msleep(500);
+            next_run = uf_plugin_next_run(next_run, 500);
+            if(kb_events)
+                uf_evring_wait_until(kb_events, next_run);
+            else
+                g15daemon_sleep_until_ns(next_run);
         }
     }
+    if(kb_events) {
+        pthread_mutex_lock(&masterlist->lcdlist_mutex);
+        uf_evring_unsubscribe(kb_events);
+        pthread_mutex_unlock(&masterlist->lcdlist_mutex);
+    }
     if(plugin_close) {
         (*plugin_close)(plugin_args->args);
     }
@@ -195,160 +211,404 @@ void *plugin_thread(plugin_t *plugin_args) {
     return NULL;
 }
 
-int g15_count_plugins(char *plugin_directory) {
-    
-    DIR *directory;
-    struct dirent *ep;
-    char pluginname[2048];
-    int count=0;
-    
-    directory = opendir (plugin_directory);
-    if (directory != NULL)
-    {
-       while ((ep = readdir (directory))) {
-            if(strstr(ep->d_name,".so")){
-                strcpy(pluginname, plugin_directory);
-                strncat(pluginname,"/",1);
-                strncat(pluginname,ep->d_name,200);
-                ++count;
-            }
-        }
-        (void) closedir (directory);
-    }
-    else
-      count = -1;
-  
-    return count;  
-}
-
-int g15_plugin_load (g15daemon_t *masterlist, char *filename) {
+/* start a plugin which has been loaded and is enabled.  returns 1 if it is run by the worker pool, or -1 if
+   it couldn't be started */
+static int g15_plugin_start (g15daemon_t *masterlist, void *plugin_handle, plugin_info_t *info) {
 
-    void * plugin_handle = NULL;
-    config_section_t *plugin_cfg = g15daemon_cfg_load_section(masterlist,"PLUGINS");
-    
+    config_section_t *thread_cfg = g15daemon_cfg_load_section(masterlist,"PLUGIN_THREADS");
+    config_section_t *device_cfg = g15daemon_cfg_load_section(masterlist,"PLUGIN_DEVICES");
+    plugin_t  *plugin_args=malloc(sizeof(plugin_t));
     pthread_t client_connection;
     pthread_attr_t attr;
     lcdnode_t *clientnode;
-    char *error_str;
-    
-    if((plugin_handle = g15daemon_dlopen_plugin(filename,G15_PLUGIN_NONSHARED))!=NULL) {
-        plugin_t  *plugin_args=malloc(sizeof(plugin_t));
-        plugin_args->info = dlsym(plugin_handle, "g15plugin_info");
-
-        error_str=dlerror();
-          
-        if(error_str!=NULL)
-          g15daemon_log(LOG_ERR,"g15_plugin_load: %s %s\n",filename,error_str);
-
-        if(!plugin_args->info) { /* if it doesnt have a valid struct, we should just load it as a library... but we dont at the moment FIXME */
-            g15daemon_log(LOG_ERR,"%s is not a valid g15daemon plugin.  Unloading\n",filename);
-            g15daemon_dlclose_plugin(plugin_handle);
-            dlerror();
-            return -1;
-        }
-        
-        if(strncasecmp("Load",g15daemon_cfg_read_string(plugin_cfg, plugin_args->info->name,"Load"),5)!=0)
-        {
-        
-            g15daemon_log(LOG_ERR, "\"%s\" Plugin disabled in g15daemon.conf - not running\n",plugin_args->info->name);
-            g15daemon_dlclose_plugin(plugin_handle);
-            return -1;
-        } 	
+    g15daemon_t *device;
+
+    plugin_args->info = info;
+    g15daemon_log(LOG_WARNING, "Booting plugin \"%s\"",plugin_args->info->name);
 
-        g15daemon_log(LOG_WARNING, "Booting plugin \"%s\"",plugin_args->info->name);
+    /* plugins run on the first keyboard unless [PLUGIN_DEVICES] puts them on another */
+    device = g15daemon_device(masterlist, g15daemon_cfg_read_int(device_cfg, info->name, 0));
+    if(device == NULL) {
+        g15daemon_log(LOG_WARNING, "Plugin \"%s\" is set to run on a keyboard which isn't there.  Using the first", info->name);
+        device = masterlist;
+    }
+    masterlist = device;
+    /* screen plugins draw with libg15render, for the g15's own panel only */
+    if(info->type == G15_PLUGIN_LCD_CLIENT && masterlist->geometry != uf_geometry_default()) {
+        g15daemon_log(LOG_WARNING, "Plugin \"%s\" draws for a %ix%i lcd, and keyboard %u has a %s panel.  Not starting it",
+                      info->name, LCD_WIDTH, LCD_HEIGHT, masterlist->devno, masterlist->geometry->name);
+        free(plugin_args);
+        return -1;
+    }
 
-        plugin_args->type = plugin_args->info->type;
-        /* assign the generic eventhandler if the plugin doesnt provide one - the generic one does nothing atm. FIXME*/
-        if(plugin_args->info->event_handler==NULL)
-            plugin_args->info->event_handler = (void*)internal_generic_eventhandler;
+    plugin_args->type = plugin_args->info->type;
+    /* assign the generic eventhandler if the plugin doesnt provide one - the generic one does nothing atm. FIXME*/
+    if(plugin_args->info->event_handler==NULL)
+        plugin_args->info->event_handler = (void*)internal_generic_eventhandler;
         
     
-        if(plugin_args->type == G15_PLUGIN_LCD_CLIENT) {
-            //g15daemon_t *foolist = (g15daemon_t*)*masterlist;
-            clientnode = g15daemon_lcdnode_add(&masterlist);
+    if(plugin_args->type == G15_PLUGIN_LCD_CLIENT) {
+        //g15daemon_t *foolist = (g15daemon_t*)*masterlist;
+        if((clientnode = g15daemon_lcdnode_add(&masterlist)) == NULL) {
+            free(plugin_args);
+            return -1;
+        }
+        uf_lcd_config_fps(clientnode->lcd, plugin_args->info->name);
             
-            plugin_args->plugin_handle = plugin_handle;
-            memcpy(clientnode->lcd->g15plugin,plugin_args,sizeof(plugin_s));
-            plugin_args->args = clientnode;
-        } else if(plugin_args->type == G15_PLUGIN_CORE_OS_KB || 
-                  plugin_args->type == G15_PLUGIN_CORE_KB_INPUT ||
-                          plugin_args->type == G15_PLUGIN_LCD_SERVER) 
-                  {
-                      plugin_args->args = masterlist;
-                      plugin_args->plugin_handle = plugin_handle;
-                  }
-
-                  memset(&attr,0,sizeof(pthread_attr_t));
-                  pthread_attr_init(&attr);
-                  pthread_attr_setdetachstate(&attr,PTHREAD_CREATE_DETACHED);
-                  pthread_attr_setstacksize(&attr,64*1024); /* set stack to 64k - dont need 8Mb */
-                  if (pthread_create(&client_connection, &attr, (void*)plugin_thread, plugin_args) != 0) {
-                      g15daemon_log(LOG_ERR,"Unable to create client thread.");
-                  } else {
-                      pthread_detach(client_connection);
-                  }
+        plugin_args->plugin_handle = plugin_handle;
+        memcpy(clientnode->lcd->g15plugin,plugin_args,sizeof(plugin_s));
+        plugin_args->args = clientnode;
+    } else if(plugin_args->type == G15_PLUGIN_CORE_OS_KB || 
+              plugin_args->type == G15_PLUGIN_CORE_KB_INPUT ||
+              plugin_args->type == G15_PLUGIN_LCD_SERVER) 
+    {
+        plugin_args->args = masterlist;
+        plugin_args->plugin_handle = plugin_handle;
+    }
+
+    /* plugins share the worker pool unless given a thread of their own in [PLUGIN_THREADS].
+       the LCDServer never returns from its run function, so always has one */
+    if((plugin_args->type == G15_PLUGIN_LCD_CLIENT || plugin_args->type == G15_PLUGIN_CORE_OS_KB) &&
+       !g15daemon_cfg_read_bool(thread_cfg, plugin_args->info->name, 0) &&
+       uf_engine_add(plugin_args) == 0) {
+        g15daemon_log(LOG_ERR,"Plugin \"%s\" boot successful.",plugin_args->info->name);
+        return 1;
+    }
+
+    memset(&attr,0,sizeof(pthread_attr_t));
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr,PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&attr,64*1024); /* set stack to 64k - dont need 8Mb */
+    if (pthread_create(&client_connection, &attr, (void*)plugin_thread, plugin_args) != 0) {
+        g15daemon_log(LOG_ERR,"Unable to create client thread.");
+    } else {
+        pthread_detach(client_connection);
     }
     return 0;
 }
 
+typedef struct plugin_file_s
+{
+    char path[1024];
+    /* offset of the file name in path */
+    int name;
+    time_t mtime;
+    /* position in [PLUGIN_LOAD_ORDER], or after everything named there in the order found */
+    int order;
+    /* once started, the plugin's name, and whether it can be stopped again */
+    char plugin[128];
+    int pooled;
+} plugin_file_t;
+
+/* the plugins started so far, in order.  a config reload only starts the ones enabled since */
+static pthread_mutex_t plugins_mutex = PTHREAD_MUTEX_INITIALIZER;
+static plugin_file_t *running = NULL;
+static int nrunning = 0;
+
+static int plugin_running(char *path)
+{
+    int i;
+
+    for(i = 0; i < nrunning; i++)
+        if(strcmp(running[i].path, path) == 0)
+            return 1;
+    return 0;
+}
+
+static int plugin_file_cmp(const void *a, const void *b)
+{
+    return ((plugin_file_t*)a)->order - ((plugin_file_t*)b)->order;
+}
 
-int g15_open_all_plugins(g15daemon_t *masterlist, char *plugin_directory) {
+/* the manifest caches what each plugin file turned out to be.  while the file is unchanged, a file which
+   isn't a plugin, or is a plugin which has been disabled, is never opened.  it is kept in a file of its own
+   (G15_PLUGIN_MANIFEST), a line per plugin file of "path<tab>mtime<tab>type<tab>name", with a type of "-"
+   if the file isn't a plugin at all.  only used with plugins_mutex held */
+typedef struct plugin_cached_s
+{
+    char path[1024];
+    time_t mtime;
+    int type;
+    char name[128];
+    /* found by a scan of the plugin directory.  only files which were are written back */
+    int seen;
+} plugin_cached_t;
+
+static plugin_cached_t *manifest = NULL;
+static int nmanifest = 0;
+static int manifest_loaded = 0;
+static int manifest_dirty = 0;
+
+static plugin_cached_t *plugin_manifest_find(char *path)
+{
+    int i;
+
+    for(i = 0; i < nmanifest; i++)
+        if(strcmp(manifest[i].path, path) == 0)
+            return &manifest[i];
+    return NULL;
+}
+
+static plugin_cached_t *plugin_manifest_add(char *path)
+{
+    plugin_cached_t *entry = plugin_manifest_find(path);
+
+    if(entry)
+        return entry;
+    manifest = realloc(manifest, (nmanifest + 1) * sizeof(plugin_cached_t));
+    entry = &manifest[nmanifest++];
+    memset(entry, 0, sizeof(plugin_cached_t));
+    strncpy(entry->path, path, sizeof(entry->path) - 1);
+    return entry;
+}
+
+static void plugin_manifest_load()
+{
+    char line[1400], *path, *mtime, *type, *name, *save = NULL;
+    plugin_cached_t *entry;
+    FILE *f;
+
+    manifest_loaded = 1;
+    if((f = fopen(G15_PLUGIN_MANIFEST, "r")) == NULL)
+        return;
+    while(fgets(line, sizeof(line), f)) {
+        if(line[0] == '#')
+            continue;
+        line[strcspn(line, "\n")] = 0;
+        path = strtok_r(line, "\t", &save);
+        mtime = strtok_r(NULL, "\t", &save);
+        type = strtok_r(NULL, "\t", &save);
+        name = strtok_r(NULL, "\t", &save);
+        if(path == NULL || mtime == NULL || type == NULL || (*type != '-' && name == NULL))
+            continue;
+        entry = plugin_manifest_add(path);
+        entry->mtime = atol(mtime);
+        entry->type = *type == '-' ? G15_PLUGIN_NONE : atoi(type);
+        strncpy(entry->name, name ? name : "", sizeof(entry->name) - 1);
+    }
+    fclose(f);
+}
+
+/* write the manifest out again if it has changed, replacing the file in one go */
+static void plugin_manifest_save()
+{
+    char tmpname[sizeof(G15_PLUGIN_MANIFEST) + 8];
+    FILE *f;
+    int fd, i, err = 0;
+
+    if(!manifest_dirty)
+        return;
+    manifest_dirty = 0;
+    snprintf(tmpname, sizeof(tmpname), "%s.XXXXXX", G15_PLUGIN_MANIFEST);
+    if((fd = mkstemp(tmpname)) < 0 || (f = fdopen(fd, "w")) == NULL) {
+        G15_INFO("Unable to save the plugin cache %s: %s", G15_PLUGIN_MANIFEST, strerror(errno));
+        if(fd >= 0) {
+            close(fd);
+            unlink(tmpname);
+        }
+        return;
+    }
+    fchmod(fd, 0644);
+    fprintf(f, "# what each plugin file is, by path and mtime.  written by g15daemon - changes will be lost\n");
+    for(i = 0; i < nmanifest; i++) {
+        if(!manifest[i].seen)
+            continue;
+        if(manifest[i].type == G15_PLUGIN_NONE)
+            fprintf(f, "%s\t%ld\t-\n", manifest[i].path, (long)manifest[i].mtime);
+        else
+            fprintf(f, "%s\t%ld\t%i\t%s\n", manifest[i].path, (long)manifest[i].mtime, manifest[i].type, manifest[i].name);
+    }
+    if(fflush(f) != 0 || fsync(fd) != 0)
+        err = errno;
+    if(fclose(f) != 0 && err == 0)
+        err = errno;
+    if(err == 0 && rename(tmpname, G15_PLUGIN_MANIFEST) < 0)
+        err = errno;
+    if(err) {
+        G15_INFO("Unable to save the plugin cache %s: %s", G15_PLUGIN_MANIFEST, strerror(err));
+        unlink(tmpname);
+    }
+}
+
+/* the type of the plugin 'file' is cached as, with its name in 'name', or -1 if it isn't cached or has changed */
+static int plugin_manifest_lookup(plugin_file_t *file, char *name, int namelen)
+{
+    plugin_cached_t *entry = plugin_manifest_find(file->path);
+
+    if(entry == NULL || entry->mtime != file->mtime)
+        return -1;
+    entry->seen = 1;
+    if(entry->type == G15_PLUGIN_NONE)
+        return G15_PLUGIN_NONE;
+    snprintf(name, namelen, "%s", entry->name);
+    return *name ? entry->type : -1;
+}
+
+static void plugin_manifest_store(plugin_file_t *file, plugin_info_t *info)
+{
+    plugin_cached_t *entry = plugin_manifest_add(file->path);
+    int type = info ? info->type : G15_PLUGIN_NONE;
+    char *name = info && info->name ? info->name : "";
+
+    entry->seen = 1;
+    if(entry->mtime == file->mtime && entry->type == type && strcmp(entry->name, name) == 0)
+        return;
+    entry->mtime = file->mtime;
+    entry->type = type;
+    strncpy(entry->name, name, sizeof(entry->name) - 1);
+    entry->name[sizeof(entry->name) - 1] = 0;
+    manifest_dirty = 1;
+}
+
+static int plugin_enabled(config_section_t *plugin_cfg, char *name)
+{
+    if(strncasecmp("Load",g15daemon_cfg_read_string(plugin_cfg, name,"Load"),5)!=0) {
+        g15daemon_log(LOG_ERR, "\"%s\" Plugin disabled in g15daemon.conf - not running\n",name);
+        return 0;
+    }
+    return 1;
+}
+
+/* start every enabled plugin in plugin_directory which isn't already running.  plugins_mutex must be held */
+static int plugins_open(g15daemon_t *masterlist, char *plugin_directory) {
     
     DIR *directory;
     struct dirent *ep;
-    char pluginname[2048];
-    int loadcount = 0;
-    int count = g15_count_plugins(plugin_directory);
+    struct stat st;
+    plugin_file_t *files = NULL;
+    int count = 0, total, loadcount = 0, i, j;
+    /* reloads only mention plugins they actually start */
+    int quiet = nrunning > 0;
+    unsigned long long started = g15daemon_time_ns();
     config_section_t *load_cfg = g15daemon_cfg_load_section(masterlist,"PLUGIN_LOAD_ORDER");
+    config_section_t *plugin_cfg = g15daemon_cfg_load_section(masterlist,"PLUGINS");
 
-   if(!uf_search_confitem(load_cfg,"TotalPlugins") ||
-         (g15daemon_cfg_read_int(load_cfg,"TotalPlugins",0)!=count) ||
-     	 (g15daemon_cfg_read_string(load_cfg,"0","")[0]=='/')) {
-
-      g15daemon_log(LOG_INFO,"Number of plugins has changed. Rebuilding load order.");
-
-      directory = opendir (plugin_directory);
-      if (directory != NULL && count)
-      {
-         g15daemon_log(LOG_WARNING,"Attempting load of %i plugins",count);
-         while ((ep = readdir (directory))) {
-            if(strstr(ep->d_name,".so")){
-                strcpy(pluginname, plugin_directory);
-                strncat(pluginname,"/",1);
-                strncat(pluginname,ep->d_name,200);
-                if(g15_plugin_load (masterlist, pluginname)==0){
-                  char tmp[10];
-                  sprintf(tmp,"%i",loadcount);
-                  g15daemon_cfg_write_string(load_cfg,tmp,ep->d_name);
-                  loadcount++;
-
-                }
-                g15daemon_msleep(20);
-            }
-        }
-        (void) closedir (directory);
-        
-        g15daemon_cfg_write_int(load_cfg,"TotalPlugins",loadcount);
-        
-        g15daemon_log(LOG_WARNING,"Successfully loaded %i of %i plugins.",loadcount,count);
-        return loadcount;
-      }
-      else
+    if(!manifest_loaded)
+        plugin_manifest_load();
+    /* one pass over the directory */
+    directory = opendir (plugin_directory);
+    if (directory == NULL) {
         g15daemon_log (LOG_ERR,"Unable to open the directory: %s",plugin_directory);
-    }else{
-      int i;
-      g15daemon_log(LOG_INFO,"Loading %i plugins named in g15daemon.conf.",count);
-      for(i=0;i<count;i++){
+        return 0;
+    }
+    while ((ep = readdir (directory))) {
+        if(!strstr(ep->d_name,".so"))
+            continue;
+        files = realloc(files, (count + 1) * sizeof(plugin_file_t));
+        snprintf(files[count].path, sizeof(files[count].path), "%s/%s", plugin_directory, ep->d_name);
+        if(plugin_running(files[count].path))
+            continue;
+        files[count].name = strlen(plugin_directory) + 1;
+        files[count].mtime = stat(files[count].path, &st) == 0 ? st.st_mtime : 0;
+        files[count].order = 0x10000 + count;
+        files[count].pooled = 0;
+        count++;
+    }
+    (void) closedir (directory);
+
+    /* plugins named in the load order (screen order) go first */
+    total = g15daemon_cfg_read_int(load_cfg,"TotalPlugins",0);
+    for(i = 0; i < total; i++) {
         char tmp[10];
-        char plugin_fname[1024];
+        char *fname;
         sprintf(tmp,"%i",i);
-        strcpy(plugin_fname,PLUGINDIR);
-        strncat(plugin_fname,"/",1);
-        strncat(plugin_fname,g15daemon_cfg_read_string(load_cfg,tmp,""),128);
-        g15_plugin_load(masterlist,plugin_fname);
-        g15daemon_msleep(20);
-      }
-      return count;
+        fname = g15daemon_cfg_read_string(load_cfg,tmp,"");
+        if(strrchr(fname,'/'))
+            fname = strrchr(fname,'/') + 1;
+        for(j = 0; j < count; j++)
+            if(files[j].order >= 0x10000 && strcmp(files[j].path + files[j].name, fname) == 0)
+                files[j].order = i;
     }
-    return 0;
+    qsort(files, count, sizeof(plugin_file_t), plugin_file_cmp);
+
+    if(!quiet)
+        g15daemon_log(LOG_WARNING,"Attempting load of %i plugins",count);
+    for(i = 0; i < count; i++) {
+        char name[128];
+        void *handle;
+        plugin_info_t *info;
+        int type = plugin_manifest_lookup(&files[i], name, sizeof(name));
+
+        if(type == G15_PLUGIN_NONE) {
+            g15daemon_log(LOG_INFO,"%s is not a valid g15daemon plugin (cached).  Skipping\n",files[i].path);
+            continue;
+        }
+        if(type >= 0 && !plugin_enabled(plugin_cfg, name))
+            continue;
+
+        /* each plugin is started as soon as it is loaded - its init runs on its own thread or a worker while
+           we carry on loading the rest */
+        if((handle = g15daemon_dlopen_plugin(files[i].path,G15_PLUGIN_NONSHARED)) == NULL)
+            continue;
+        if((info = dlsym(handle, "g15plugin_info")) == NULL) {
+            /* if it doesnt have a valid struct, we should just load it as a library... but we dont at the moment FIXME */
+            g15daemon_log(LOG_ERR,"%s is not a valid g15daemon plugin.  Unloading\n",files[i].path);
+            plugin_manifest_store(&files[i], NULL);
+            g15daemon_dlclose_plugin(handle);
+            dlerror();
+            continue;
+        }
+        plugin_manifest_store(&files[i], info);
+        if(type < 0 && !plugin_enabled(plugin_cfg, info->name)) {
+            g15daemon_dlclose_plugin(handle);
+            continue;
+        }
+        /* the name is copied now, as a plugin which quits takes its info with it */
+        strncpy(files[i].plugin, info->name, sizeof(files[i].plugin) - 1);
+        files[i].plugin[sizeof(files[i].plugin) - 1] = 0;
+        if((files[i].pooled = g15_plugin_start(masterlist, handle, info)) < 0) {
+            g15daemon_dlclose_plugin(handle);
+            continue;
+        }
+        running = realloc(running, (nrunning + 1) * sizeof(plugin_file_t));
+        running[nrunning++] = files[i];
+        loadcount++;
+    }
+    free(files);
+    plugin_manifest_save();
+
+    /* the load order only lists the plugins actually run */
+    for(i = 0; i < nrunning; i++) {
+        char tmp[10];
+        sprintf(tmp,"%i",i);
+        g15daemon_cfg_write_string(load_cfg,tmp,running[i].path + running[i].name);
+    }
+    g15daemon_cfg_write_int(load_cfg,"TotalPlugins",nrunning);
+
+    if(!quiet || loadcount)
+        g15daemon_log(LOG_WARNING,"Successfully loaded %i of %i plugins in %llums.",loadcount,count,
+                      (g15daemon_time_ns() - started) / G15_NSEC_PER_MSEC);
+    return loadcount;
+}
+
+int g15_open_all_plugins(g15daemon_t *masterlist, char *plugin_directory) {
+    int loadcount;
+
+    pthread_mutex_lock(&plugins_mutex);
+    loadcount = plugins_open(masterlist, plugin_directory);
+    pthread_mutex_unlock(&plugins_mutex);
+    return loadcount;
+}
+
+int uf_plugins_reload(g15daemon_t *masterlist, char *plugin_directory) {
+    config_section_t *plugin_cfg = g15daemon_cfg_load_section(masterlist,"PLUGINS");
+    int i, j, loadcount;
+
+    pthread_mutex_lock(&plugins_mutex);
+    for(i = 0, j = 0; i < nrunning; i++) {
+        if(plugin_enabled(plugin_cfg, running[i].plugin)) {
+            running[j++] = running[i];
+        } else if(running[i].pooled) {
+            /* it may already have quit */
+            if(uf_engine_remove(running[i].plugin) == 0)
+                g15daemon_log(LOG_WARNING,"Stopping plugin \"%s\"",running[i].plugin);
+        } else {
+            g15daemon_log(LOG_WARNING,"Plugin \"%s\" has a thread of its own, and will be stopped when g15daemon is restarted",running[i].plugin);
+            running[j++] = running[i];
+        }
+    }
+    nrunning = j;
+    loadcount = plugins_open(masterlist, plugin_directory);
+    pthread_mutex_unlock(&plugins_mutex);
+    return loadcount;
 }
@@ -0,0 +1,380 @@
+/*
+    This file is part of g15daemon.
+
+    g15daemon is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    g15daemon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with g15daemon; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+    (c) 2006-2008 Mike Lampard, Philip Lawatsch, and others
+
+    $Revision$ -  $Date$ $Author$
+
+    This daemon listens on localhost port 15550 for client connections,
+    and arbitrates LCD display.  Allows for multiple simultaneous clients.
+    Client screens can be cycled through by pressing the 'L1' key.
+
+    g15_stats.c
+    pipeline statistics.  counters and latency histograms are kept by the threads doing the work,
+    without locks or atomics, and are only gathered up when somebody connects to the stats socket
+    (eg "socat - UNIX-CONNECT:/var/run/g15daemon.stats").  the socket sends a text report and hangs up.
+*/
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include <config.h>
+#include "g15daemon.h"
+
+extern volatile int leaving;
+
+/* an fps figure older than this is stale - the client has stopped drawing */
+#define STATS_FPS_STALE 2000000
+
+static unsigned int hist_index(unsigned long long usecs)
+{
+    unsigned int exp;
+
+    if(usecs >= 1ULL << 32)
+        usecs = (1ULL << 32) - 1;
+    if(usecs < (1 << G15_HIST_SUBBITS))
+        return usecs;
+    exp = 31 - __builtin_clz((unsigned int)usecs);
+    return ((exp - G15_HIST_SUBBITS + 1) << G15_HIST_SUBBITS) +
+           ((usecs >> (exp - G15_HIST_SUBBITS)) & ((1 << G15_HIST_SUBBITS) - 1));
+}
+
+/* smallest value counted in bucket 'index' */
+static unsigned long long hist_value(unsigned int index)
+{
+    unsigned int shift;
+
+    if(index < (1 << G15_HIST_SUBBITS))
+        return index;
+    shift = (index >> G15_HIST_SUBBITS) - 1;
+    return (unsigned long long)((1 << G15_HIST_SUBBITS) + (index & ((1 << G15_HIST_SUBBITS) - 1))) << shift;
+}
+
+void uf_hist_record(g15_histogram_t *hist, unsigned long long usecs)
+{
+    hist->counts[hist_index(usecs)]++;
+    hist->total += usecs;
+    if(usecs > hist->max)
+        hist->max = usecs;
+}
+
+static void hist_add(g15_histogram_t *sum, g15_histogram_t *hist)
+{
+    int i;
+
+    for(i = 0; i < G15_HIST_BUCKETS; i++)
+        sum->counts[i] += hist->counts[i];
+    sum->total += hist->total;
+    if(hist->max > sum->max)
+        sum->max = hist->max;
+}
+
+void uf_stats_retire(g15daemon_t *masterlist, lcd_t *lcd)
+{
+    g15_lcdstats_t *retired = &masterlist->retired;
+
+    retired->frames += lcd->stats.frames;
+    retired->dropped += lcd->stats.dropped;
+    retired->bytes += lcd->stats.bytes;
+    /* a kept screen's were added when its client went */
+    if(lcd->stats.recv_to_swap)
+        hist_add(retired->recv_to_swap, lcd->stats.recv_to_swap);
+    if(lcd->events) {
+        hist_add(&masterlist->key_to_client, &lcd->events->latency);
+        masterlist->events_lost += lcd->events->lost;
+    }
+}
+
+unsigned long uf_stats_events(g15daemon_t *masterlist, g15_histogram_t *latency)
+{
+    unsigned long lost = masterlist->events_lost + masterlist->kb_events.lost;
+    lcdnode_t *node = masterlist->tail;
+
+    hist_add(latency, &masterlist->key_to_client);
+    hist_add(latency, &masterlist->kb_events.latency);
+    do {
+        if(node->lcd->events) {
+            hist_add(latency, &node->lcd->events->latency);
+            lost += node->lcd->events->lost;
+        }
+        node = node->next;
+    } while(node != masterlist->tail);
+    return lost;
+}
+
+/* one line per histogram: count, mean and percentiles, followed by the non-empty buckets */
+static void stats_print_hist(FILE *f, char *name, g15_histogram_t *hist)
+{
+    static const double percentiles[] = { 50.0, 90.0, 99.0, 99.9 };
+    unsigned long count = 0, seen = 0;
+    unsigned int i, p = 0;
+
+    for(i = 0; i < G15_HIST_BUCKETS; i++)
+        count += hist->counts[i];
+    fprintf(f, "latency %s count %lu mean %llu", name, count, count ? hist->total / count : 0);
+    for(i = 0; i < G15_HIST_BUCKETS && p < sizeof(percentiles) / sizeof(double); i++) {
+        seen += hist->counts[i];
+        while(count && p < sizeof(percentiles) / sizeof(double) && seen >= count * percentiles[p] / 100.0)
+            fprintf(f, " p%g %llu", percentiles[p++], hist_value(i));
+    }
+    for(; p < sizeof(percentiles) / sizeof(double); p++)
+        fprintf(f, " p%g 0", percentiles[p]);
+    fprintf(f, " max %llu\n", hist->max);
+
+    for(i = 0; i < G15_HIST_BUCKETS; i++)
+        if(hist->counts[i])
+            fprintf(f, "bucket %s %llu %lu\n", name, hist_value(i), hist->counts[i]);
+}
+
+typedef struct stats_screen_s
+{
+    char name[32];
+    unsigned int device;
+    int foreground;
+    unsigned int priority;
+    unsigned long frames;
+    unsigned long dropped;
+    unsigned long long bytes;
+    unsigned int fps;
+    unsigned long events;
+    unsigned long events_lost;
+} stats_screen_t;
+
+/* what each keyboard's lcd thread has written, and what the daemon as a whole has */
+typedef struct stats_device_s
+{
+    unsigned long frames_written;
+    unsigned long frames_skipped;
+    unsigned long coalesced;
+    unsigned long paced;
+    unsigned long control_written;
+    unsigned long control_suppressed;
+    unsigned long events_lost;
+    unsigned int screens;
+} stats_device_t;
+
+/* snapshot up to 'room' of one keyboard's screens into 'screens' under its list lock, and add its
+   histograms to the sums */
+static unsigned int stats_device(g15daemon_t *masterlist, stats_screen_t *screens, unsigned int room, stats_device_t *dev,
+                                 g15_histogram_t *recv_to_swap, g15_histogram_t *key_to_client, unsigned long long now)
+{
+    unsigned int count = 0, i;
+    lcdnode_t *node;
+
+    pthread_mutex_lock(&masterlist->lcdlist_mutex);
+    hist_add(recv_to_swap, masterlist->retired.recv_to_swap);
+    dev->events_lost = uf_stats_events(masterlist, key_to_client);
+    node = masterlist->tail;
+    do {
+        lcd_t *lcd = node->lcd;
+        stats_screen_t *screen = &screens[count++];
+
+        if(lcd->g15plugin && lcd->g15plugin->info && lcd->g15plugin->info->name)
+            strncpy(screen->name, lcd->g15plugin->info->name, sizeof(screen->name) - 1);
+        else
+            strcpy(screen->name, "-");
+        screen->device = masterlist->devno;
+        screen->foreground = node == masterlist->current;
+        screen->priority = lcd->priority;
+        screen->frames = lcd->stats.frames;
+        screen->dropped = lcd->stats.dropped;
+        screen->bytes = lcd->stats.bytes;
+        screen->fps = now - lcd->stats.frame_time[lcd->pending & LCD_FRAME_INDEX] < STATS_FPS_STALE ? lcd->stats.fps : 0;
+        screen->events = 0;
+        screen->events_lost = 0;
+        if(lcd->events) {
+            for(i = 0; i < G15_HIST_BUCKETS; i++)
+                screen->events += lcd->events->latency.counts[i];
+            screen->events_lost = lcd->events->lost;
+        }
+        if(lcd->stats.recv_to_swap)
+            hist_add(recv_to_swap, lcd->stats.recv_to_swap);
+        node = node->next;
+    } while(node != masterlist->tail && count < room);
+    pthread_mutex_unlock(&masterlist->lcdlist_mutex);
+
+    dev->frames_written = masterlist->frames_written;
+    dev->frames_skipped = masterlist->frames_skipped;
+    dev->coalesced = masterlist->refresh.coalesced;
+    dev->paced = masterlist->pacer.deferred;
+    uf_backend_control_stats(masterlist->device, &dev->control_written, &dev->control_suppressed);
+    dev->screens = count;
+    return count;
+}
+
+static void stats_report(g15daemon_t *masterlist, FILE *f)
+{
+    g15_histogram_t *recv_to_swap = g15daemon_xmalloc(sizeof(g15_histogram_t));
+    g15_histogram_t *key_to_client = g15daemon_xmalloc(sizeof(g15_histogram_t));
+    g15_histogram_t *swap_to_write = g15daemon_xmalloc(sizeof(g15_histogram_t));
+    g15_histogram_t *usb_write = g15daemon_xmalloc(sizeof(g15_histogram_t));
+    stats_device_t *devs, total;
+    stats_screen_t *screens;
+    unsigned long long now = uf_gettime_us(), first_frame = 0;
+    unsigned int count = 0, allocated = 0, d, i;
+    unsigned long captured, capture_dropped, plugin_runs;
+    unsigned long retired_frames = 0, retired_dropped = 0;
+    unsigned long long retired_bytes = 0;
+    unsigned int workers, plugins;
+    g15_histogram_t *plugin_late;
+
+    /* each keyboard is snapshotted under its own list lock in turn, and the slow part done without any */
+    devs = g15daemon_xmalloc(masterlist->ndevices * sizeof(stats_device_t));
+    for(d = 0; d < masterlist->ndevices; d++)
+        allocated += masterlist->devices[d]->numclients + 1;
+    screens = g15daemon_xmalloc(allocated * sizeof(stats_screen_t));
+    memset(&total, 0, sizeof(total));
+    for(d = 0; d < masterlist->ndevices; d++) {
+        g15daemon_t *device = masterlist->devices[d];
+
+        /* screens added since the count was taken are left for the next report */
+        if(count == allocated)
+            break;
+        count += stats_device(device, screens + count, allocated - count, &devs[d], recv_to_swap, key_to_client, now);
+        hist_add(swap_to_write, &device->swap_to_write);
+        hist_add(usb_write, &device->usb_write);
+        if(device->first_frame && (!first_frame || device->first_frame < first_frame))
+            first_frame = device->first_frame;
+        retired_frames += device->retired.frames;
+        retired_dropped += device->retired.dropped;
+        retired_bytes += device->retired.bytes;
+        total.frames_written += devs[d].frames_written;
+        total.frames_skipped += devs[d].frames_skipped;
+        total.coalesced += devs[d].coalesced;
+        total.paced += devs[d].paced;
+        total.control_written += devs[d].control_written;
+        total.control_suppressed += devs[d].control_suppressed;
+        total.events_lost += devs[d].events_lost;
+    }
+
+    fprintf(f, "# %s statistics\n", PACKAGE_STRING);
+    fprintf(f, "uptime %llu.%06llu\n", (now - masterlist->started) / 1000000, (now - masterlist->started) % 1000000);
+    fprintf(f, "first_frame %llu.%06llu\n", first_frame / 1000000, first_frame % 1000000);
+    fprintf(f, "frames_written %lu\n", total.frames_written);
+    fprintf(f, "frames_skipped %lu\n", total.frames_skipped);
+    fprintf(f, "refreshes_coalesced %lu\n", total.coalesced);
+    fprintf(f, "frames_paced %lu\n", total.paced);
+    fprintf(f, "control_writes %lu\n", total.control_written);
+    fprintf(f, "control_writes_suppressed %lu\n", total.control_suppressed);
+    fprintf(f, "retired_frames %lu\n", retired_frames);
+    fprintf(f, "retired_dropped %lu\n", retired_dropped);
+    fprintf(f, "retired_bytes %llu\n", retired_bytes);
+    fprintf(f, "events_lost %lu\n", total.events_lost);
+    uf_capture_stats(&captured, &capture_dropped);
+    fprintf(f, "capture_frames %lu\n", captured);
+    fprintf(f, "capture_dropped %lu\n", capture_dropped);
+    plugin_late = uf_engine_stats(&workers, &plugins, &plugin_runs);
+    fprintf(f, "plugin_workers %u\n", workers);
+    fprintf(f, "plugins_pooled %u\n", plugins);
+    fprintf(f, "plugin_runs %lu\n", plugin_runs);
+
+    fprintf(f, "# device <n> <backend> screens <n> frames_written <n> frames_skipped <n> coalesced <n> paced <n> control_writes <n> suppressed <n> events_lost <n>\n");
+    for(i = 0; i < d; i++)
+        fprintf(f, "device %u %s screens %u frames_written %lu frames_skipped %lu coalesced %lu paced %lu control_writes %lu suppressed %lu events_lost %lu\n",
+                i, uf_backend_name(masterlist->devices[i]->device), devs[i].screens, devs[i].frames_written,
+                devs[i].frames_skipped, devs[i].coalesced, devs[i].paced, devs[i].control_written,
+                devs[i].control_suppressed, devs[i].events_lost);
+
+    fprintf(f, "# latency <name> count <n> mean <us> p50 <us> p90 <us> p99 <us> p99.9 <us> max <us>\n");
+    fprintf(f, "# bucket <name> <lowest us in bucket> <n>\n");
+    stats_print_hist(f, "recv_to_swap", recv_to_swap);
+    stats_print_hist(f, "swap_to_write", swap_to_write);
+    stats_print_hist(f, "usb_write", usb_write);
+    stats_print_hist(f, "key_to_client", key_to_client);
+    stats_print_hist(f, "plugin_run_late", plugin_late);
+
+    fprintf(f, "# screen <n> <name> <foreground> frames <n> dropped <n> bytes <n> fps <n> events <n> lost <n> priority <class> device <n>\n");
+    for(i = 0; i < count; i++)
+        fprintf(f, "screen %u \"%s\" %i frames %lu dropped %lu bytes %llu fps %u events %lu lost %lu priority %u device %u\n", i, screens[i].name,
+                screens[i].foreground, screens[i].frames, screens[i].dropped, screens[i].bytes, screens[i].fps,
+                screens[i].events, screens[i].events_lost, screens[i].priority, screens[i].device);
+
+    free(screens);
+    free(devs);
+    free(recv_to_swap);
+    free(key_to_client);
+    free(swap_to_write);
+    free(usb_write);
+}
+
+int uf_stats_open(g15daemon_t *masterlist, char *path)
+{
+    struct sockaddr_un addr;
+    int sock;
+
+    masterlist->stats_sock = -1;
+    if(path == NULL || *path == 0 || strlen(path) >= sizeof(addr.sun_path))
+        return -1;
+
+    if((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        g15daemon_log(LOG_WARNING, "Unable to create stats socket: %s", strerror(errno));
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    /* only one g15daemon runs at a time, so anything already there is left over from a crash */
+    unlink(path);
+    if(bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(sock, 4) < 0) {
+        g15daemon_log(LOG_WARNING, "Unable to listen on stats socket %s: %s", path, strerror(errno));
+        close(sock);
+        return -1;
+    }
+    chmod(path, 0666);
+    g15daemon_log(LOG_INFO, "Statistics available from %s", path);
+    return masterlist->stats_sock = sock;
+}
+
+void *uf_stats_thread(void *lcdlist)
+{
+    g15daemon_t *masterlist = (g15daemon_t*)lcdlist;
+    struct pollfd pfd;
+    struct timeval timeout = { 1, 0 };
+    int client;
+    FILE *f;
+
+    while(!leaving) {
+        pfd.fd = masterlist->stats_sock;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if(poll(&pfd, 1, 500) <= 0 || !(pfd.revents & POLLIN))
+            continue;
+        if((client = accept(masterlist->stats_sock, NULL, NULL)) < 0)
+            continue;
+        /* a reader which stalls must not keep us from exiting */
+        setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        if((f = fdopen(client, "w")) == NULL) {
+            close(client);
+            continue;
+        }
+        stats_report(masterlist, f);
+        fclose(f);
+    }
+    close(masterlist->stats_sock);
+    masterlist->stats_sock = -1;
+    return NULL;
+}
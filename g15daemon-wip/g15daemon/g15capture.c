@@ -0,0 +1,377 @@
+/*
+    This file is part of g15daemon.
+
+    g15daemon is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    g15daemon is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with g15daemon; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+    (c) 2006-2008 Mike Lampard, Philip Lawatsch, and others
+
+    $Revision$ -  $Date$ $Author$
+
+    This daemon listens on localhost port 15550 for client connections,
+    and arbitrates LCD display.  Allows for multiple simultaneous clients.
+    Client screens can be cycled through by pressing the 'L1' key.
+
+
+    g15capture.c
+    decode the capture files recorded by g15daemon ("Capture File" in the Global section of
+    g15daemon.conf), listing the frames, or exporting them as a sequence of pbm images or as an
+    animated gif.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "g15daemon.h"
+
+/* the largest lcd a capture file may describe */
+#define MAX_WIDTH 1024
+#define MAX_HEIGHT 1024
+
+enum {
+    MODE_LIST = 0,
+    MODE_PBM,
+    MODE_GIF
+};
+
+typedef struct capture_s
+{
+    FILE *f;
+    unsigned int width;
+    unsigned int height;
+    unsigned int size;
+    unsigned long long start;
+    unsigned long long time;
+    unsigned char frame[MAX_WIDTH / 8 * MAX_HEIGHT];
+} capture_t;
+
+typedef struct gif_s
+{
+    FILE *f;
+    unsigned int scale;
+    unsigned char block[255];
+    unsigned int blocklen;
+    unsigned int bits;
+    unsigned int nbits;
+} gif_t;
+
+static int read_le(FILE *f, unsigned long long *value, int bytes)
+{
+    int i, c;
+
+    *value = 0;
+    for(i = 0; i < bytes; i++) {
+        if((c = getc(f)) == EOF)
+            return -1;
+        *value |= (unsigned long long)c << (8 * i);
+    }
+    return 0;
+}
+
+static int read_varint(FILE *f, unsigned long long *value)
+{
+    int shift = 0, c;
+
+    *value = 0;
+    do {
+        if((c = getc(f)) == EOF || shift > 63)
+            return -1;
+        *value |= (unsigned long long)(c & 0x7f) << shift;
+        shift += 7;
+    } while(c & 0x80);
+    return 0;
+}
+
+static int read_header(capture_t *cap)
+{
+    char magic[6];
+    unsigned long long version, width, height;
+
+    /* the 'G' has already been read */
+    magic[0] = 'G';
+    if(fread(magic + 1, 5, 1, cap->f) != 1 || memcmp(magic, G15_CAPTURE_MAGIC, 6) != 0)
+        return -1;
+    if(read_le(cap->f, &version, 1) < 0 || read_le(cap->f, &width, 2) < 0 ||
+       read_le(cap->f, &height, 2) < 0 || read_le(cap->f, &cap->start, 8) < 0)
+        return -1;
+    if(version != G15_CAPTURE_VERSION) {
+        fprintf(stderr, "Unsupported capture version %llu\n", version);
+        return -1;
+    }
+    if(width == 0 || width > MAX_WIDTH || width % 8 || height == 0 || height > MAX_HEIGHT) {
+        fprintf(stderr, "Bad capture geometry %llux%llu\n", width, height);
+        return -1;
+    }
+    cap->width = width;
+    cap->height = height;
+    cap->size = width / 8 * height;
+    cap->time = cap->start;
+    memset(cap->frame, 0, cap->size);
+    return 0;
+}
+
+static int read_frame(capture_t *cap)
+{
+    unsigned long long delta, skip, count;
+    unsigned int pos = 0;
+    int c;
+
+    if(read_varint(cap->f, &delta) < 0)
+        return -1;
+    cap->time += delta;
+    while(pos < cap->size) {
+        if(read_varint(cap->f, &skip) < 0 || read_varint(cap->f, &count) < 0)
+            return -1;
+        if(skip + count > cap->size - pos)
+            return -1;
+        pos += skip;
+        while(count--) {
+            if((c = getc(cap->f)) == EOF)
+                return -1;
+            cap->frame[pos++] ^= c;
+        }
+    }
+    return 0;
+}
+
+static int write_pbm(capture_t *cap, char *prefix, unsigned long num)
+{
+    char filename[1024];
+    FILE *f;
+
+    snprintf(filename, sizeof(filename), "%s%05lu.pbm", prefix, num);
+    if((f = fopen(filename, "wb")) == NULL) {
+        perror(filename);
+        return -1;
+    }
+    fprintf(f, "P4\n# frame %lu at %llu.%06llu\n%u %u\n", num, cap->time / 1000000, cap->time % 1000000,
+            cap->width, cap->height);
+    fwrite(cap->frame, cap->size, 1, f);
+    return fclose(f);
+}
+
+static void gif_byte(gif_t *gif, unsigned char byte)
+{
+    gif->block[gif->blocklen++] = byte;
+    if(gif->blocklen == sizeof(gif->block)) {
+        putc(gif->blocklen, gif->f);
+        fwrite(gif->block, gif->blocklen, 1, gif->f);
+        gif->blocklen = 0;
+    }
+}
+
+static void gif_code(gif_t *gif, unsigned int code)
+{
+    gif->bits |= code << gif->nbits;
+    gif->nbits += 3;
+    while(gif->nbits >= 8) {
+        gif_byte(gif, gif->bits & 0xff);
+        gif->bits >>= 8;
+        gif->nbits -= 8;
+    }
+}
+
+static void gif_open(gif_t *gif, unsigned int width, unsigned int height)
+{
+    unsigned int w = width * gif->scale, h = height * gif->scale;
+    /* lcd green, and black */
+    static const unsigned char palette[] = { 0xb0, 0xd0, 0x70, 0x00, 0x00, 0x00 };
+
+    fwrite("GIF89a", 6, 1, gif->f);
+    putc(w & 0xff, gif->f); putc(w >> 8, gif->f);
+    putc(h & 0xff, gif->f); putc(h >> 8, gif->f);
+    /* a global colour table of two entries */
+    putc(0x80, gif->f); putc(0, gif->f); putc(0, gif->f);
+    fwrite(palette, sizeof(palette), 1, gif->f);
+    /* loop for ever */
+    fwrite("\x21\xff\x0bNETSCAPE2.0\x03\x01\x00\x00\x00", 19, 1, gif->f);
+}
+
+/* the lcd is 1 bit deep, so rather than carry a full lzw compressor each pixel is sent as a literal code,
+   with a clear code every two pixels to stop the code size from growing.  a frame comes to about 4k */
+static void gif_frame(gif_t *gif, unsigned char *frame, unsigned int width, unsigned int height,
+                      unsigned long long time, unsigned long long next)
+{
+    unsigned int w = width * gif->scale, h = height * gif->scale;
+    unsigned int x, y, n = 0, delay;
+
+    /* gif delays are in hundredths of a second.  the last frame is shown for a second */
+    delay = next ? (next - time + 5000) / 10000 : 100;
+    if(delay > 0xffff)
+        delay = 0xffff;
+    fwrite("\x21\xf9\x04\x00", 4, 1, gif->f);
+    putc(delay & 0xff, gif->f); putc(delay >> 8, gif->f);
+    putc(0, gif->f); putc(0, gif->f);
+
+    putc(0x2c, gif->f);
+    fwrite("\0\0\0\0", 4, 1, gif->f);
+    putc(w & 0xff, gif->f); putc(w >> 8, gif->f);
+    putc(h & 0xff, gif->f); putc(h >> 8, gif->f);
+    putc(0, gif->f);
+
+    /* minimum code size 2: clear is 4, end of information 5 */
+    putc(2, gif->f);
+    gif->bits = gif->nbits = gif->blocklen = 0;
+    for(y = 0; y < h; y++) {
+        unsigned char *row = frame + (y / gif->scale) * (width / 8);
+        for(x = 0; x < w; x++) {
+            unsigned int px = x / gif->scale;
+            if(n++ % 2 == 0)
+                gif_code(gif, 4);
+            gif_code(gif, (row[px / 8] >> (7 - px % 8)) & 1);
+        }
+    }
+    gif_code(gif, 5);
+    if(gif->nbits)
+        gif_byte(gif, gif->bits);
+    if(gif->blocklen) {
+        putc(gif->blocklen, gif->f);
+        fwrite(gif->block, gif->blocklen, 1, gif->f);
+    }
+    putc(0, gif->f);
+}
+
+static void usage(char *name)
+{
+    printf("%s - decode lcd captures recorded by g15daemon\n", name);
+    printf("usage: %s [-l] [-p prefix] [-g file.gif [-s scale]] capturefile\n", name);
+    printf(" -l\tlist the frames (default)\n");
+    printf(" -p\twrite each frame to prefixNNNNN.pbm\n");
+    printf(" -g\twrite the frames to an animated gif, with their original timing\n");
+    printf(" -s\tscale the gif up by a whole number (default 2)\n");
+}
+
+static void list_session(capture_t *cap)
+{
+    time_t secs = cap->start / 1000000;
+
+    printf("session %ux%u started %s", cap->width, cap->height, ctime(&secs));
+}
+
+int main(int argc, char *argv[])
+{
+    capture_t *cap;
+    gif_t gif;
+    int mode = MODE_LIST, c, retval = 0;
+    char *out = NULL;
+    unsigned long frames = 0;
+    /* the gif frame waiting for the next to arrive, which gives its delay */
+    unsigned char *pending = NULL;
+    unsigned long long pending_time = 0;
+    unsigned int gif_width = 0, gif_height = 0;
+
+    memset(&gif, 0, sizeof(gif));
+    gif.scale = 2;
+    while((c = getopt(argc, argv, "lp:g:s:h")) != -1) {
+        switch(c) {
+            case 'l':
+                mode = MODE_LIST;
+                break;
+            case 'p':
+                mode = MODE_PBM;
+                out = optarg;
+                break;
+            case 'g':
+                mode = MODE_GIF;
+                out = optarg;
+                break;
+            case 's':
+                gif.scale = atoi(optarg);
+                if(gif.scale < 1 || gif.scale > 8)
+                    gif.scale = 2;
+                break;
+            default:
+                usage(argv[0]);
+                return c == 'h' ? 0 : 1;
+        }
+    }
+    if(optind != argc - 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    cap = malloc(sizeof(capture_t));
+    if(cap == NULL || (cap->f = fopen(argv[optind], "rb")) == NULL) {
+        perror(argv[optind]);
+        return 1;
+    }
+    if(getc(cap->f) != 'G' || read_header(cap) < 0) {
+        fprintf(stderr, "%s is not a g15daemon capture file\n", argv[optind]);
+        return 1;
+    }
+    if(mode == MODE_LIST)
+        list_session(cap);
+    if(mode == MODE_GIF) {
+        if((gif.f = fopen(out, "wb")) == NULL) {
+            perror(out);
+            return 1;
+        }
+        pending = malloc(sizeof(cap->frame));
+        gif_width = cap->width;
+        gif_height = cap->height;
+        gif_open(&gif, gif_width, gif_height);
+    }
+
+    while((c = getc(cap->f)) != EOF) {
+        if(c == 'G') {
+            /* the daemon was restarted - a new session begins */
+            if(read_header(cap) < 0) {
+                fprintf(stderr, "Bad session header after frame %lu\n", frames);
+                retval = 1;
+                break;
+            }
+            if(mode == MODE_LIST)
+                list_session(cap);
+            continue;
+        }
+        if(c != 'F' || read_frame(cap) < 0) {
+            fprintf(stderr, "Capture truncated or corrupt after frame %lu\n", frames);
+            retval = 1;
+            break;
+        }
+        switch(mode) {
+            case MODE_LIST:
+                printf("frame %lu at %llu.%06llu\n", frames, cap->time / 1000000, cap->time % 1000000);
+                break;
+            case MODE_PBM:
+                if(write_pbm(cap, out, frames) < 0)
+                    return 1;
+                break;
+            case MODE_GIF:
+                /* a gif has one size */
+                if(cap->width != gif_width || cap->height != gif_height)
+                    continue;
+                if(frames)
+                    gif_frame(&gif, pending, gif_width, gif_height, pending_time, cap->time);
+                memcpy(pending, cap->frame, cap->size);
+                pending_time = cap->time;
+                break;
+        }
+        frames++;
+    }
+
+    if(mode == MODE_GIF) {
+        if(frames)
+            gif_frame(&gif, pending, gif_width, gif_height, pending_time, 0);
+        putc(0x3b, gif.f);
+        fclose(gif.f);
+    }
+    if(mode != MODE_LIST)
+        printf("%lu frames written to %s\n", frames, out);
+    fclose(cap->f);
+    return retval;
+}
@@ -32,9 +32,61 @@
 #define BLACKnWHITE 
 #endif
 
+/* the g15's own panel.  screens on a keyboard with another panel use the sizes in its geometry instead */
 #define LCD_WIDTH 160
 #define LCD_HEIGHT 43
 #define LCD_BUFSIZE 1048
+#define G15_NSEC_PER_SEC 1000000000ULL
+#define G15_NSEC_PER_MSEC 1000000ULL
+
+/* bytes per pixel row in the packed lcd buffer */
+#define LCD_ROWBYTES (LCD_WIDTH/8)
+
+/* pixel formats of lcd panels.  MONO is 1 bit per pixel, packed in rows with the leftmost pixel in bit 7 */
+enum {
+    G15_PIXFMT_MONO = 0
+};
+
+/* the lcd panels the daemon can drive: identifier, name, width, height, pixel format, and the bytes in a
+   frame buffer (a packed frame, and any padding the device expects).  widths must be a multiple of 8.
+   the frame pipeline's kernels are built for each panel with its sizes as constants (see g15_geometry.c) */
+#define G15_GEOMETRIES(G) \
+    G(g15,     "g15",    160, 43, G15_PIXFMT_MONO, 1048) \
+    G(mono128, "128x64", 128, 64, G15_PIXFMT_MONO, 1024) \
+    G(mono240, "240x64", 240, 64, G15_PIXFMT_MONO, 1920)
+
+/* the largest frame buffer, and 1 byte per pixel client frame, of any panel */
+#define G15_GEOMETRY_BUFSIZE(id, name, width, height, format, bufsize) unsigned char id[bufsize];
+#define G15_GEOMETRY_PIXELS(id, name, width, height, format, bufsize) unsigned char id[(width) * (height)];
+union g15_bufsizes_u { G15_GEOMETRIES(G15_GEOMETRY_BUFSIZE) };
+union g15_pixels_u { G15_GEOMETRIES(G15_GEOMETRY_PIXELS) };
+#define G15_MAX_BUFSIZE sizeof(union g15_bufsizes_u)
+#define G15_MAX_PIXELS sizeof(union g15_pixels_u)
+
+/* lcd_t.pending holds the index of the published frame, with LCD_FRAME_FRESH set until the lcd thread takes it */
+#define LCD_FRAME_INDEX 0x3
+#define LCD_FRAME_FRESH 0x4
+
+/* continuous capture files are a series of sessions, each a header followed by the frames written to the lcd:
+     header: "G15CAP", version (1 byte), width & height (2 bytes each), wallclock start of the session in
+             microseconds since the epoch (8 bytes).  all multibyte values are little endian
+     frame:  'F', microseconds since the previous frame (or the session start) as a varint, then the frame XORed
+             with the previous one (zeroes for the first), as pairs of varints - bytes unchanged, bytes changed - 
+             each pair followed by the changed bytes, until the whole frame is covered.
+   varints are 7 bits per byte, least significant first, with the top bit set on all but the last byte */
+#define G15_CAPTURE_MAGIC "G15CAP"
+#define G15_CAPTURE_VERSION 1
+
+/* latency histograms split each power of two microseconds into 1<<G15_HIST_SUBBITS buckets, up to 2^32us */
+#define G15_HIST_SUBBITS 4
+#define G15_HIST_BUCKETS ((32 - G15_HIST_SUBBITS + 1) << G15_HIST_SUBBITS)
+
+/* events which may be queued for each event subscriber.  must be a power of two */
+#define G15_EVENT_RING 32
+
+/* screen ids hold the slot number in their low bits */
+#define G15_SLOT_BITS 16
+#define G15_SLOT_MASK ((1 << G15_SLOT_BITS) - 1)
 
 #ifdef HAVE_CONFIG_H
 #include <config.h>
@@ -56,6 +108,12 @@
 /* if the following CMD is sent from a client, G15Daemon will not send any MR or G? keypresses via uinput, 
  * all M&G keys must be handled by the client.  If the client dies or exits, normal functions resume. */
 #define CLIENT_CMD_KEY_HANDLER 0x10
+/* set the client's priority class (see G15_PRIORITY_*) */
+#define CLIENT_CMD_PRIORITY_BACKGROUND 'b'
+#define CLIENT_CMD_PRIORITY_NORMAL 'o'
+#define CLIENT_CMD_PRIORITY_ALERT 'a'
+/* rotate away from the client's screen after the number of seconds (0-63) in the low bits.  0 for the default */
+#define CLIENT_CMD_ROTATE 0xc0
 
 enum {
     /* plugin types - LCD plugins are provided with a lcd_t and keystates via EVENT when visible */
@@ -70,6 +128,11 @@ enum {
     G15_PLUGIN_LCD_SERVER = 4
 };
 
+/* what each file in the plugin directory turned out to be is cached in G15_PLUGIN_MANIFEST, by path and mtime.
+   the daemon keeps it up to date as nobody, so the directory is handed to nobody at startup */
+#define G15_CACHE_DIR "/var/cache/g15daemon"
+#define G15_PLUGIN_MANIFEST G15_CACHE_DIR "/plugins"
+
 enum {
     /* plugin RETURN values */
     G15_PLUGIN_QUIT = -1,
@@ -89,7 +152,9 @@ enum {
     G15_EVENT_EXITNOW,
     /* core event types */
     G15_COREVENT_KEYPRESS_IN,
-    G15_COREVENT_KEYPRESS_OUT
+    G15_COREVENT_KEYPRESS_OUT,
+    /* the config file was changed and reloaded - re-read any settings kept.  value is the reload count */
+    G15_EVENT_CONFIG_CHANGED
 };
 
 enum {
@@ -97,6 +162,38 @@ enum {
     SCR_VISIBLE
 };
 
+enum {
+    /* screen priority classes.  background screens are shown only when there is nothing else to show, and
+       alerts take the lcd from other screens for a while (see g15_arbiter.c) */
+    G15_PRIORITY_BACKGROUND = 0,
+    G15_PRIORITY_NORMAL,
+    G15_PRIORITY_ALERT,
+    G15_PRIORITY_CLASSES
+};
+
+/* keyboards one daemon can drive.  each is given with its own --backend option */
+#define G15_MAX_DEVICES 8
+
+/* overlay layers a screen may have over its own frame, numbered from 1 (drawn first) to G15_LAYERS */
+#define G15_LAYERS 8
+
+enum {
+    /* how a layer's lit pixels are combined with those beneath it.  COPY also clears the pixels unlit in
+       the layer, ANDNOT clears those lit in it */
+    G15_ROP_COPY = 0,
+    G15_ROP_OR,
+    G15_ROP_XOR,
+    G15_ROP_ANDNOT,
+    G15_ROPS
+};
+
+/* threads which look at the current screen without taking lcdlist_mutex */
+enum {
+    G15_READER_KEYBOARD = 0,
+    G15_READER_LCD,
+    G15_SCREEN_READERS
+};
+
 /* plugin global or local */
 enum {
     G15_PLUGIN_NONSHARED = 0,
@@ -111,9 +208,24 @@ typedef struct plugin_event_s 	plugin_event_t;
 typedef struct plugin_info_s 	plugin_info_t;
 typedef struct plugin_s 	plugin_t;
 
+typedef struct g15_mailbox_s	g15_mailbox_t;
+typedef struct g15_pacer_s	g15_pacer_t;
+typedef struct g15_histogram_s	g15_histogram_t;
+typedef struct g15_lcdstats_s	g15_lcdstats_t;
+typedef struct g15_evring_s	g15_evring_t;
+typedef struct g15_slot_s	g15_slot_t;
+typedef struct g15_arbiter_s	g15_arbiter_t;
+typedef struct g15_layer_s	g15_layer_t;
+typedef struct g15_geometry_s	g15_geometry_t;
+/* a keyboard's backend instance, private to g15_backend.c */
+typedef struct g15_device_s	g15_device_t;
+
 typedef struct config_items_s	config_items_t;
 typedef struct config_section_s config_section_t;
 typedef struct configfile_s 	configfile_t;
+typedef struct config_arena_s	config_arena_t;
+typedef struct config_index_s	config_index_t;
+typedef struct config_slot_s	config_slot_t;
 
 typedef struct config_items_s
 {
@@ -122,21 +234,144 @@ typedef struct config_items_s
     config_items_t *head;
     char *key;
     char *value;
+    /* room at value, so a shorter value can be written in place */
+    unsigned int capacity;
+    /* value parsed when it was written */
+    int ival;
+    int bval;
+    double fval;
 } config_items_s;
 
+/* open addressed hash table of names (see g15_config.c) */
+typedef struct config_index_s
+{
+    unsigned int size;
+    unsigned int used;
+    config_slot_t *slots;
+} config_index_s;
+
 typedef struct config_section_s
 {
     config_section_t *head;
     config_section_t *next;
     char *sectionname;
     config_items_t *items;
+    /* the items by key */
+    config_index_t index;
+    configfile_t *config;
+    /* the section as last saved, and whether it has changed since */
+    char *text;
+    unsigned int textlen;
+    unsigned int textsize;
+    int dirty;
 }config_section_s;
 
 typedef struct configfile_s
 {
     config_section_t *sections;
+    /* sections by name, and interned key names */
+    config_index_t index;
+    config_index_t keys;
+    /* everything above is allocated from here */
+    config_arena_t *arena;
+    pthread_rwlock_t lock;
+    /* hash of the file as last read or written, and count of reloads which changed anything */
+    unsigned int hash;
+    unsigned int generation;
+    /* the file it was read from, and whether anything has changed since it was last saved */
+    char *filename;
+    int dirty;
 }configfile_s;
 
+/* latest-frame-wins mailbox, used for lcd refreshes & device commands.  any number of posts made
+   before the waiter gets around to waiting are collapsed into a single wakeup */
+typedef struct g15_mailbox_s
+{
+    /* eventfd (both members equal) or the read & write ends of a pipe */
+    int fd[2];
+    /* generation counter - incremented atomically by every poster */
+    volatile unsigned long posted;
+    /* generation last handed to the waiter. only touched by the waiter */
+    unsigned long taken;
+    /* posts which were folded into a later one (only counted for lcd refreshes) */
+    unsigned long coalesced;
+} g15_mailbox_s;
+
+/* lcd frame pacing. writes are submitted on deadlines rather than as soon as a refresh arrives, 
+   the interval between deadlines stretching as the measured usb write time grows */
+typedef struct g15_pacer_s
+{
+    /* global frame rate limit, 0 for unlimited. screens may set a lower limit in lcd_t.max_fps */
+    unsigned int max_fps;
+    /* maximum percentage of wallclock time the bus may spend on lcd writes */
+    unsigned int max_load;
+    /* start of the last write, and the running average write duration, in microseconds */
+    unsigned long long last_submit;
+    unsigned long long write_avg;
+    /* number of frames held back until their deadline */
+    unsigned long deferred;
+} g15_pacer_s;
+
+/* log-linear latency histogram (after HdrHistogram) - every value is counted to within ~6%.
+   each histogram has a single writer, and is read without locking by the stats socket */
+typedef struct g15_histogram_s
+{
+    unsigned long counts[G15_HIST_BUCKETS];
+    /* sum and largest of the values recorded, in microseconds */
+    unsigned long long total;
+    unsigned long long max;
+} g15_histogram_s;
+
+/* per-screen counters, written only by the thread drawing the screen */
+typedef struct g15_lcdstats_s
+{
+    /* frames published, and frames replaced before the lcd thread took them */
+    unsigned long frames;
+    unsigned long dropped;
+    /* frame data received from the client */
+    unsigned long long bytes;
+    /* when the frame in the back buffer finished arriving, 0 if it didn't come from a client */
+    unsigned long long recv_time;
+    /* when each of lcd_t.frames was published */
+    unsigned long long frame_time[3];
+    /* frame rate over the last whole second */
+    unsigned long long fps_start;
+    unsigned long fps_frames;
+    unsigned int fps;
+    /* allocated apart from the screen, and NULL while the screen is kept for a client which has gone */
+    g15_histogram_t *recv_to_swap;
+} g15_lcdstats_s;
+
+typedef struct plugin_event_s
+{
+    unsigned int event;
+    unsigned long value;
+    lcd_t *lcd;
+    /* monotonic time in microseconds at which a keypress was read from the keyboard, or the event sent */
+    unsigned long long timestamp;
+} plugin_event_s;
+
+/* events waiting for one subscriber - a screen's plugin or client, or the OS keyboard handler.  the keyboard
+   thread is the only producer and the subscriber drains the ring from its own thread, so a subscriber which
+   is slow to handle its events holds up nobody but itself.  events arriving while the ring is full are lost */
+typedef struct g15_evring_s
+{
+    plugin_event_t events[G15_EVENT_RING];
+    /* free running indices.  head is only written by the producer, tail only by the subscriber */
+    volatile unsigned int head;
+    volatile unsigned int tail;
+    /* set while the subscriber is draining the ring.  changed only with lcdlist_mutex held */
+    volatile int subscribed;
+    int *(*handler) (void *);
+    /* the subscriber is woken by a post to its mailbox, or, for plugins run by the worker pool, by notify() */
+    g15_mailbox_t wake;
+    void (*notify) (void *);
+    void *notify_arg;
+    /* events lost to a full ring (producer), and latency from keyboard to handled keypress (subscriber) */
+    unsigned long lost;
+    g15_histogram_t latency;
+} g15_evring_s;
+
 typedef struct plugin_info_s 
 {
     /* type - see above for valid defines*/
@@ -164,11 +399,55 @@ typedef struct plugin_s
     void *args;
 } plugin_s;
 
+/* an overlay layer (see g15_compositor.c).  pixels are packed like the lcd buffer, in rows of 'rowbytes'
+   bytes with the leftmost pixel in bit 7 */
+typedef struct g15_layer_s
+{
+    int x, y;
+    unsigned int width, height, rowbytes;
+    unsigned int rop;
+    /* nothing outside clip_x0..clip_x1, clip_y0..clip_y1 (exclusive) is drawn */
+    int clip_x0, clip_y0, clip_x1, clip_y1;
+    /* g15daemon_time_ns() at which the layer is removed, 0 to keep it */
+    unsigned long long expires;
+    unsigned int size;
+    unsigned char *pixels;
+} g15_layer_s;
+
+/* a panel's geometry, and the frame pipeline's kernels built for it */
+typedef struct g15_geometry_s
+{
+    const char *name;
+    unsigned int width;
+    unsigned int height;
+    unsigned int format;
+    /* bytes in a packed row, in the rows shown, and in a frame buffer */
+    unsigned int rowbytes;
+    unsigned int framesize;
+    unsigned int bufsize;
+    /* pack a frame of width*height bytes, 1 per pixel, into 'dst' */
+    void (*pack)(unsigned char *dst, const unsigned char *src);
+    /* compare 'buf' against the shadow copy of the last frame written. returns the height of the damaged
+       region in pixel rows (0 if the frames are identical), with its first and last rows in *first_row & *last_row */
+    int (*damage)(const unsigned char *shadow, const unsigned char *buf, int *first_row, int *last_row);
+    /* draw the part of 'layer' within screen pixels x0..x1, y0..y1 (exclusive) onto 'screen' */
+    void (*blit)(unsigned char *screen, g15_layer_t *layer, int x0, int y0, int x1, int y1);
+} g15_geometry_s;
+
 typedef struct lcd_s
 {
     g15daemon_t *masterlist;
     int lcd_type;
-    unsigned char buf[LCD_BUFSIZE];
+    /* the back buffer.  clients draw here and publish the result with g15daemon_send_refresh(), 
+       after which buf points to a fresh buffer holding a copy of the frame just published */
+    unsigned char *buf;
+    /* triple buffered frame storage, each the panel's bufsize - the back buffer (owned by the client), the
+       published frame awaiting the lcd thread, and the front buffer (owned by the lcd thread).  while the screen
+       is kept for a client which has gone, all three point to one copy of its last frame */
+    unsigned char *frames[3];
+    volatile unsigned int pending;
+    unsigned int back;
+    unsigned int front;
     int max_x;
     int max_y;
     int connection;
@@ -180,19 +459,37 @@ typedef struct lcd_s
     unsigned int usr_foreground;
     /* set to 1 if screen is never to be user-selectable */
     unsigned int never_select;
+    /* frame rate limit for this screen, 0 to use the global limit */
+    unsigned int max_fps;
+    /* set to 1 while this is the screen on the lcd.  changed only with lcdlist_mutex held */
+    volatile unsigned int foreground;
+    /* priority class (G15_PRIORITY_*), and how long the screen is shown before the next is rotated in.  0 to
+       use the global setting.  change them with g15daemon_lcd_set_priority() & g15daemon_lcd_set_rotation() */
+    unsigned int priority;
+    unsigned int rotate_msecs;
+    /* set while a new screen is waiting for its first frame before taking the lcd */
+    volatile unsigned int wants_foreground;
+    /* the screen's place on the screen list */
+    lcdnode_t *node;
+    /* overlay layers, and the frame with them drawn over it.  changed only with layers_lock held, though
+       nlayers may be read without it */
+    pthread_mutex_t layers_lock;
+    g15_layer_t *layers[G15_LAYERS];
+    volatile unsigned int nlayers;
+    unsigned char *composed;
+    int composed_valid;
+    /* the part of composed to draw again, in whole bytes.  empty if damage_x0 >= damage_x1 */
+    int damage_x0, damage_y0, damage_x1, damage_y1;
+    g15_lcdstats_t stats;
+    /* events for the screen's plugin or client.  NULL while the screen is kept for a client which has gone.
+       changed only with lcdlist_mutex held */
+    g15_evring_t *events;
     /* only used for plugins */
     plugin_t *g15plugin;
     
 } lcd_s;
 
 
-typedef struct plugin_event_s
-{
-    unsigned int event;
-    unsigned long value;
-    lcd_t *lcd;
-} plugin_event_s;
-
 
 struct lcdnode_s {
     g15daemon_t *list;
@@ -200,51 +497,308 @@ struct lcdnode_s {
     lcdnode_t *next;
     lcdnode_t *last_priority;
     lcd_t *lcd;
+    /* slot number in the low bits, and the slot's generation above them.  ids are not reused for a long while */
+    unsigned int id;
+    /* the screen the cycle key goes to from this one */
+    lcdnode_t *cycle_next;
+    /* once removed, the node waits here until no reader can still be looking at it */
+    lcdnode_t *next_retired;
+    unsigned long retired_epoch;
+    /* neighbours in the ring of screens of the same priority class */
+    lcdnode_t *class_prev;
+    lcdnode_t *class_next;
 }lcdnode_s;
 
+/* registry of screens by id.  a free slot is on the free list, and bumps its generation when reused */
+typedef struct g15_slot_s
+{
+    lcdnode_t *node;
+    unsigned int generation;
+    int next_free;
+} g15_slot_s;
+
+/* foreground arbitration.  changed only with lcdlist_mutex held */
+typedef struct g15_arbiter_s
+{
+    /* screens of each priority class, as rings in the order they joined it.  NULL if there are none */
+    lcdnode_t *classes[G15_PRIORITY_CLASSES];
+    unsigned int counts[G15_PRIORITY_CLASSES];
+    /* the screen the first of the alerts showing took the lcd from, to go back to afterwards */
+    lcdnode_t *preempted;
+    /* when the alert showing is over, and when the screen showing is rotated away from.  0 if never */
+    unsigned long long alert_end;
+    unsigned long long rotate_at;
+    /* settings from the Global section */
+    unsigned int alert_msecs;
+    unsigned int rotate_msecs;
+    unsigned int new_to_front;
+    /* the thread which ends alerts & rotates screens on time, and its wakeup */
+    pthread_t thread;
+    g15_mailbox_t wake;
+    int running;
+    volatile int stop;
+} g15_arbiter_s;
+
+/* one keyboard, with its screens, lcd pipeline & threads.  keyboards share nothing but the config, so one which is
+   slow to take frames or read keys holds up nobody else */
 struct g15daemon_s
 {
+    /* the keyboard's own lock, guarding its screen list & everything said to be changed only with it held */
+    pthread_mutex_t lcdlist_mutex;
+    /* the keyboard's backend, its number, and every keyboard the daemon drives by number.  all set before any
+       threads start, and never changed */
+    g15_device_t *device;
+    /* the keyboard's lcd panel.  frames on its screens are the panel's size */
+    const g15_geometry_t *geometry;
+    unsigned int devno;
+    g15daemon_t **devices;
+    unsigned int ndevices;
     lcdnode_t *head;
     lcdnode_t *tail;
-    lcdnode_t *current;
-    void *(*keyboard_handler)(void*);
+    /* the screen on the lcd.  changed only with lcdlist_mutex held, but the keyboard & lcd threads read it
+       without the lock, between uf_lcdnode_enter() and uf_lcdnode_leave() */
+    lcdnode_t * volatile current;
+    /* keypresses for the OS keyboard handler plugin */
+    g15_evring_t kb_events;
+    /* the key state last handled, and when the cycle key went down.  only touched by the keyboard thread */
+    unsigned long last_keys;
+    unsigned long long cycle_pressed;
     struct passwd *nobody;
     volatile unsigned long numclients;
     configfile_t *config;
     unsigned int kb_backlight_state; // master state
     unsigned int remote_keyhandler_sock;
+    /* the screen of the client which has taken over the keys, if any.  changed only with lcdlist_mutex held */
+    lcd_t *remote_keyhandler;
+    /* copy of the last frame successfully written to the keyboard. only touched by the lcd thread */
+    unsigned char shadow_buf[G15_MAX_BUFSIZE];
+    /* set to 0 to force the next frame out to the device (eg after a reconnect) */
+    volatile unsigned int shadow_valid;
+    /* the frame being sent, snapshotted from the foreground screen */
+    unsigned char staging_buf[G15_MAX_BUFSIZE];
+    unsigned long frames_written;
+    unsigned long frames_skipped;
+    /* refresh requests for the lcd thread */
+    g15_mailbox_t refresh;
+    g15_pacer_t pacer;
+    /* latency of the lcd pipeline: publish to start of usb write, and the write itself (lcd thread) */
+    g15_histogram_t swap_to_write;
+    g15_histogram_t usb_write;
+    /* screens by id (see linked_lists.c) */
+    g15_slot_t *slots;
+    unsigned int nslots;
+    int free_slot;
+    /* screens removed but not yet freed.  screen_epoch counts removals, and each reader thread records the
+       count as it starts looking at the current screen, or ~0 when it isn't */
+    lcdnode_t *retired_screens;
+    volatile unsigned long screen_epoch;
+    volatile unsigned long reader_epoch[G15_SCREEN_READERS];
+    /* which screen is shown (see g15_arbiter.c) */
+    g15_arbiter_t arbiter;
+    /* counters of screens which have been removed, including their keypress latencies & lost events */
+    g15_lcdstats_t retired;
+    g15_histogram_t key_to_client;
+    unsigned long events_lost;
+    /* listening stats socket, or -1 */
+    int stats_sock;
+    /* when the daemon started, and how long it took to write the first frame from a client to the lcd (us) */
+    unsigned long long started;
+    unsigned long long first_frame;
 }g15daemon_s;
 
-pthread_mutex_t lcdlist_mutex;
-pthread_mutex_t g15lib_mutex;
-
 /* server hello */
 #define SERV_HELO "G15 daemon HELLO"
 
 #ifdef G15DAEMON_BUILD
 /* internal g15daemon-only functions */
-void g15daemon_init_refresh();
-void g15daemon_quit_refresh();
-int uf_write_buf_to_g15(lcd_t *lcd);
-/* write a pbm format file 'filename' with image contained in 'buf' */
-int uf_screendump_pbm(unsigned char *buf,char *filename);
-int uf_read_keypresses(unsigned int *keypresses, unsigned int timeout);
+/* mailboxes - any number of threads may post, one may wait */
+int uf_mailbox_init(g15_mailbox_t *mbox);
+void uf_mailbox_post(g15_mailbox_t *mbox);
+/* take the posts made since the last take without blocking, returning how many there were */
+unsigned long uf_mailbox_take(g15_mailbox_t *mbox);
+/* as uf_mailbox_take(), but wait up to 'timeout' milliseconds (-1 for ever) for a post if there are none */
+unsigned long uf_mailbox_wait(g15_mailbox_t *mbox, int timeout);
+void uf_mailbox_close(g15_mailbox_t *mbox);
+int g15daemon_init_refresh(g15daemon_t *masterlist);
+void g15daemon_quit_refresh(g15daemon_t *masterlist);
+/* collect any refreshes posted since the last wait without blocking. returns the number collected */
+int uf_collect_refresh(g15daemon_t *masterlist);
+/* g15daemon_time_ns() in microseconds, for frame pacing & statistics */
+unsigned long long uf_gettime_us();
+/* sleep until the monotonic clock reaches 'deadline' microseconds */
+void uf_sleep_until_us(unsigned long long deadline);
+/* apply the configured frame rate limit for the named plugin to its screen, if one is set */
+void uf_lcd_config_fps(lcd_t *lcd, char *name);
+/* device backends.  a keyboard driven by the backend in a "name[@panel][:argument]" spec, or NULL if there is no
+   such backend or panel.  the spec must outlive the device */
+g15_device_t *uf_backend_new(char *spec);
+const g15_geometry_t *uf_backend_geometry(g15_device_t *dev);
+const char *uf_backend_name(g15_device_t *dev);
+void uf_backend_list();
+int uf_backend_init(g15_device_t *dev);
+/* hand the device over to its own thread.  must be called after any fork */
+int uf_backend_start(g15_device_t *dev);
+/* reattach to a device which has gone away */
+int uf_backend_reinit(g15_device_t *dev);
+void uf_backend_exit(g15_device_t *dev);
+void uf_backend_free(g15_device_t *dev);
+int uf_write_buf_to_g15(g15_device_t *dev, unsigned char *buf);
+/* device settings are cached, and only sent to the device when they change */
+int uf_set_lcd_brightness(g15_device_t *dev, unsigned int level);
+int uf_set_lcd_contrast(g15_device_t *dev, unsigned int level);
+/* number of settings sent to the device, and number found to be unchanged and not sent */
+void uf_backend_control_stats(g15_device_t *dev, unsigned long *written, unsigned long *suppressed);
+/* wake the lcd thread without publishing a frame, eg after a screen switch or state change */
+void uf_wake_lcd_thread(g15daemon_t *masterlist);
+/* take the newest frame published for 'lcd'.  only to be called from the lcd thread.  *published is set to
+   the time the frame was published if it is new since the last call, else 0 */
+unsigned char *uf_lcd_take_frame(lcd_t *lcd, unsigned long long *published);
+/* keep only the frame last published for 'lcd', whose client has gone, or give it its three frames back when
+   the client returns.  only to be called from the client's thread */
+void uf_lcd_frames_retain(lcd_t *lcd);
+void uf_lcd_frames_resume(lcd_t *lcd);
+/* panel geometries.  pick the best kernels for this cpu */
+void uf_geometry_init();
+/* the panel named by the 'len' bytes at 'name', or NULL if there is no such panel */
+const g15_geometry_t *uf_geometry_find(const char *name, size_t len);
+/* the g15's panel */
+const g15_geometry_t *uf_geometry_default();
+void uf_geometry_list();
+/* the compositor's blit kernel for each panel */
+#define G15_GEOMETRY_BLIT(id, name, width, height, format, bufsize) \
+    void uf_blit_##id(unsigned char *screen, g15_layer_t *layer, int x0, int y0, int x1, int y1);
+G15_GEOMETRIES(G15_GEOMETRY_BLIT)
+/* add a latency in microseconds to 'hist'.  only one thread may record to a histogram */
+void uf_hist_record(g15_histogram_t *hist, unsigned long long usecs);
+/* fold the counters of a screen which is going away into the totals.  lcdlist_mutex must be held */
+void uf_stats_retire(g15daemon_t *masterlist, lcd_t *lcd);
+/* create the stats socket at 'path'.  returns the socket, or -1 */
+int uf_stats_open(g15daemon_t *masterlist, char *path);
+/* serve connections to the stats socket until the daemon exits */
+void *uf_stats_thread(void *lcdlist);
+/* logging.  set the level for the given -d debug level */
+void uf_log_init(unsigned int debug);
+/* hand logging over to the writer thread, and back again, writing out anything still queued */
+int uf_log_start();
+void uf_log_exit();
+/* write a pbm format file 'filename' with the image of a 'geometry' panel contained in 'buf' */
+int uf_screendump_pbm(const g15_geometry_t *geometry, unsigned char *buf,char *filename);
+/* frame capture, of a keyboard with a 'geometry' panel.  open 'path' to record every frame written to the lcd
+   (only screenshots are taken if path is empty) */
+int uf_capture_open(const g15_geometry_t *geometry, char *path);
+int uf_capture_start();
+/* write out everything captured so far and stop.  the lcd thread must have finished */
+void uf_capture_exit();
+/* save the next frame on the lcd as a screenshot */
+void uf_capture_screenshot();
+/* pass the frame on the lcd to the capture thread. 'written' is the time it was written, or 0 if it had
+   already been written.  only to be called from the lcd thread */
+void uf_capture_frame(unsigned char *buf, unsigned long long written);
+/* number of frames recorded, and number lost because the capture thread fell behind */
+void uf_capture_stats(unsigned long *recorded, unsigned long *dropped);
+/* wait up to 'timeout' ms for the key state to change.  *time is set to when the change was read from the device */
+int uf_read_keypresses(g15_device_t *dev, unsigned int *keypresses, unsigned long long *time, unsigned int timeout);
+/* pass a change of key state read at 'time' to the foreground screen and the keyboard handlers */
+int uf_send_key_event(lcd_t *lcd, unsigned long keys, unsigned long long time);
+/* event rings.  start draining 'ring', which belongs to a screen or the keyboard handlers of 'masterlist', from
+   the calling thread, passing each event to 'handler'.  returns a descriptor which becomes readable when events
+   are waiting, or -1 */
+int uf_evring_subscribe(g15daemon_t *masterlist, g15_evring_t *ring, void *handler);
+/* as uf_evring_subscribe(), but rather than a mailbox being posted, notify(arg) is called by the keyboard thread
+   (with lcdlist_mutex held) for each event published.  notify must not block */
+int uf_evring_subscribe_notify(g15daemon_t *masterlist, g15_evring_t *ring, void *handler, void (*notify)(void *arg), void *arg);
+/* stop draining 'ring'.  lcdlist_mutex must be held */
+void uf_evring_unsubscribe(g15_evring_t *ring);
+/* queue an event for the subscriber of 'ring'.  lcdlist_mutex must be held, so only one thread publishes at a time.
+   returns -1 if there is no subscriber or the ring is full */
+int uf_evring_publish(g15_evring_t *ring, lcd_t *lcd, unsigned int event, unsigned long value, unsigned long long timestamp);
+/* handle every event queued on 'ring', returning the number handled.  only to be called by the subscriber */
+int uf_evring_dispatch(g15_evring_t *ring);
+/* handle events queued on 'ring' as they arrive, until g15daemon_time_ns() reaches 'deadline' */
+void uf_evring_wait_until(g15_evring_t *ring, unsigned long long deadline);
+/* publish 'event' to every screen and keyboard handler which drains its own event ring */
+void uf_event_broadcast(g15daemon_t *masterlist, unsigned int event, unsigned long value);
+/* sum the keypress latencies of every ring into 'latency', returning the number of events lost.  lcdlist_mutex must be held */
+unsigned long uf_stats_events(g15daemon_t *masterlist, g15_histogram_t *latency);
 /* return the pid of a running copy of g15daemon, else -1 */
 int uf_return_running();
 /* create a /var/run/g15daemon.pid file, returning 0 on success else -1 */
 int uf_create_pidfile();
+/* plugin execution engine.  start the timer wheel, with up to 'workers' threads to run plugins on (0 for one per core) */
+int uf_engine_start(unsigned int workers);
+/* run 'plugin' on the worker pool rather than a thread of its own.  returns -1 if the engine isn't running */
+int uf_engine_add(plugin_t *plugin);
+/* stop the pooled plugin called 'name' as if it had quit.  returns -1 if no such plugin is pooled */
+int uf_engine_remove(char *name);
+/* stop the workers, and call the exit function of every plugin still running */
+void uf_engine_exit();
+/* number of workers started, plugins being run by them, and runs made.  returns how late the runs started */
+g15_histogram_t *uf_engine_stats(unsigned int *workers, unsigned int *plugins, unsigned long *runs);
+/* the time a plugin which last ran at 'last_run' is next due, 'msecs' later or now if that has passed */
+unsigned long long uf_plugin_next_run(unsigned long long last_run, unsigned int msecs);
 /* open & run all plugins in the given directory */
 int g15_open_all_plugins(g15daemon_t *masterlist, char *plugin_directory);
-/* linked lists */
-g15daemon_t *ll_lcdlist_init();
+/* after a config change, start plugins in the given directory which have been enabled, and stop those disabled */
+int uf_plugins_reload(g15daemon_t *masterlist, char *plugin_directory);
+/* linked lists.  one screen list for each keyboard */
+g15daemon_t *ll_lcdlist_init(const g15_geometry_t *geometry);
 void ll_lcdlist_destroy(g15daemon_t **masterlist);
+/* wait-free access to the current screen for the keyboard & lcd threads.  the screen returned, and the lcd
+   it points to, stay allocated until uf_lcdnode_leave() is called by the same 'reader' */
+lcdnode_t *uf_lcdnode_enter(g15daemon_t *masterlist, int reader);
+void uf_lcdnode_leave(g15daemon_t *masterlist, int reader);
+/* wait until no reader can still be looking at anything unlinked from a screen before the call */
+void uf_lcdnode_synchronize(g15daemon_t *masterlist);
+/* bring 'node' to the front.  lcdlist_mutex must be held */
+void uf_lcdnode_set_current(g15daemon_t *masterlist, lcdnode_t *node);
+/* the screen with the given id, or NULL if it has gone.  lcdlist_mutex must be held */
+lcdnode_t *uf_lcdnode_lookup(g15daemon_t *masterlist, unsigned int id);
+/* work out the cycle key's route through the screens again.  lcdlist_mutex must be held */
+void ll_relink_cycle(g15daemon_t *masterlist);
+/* 1 if the cycle key may bring 'node' to the front.  lcdlist_mutex must be held */
+int ll_selectable(g15daemon_t *masterlist, lcdnode_t *node);
+/* foreground arbitration.  start the thread which ends alerts & rotates screens on time */
+int uf_arbiter_start(g15daemon_t *masterlist);
+void uf_arbiter_exit(g15daemon_t *masterlist);
+/* the following must be called with lcdlist_mutex held.  a screen is added, or removed.  the screen list
+   is updated first */
+void uf_arbiter_add(g15daemon_t *masterlist, lcdnode_t *node);
+void uf_arbiter_remove(g15daemon_t *masterlist, lcdnode_t *node);
+/* 'node' asks for the lcd, and gets it unless an alert is showing.  if one is, it gets it afterwards */
+void uf_arbiter_request(g15daemon_t *masterlist, lcdnode_t *node);
+/* the user brought 'node' to the front with the cycle key */
+void uf_arbiter_selected(g15daemon_t *masterlist, lcdnode_t *node);
+/* the user dismissed the alert showing.  returns 0 if there wasn't one */
+int uf_arbiter_dismiss(g15daemon_t *masterlist);
+/* a new screen published its first frame - bring it to the front if it was waiting to be.  takes the lock */
+void uf_arbiter_first_frame(lcd_t *lcd);
+/* draw the layers of 'lcd' over 'frame' into 'out', redrawing only what has changed unless 'fresh' says
+   the frame is new.  expired layers are removed.  returns when the next layer expires, or 0 if none will.
+   only to be called from the lcd thread */
+unsigned long long uf_layers_compose(lcd_t *lcd, unsigned char *frame, int fresh, unsigned char *out);
+/* free the layers of a screen being freed */
+void uf_layers_free(lcd_t *lcd);
+/* as g15daemon_wait_refresh(), but give up when g15daemon_time_ns() reaches 'deadline' (0 to wait for
+   ever).  returns the number of refreshes, 0 if the deadline passed first, or -1 if the daemon is exiting */
+int uf_wait_refresh_until(g15daemon_t *masterlist, unsigned long long deadline);
 
 /* open and parse config file */
 int uf_conf_open(g15daemon_t *list, char *filename);
-/* write the config file with all keys/sections */
+/* write the config file with all keys/sections.  the file is replaced in one go, never left half written */
 int uf_conf_write(g15daemon_t *list,char *filename);
+/* save the config to the file it was read from, if it has changed */
+int uf_conf_flush(g15daemon_t *list);
+/* fork a process which keeps the daemon's privileges to save 'filename' for it once they are dropped.  to be
+   called before any other thread is started */
+int uf_conf_writer_start(char *filename);
+/* stop the writer, once the config has been saved for the last time */
+void uf_conf_writer_exit();
 /* free all memory used by the config subsystem */
 void uf_conf_free(g15daemon_t *list);
+/* watch 'filename' for changes, merging them into the running config and calling changed(masterlist)
+   before sending G15_EVENT_CONFIG_CHANGED out */
+int uf_conf_watch_start(g15daemon_t *masterlist, char *filename, void (*changed)(g15daemon_t *masterlist));
+void uf_conf_watch_exit();
 /* search the list for valid key called "key" in section named "section" return pointer to item or NULL */
 config_items_t* uf_search_confitem(config_section_t *section, char *key);
 /* generic handler for net clients */
@@ -252,10 +806,14 @@ int internal_generic_eventhandler(plugin_event_t *myevent);
 #endif
 
 /* the following functions are available for use by plugins */
-/* send notification of LCD buffer update */
+/* publish the frame drawn into lcd->buf and send notification of LCD buffer update */
 void g15daemon_send_refresh(lcd_t *lcd);
-/* wait on notification of LCD buffer update */
-void g15daemon_wait_refresh();
+/* note that a frame of 'bytes' bytes has been received from a client for 'lcd'.  the time until it is published
+   with g15daemon_send_refresh() is reported by the stats socket */
+void g15daemon_frame_received(lcd_t *lcd, unsigned int bytes);
+/* wait on notification of LCD buffer update. returns the number of refreshes coalesced into this one,
+   or -1 if the daemon is exiting */
+int g15daemon_wait_refresh(g15daemon_t *masterlist);
 /* create a new section */
 config_section_t *g15daemon_cfg_load_section(g15daemon_t *masterlist,char *name);
 /* return string value from key in sectionname */
@@ -274,31 +832,91 @@ int g15daemon_cfg_write_int(config_section_t *section, char *key, int val);
 int g15daemon_cfg_write_bool(config_section_t *section, char *key, unsigned int val);
 /* remoe a key/value pair from named section */
 int g15daemon_cfg_remove_key(config_section_t *section, char *key);
+/* save changes to the config file now, rather than waiting for them to be saved with others.  returns -1 on failure */
+int g15daemon_cfg_save(g15daemon_t *masterlist);
 
 /* send event to foreground client's eventlistener */
 int g15daemon_send_event(void *caller, unsigned int event, unsigned long value);
+/* keypresses for 'lcd' are normally handed to its event handler on the keyboard thread.  once this is called they
+   are queued instead, and handled on the calling thread by g15daemon_event_dispatch().  returns a descriptor which
+   becomes readable when events are waiting, or -1.  plugins run by g15daemon are subscribed automatically */
+int g15daemon_event_subscribe(lcd_t *lcd);
+/* call the event handler of 'lcd' for every event queued since the last dispatch.  returns the number handled */
+int g15daemon_event_dispatch(lcd_t *lcd);
+/* stop queueing events for 'lcd', and close the descriptor from g15daemon_event_subscribe().  events are
+   handed to the event handler on the keyboard thread again */
+void g15daemon_event_unsubscribe(lcd_t *lcd);
 /* open named plugin */
 void * g15daemon_dlopen_plugin(char *name,unsigned int library);
 /* close plugin with handle <handle> */
 int g15daemon_dlclose_plugin(void *handle) ;
-/* syslog wrapper */
+/* syslog wrapper.  messages are queued for a writer thread, and written in order */
 int g15daemon_log (int priority, const char *fmt, ...);
+/* the least important priority being logged, set from the -d option at startup */
+extern int g15daemon_loglevel;
+/* level-gated logging - when 'priority' isn't being logged, the arguments aren't evaluated.  messages less
+   important than G15_LOG_MAX aren't compiled in at all (eg build with -DG15_LOG_MAX=LOG_INFO to drop debug) */
+#ifndef G15_LOG_MAX
+#define G15_LOG_MAX LOG_DEBUG
+#endif
+#define G15_LOG(priority, ...) \
+    do { if((priority) <= G15_LOG_MAX && (priority) <= g15daemon_loglevel) g15daemon_log(priority, __VA_ARGS__); } while(0)
+#define G15_INFO(...) G15_LOG(LOG_INFO, __VA_ARGS__)
+#define G15_DEBUG(...) G15_LOG(LOG_DEBUG, __VA_ARGS__)
 /* cycle from displayed screen to next on list */
 void g15daemon_lcdnode_cycle(g15daemon_t *masterlist);
 /* add new screen */
 lcdnode_t *g15daemon_lcdnode_add(g15daemon_t **masterlist) ;
 /* remove screen */
 void g15daemon_lcdnode_remove (lcdnode_t *oldnode);
+/* keep the screen of a client which has gone, showing its last frame, with nothing else allocated for it:
+   its counters are added to the totals, and its event queue, its histogram and all but one frame are freed.
+   call from the client's thread, after it has stopped drawing and handling events */
+void g15daemon_lcd_detach(lcd_t *lcd);
+/* make a screen kept by g15daemon_lcd_detach() ready for a returning client to draw on */
+void g15daemon_lcd_reattach(lcd_t *lcd);
+/* the keyboard numbered 'devno' (from 0, in the order given on the command line), or NULL if there is none.
+   screens added to its list are shown on that keyboard */
+g15daemon_t *g15daemon_device(g15daemon_t *masterlist, unsigned int devno);
+/* set the priority class of a screen to one of G15_PRIORITY_*.  a screen made an alert is shown straight
+   away, or after any alerts already showing, for the configured "Alert Time (seconds)" and is then made a
+   normal screen again.  returns -1 if 'priority' isn't valid */
+int g15daemon_lcd_set_priority(lcd_t *lcd, unsigned int priority);
+/* show the screen for 'msecs' before rotating to the next, when screens are rotated.  0 for the default */
+void g15daemon_lcd_set_rotation(lcd_t *lcd, unsigned int msecs);
+/* put a 'width' x 'height' overlay at x,y over the screen's frame as layer 'layer' (1 to G15_LAYERS),
+   combined using 'rop' (G15_ROP_*).  'pixels' are packed like the lcd buffer, in rows of (width+7)/8 bytes.
+   a layer already there is replaced, but keeps its clip rectangle.  the layer is removed after
+   'expire_msecs', unless that is 0.  returns -1 if an argument isn't valid */
+int g15daemon_layer_set(lcd_t *lcd, unsigned int layer, int x, int y, unsigned int width, unsigned int height,
+                        unsigned int rop, const unsigned char *pixels, unsigned int expire_msecs);
+/* draw only the part of 'layer' inside the given rectangle.  a width or height of 0 removes the clip.
+   returns -1 if there is no such layer */
+int g15daemon_layer_clip(lcd_t *lcd, unsigned int layer, int x, int y, unsigned int width, unsigned int height);
+/* remove 'layer'.  returns -1 if there is no such layer */
+int g15daemon_layer_remove(lcd_t *lcd, unsigned int layer);
 
 /* handy function from xine_utils.c */
 void *g15daemon_xmalloc(size_t size) ;
+/* monotonic clock in nanoseconds.  unaffected by changes to the wallclock, and never wraps */
+unsigned long long g15daemon_time_ns();
+/* sleep until g15daemon_time_ns() reaches 'deadline'.  sleeping to deadlines advanced by a fixed period
+   keeps a cadence from drifting.  returns -1 if woken early because the daemon is exiting, else 0 */
+int g15daemon_sleep_until_ns(unsigned long long deadline);
+/* sleep for 'nsecs' nanoseconds */
+int g15daemon_sleep_ns(unsigned long long nsecs);
 /* threadsafe sleep */
 void g15daemon_sleep(int seconds);
-/* threadsafe millisecond sleep */
+/* threadsafe millisecond & microsecond sleeps */
 int g15daemon_msleep(int milliseconds) ;
-/* return current time in milliseconds */
+int g15daemon_usleep(int useconds);
+/* return current time in milliseconds.  wraps - use g15daemon_time_ns() */
 unsigned int g15daemon_gettime_ms();
 /* convert 1byte/pixel buffer to internal g15 format */
 void g15daemon_convert_buf(lcd_t *lcd, unsigned char * orig_buf);
+/* set the M-key LEDs on the keyboard of 'masterlist' */
+int g15daemon_set_mleds(g15daemon_t *masterlist, unsigned int leds);
+/* set the backlight level (0-2) of the keyboard of 'masterlist' */
+int g15daemon_set_kb_backlight(g15daemon_t *masterlist, unsigned int level);
 
 #endif
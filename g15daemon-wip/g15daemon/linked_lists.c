@@ -34,11 +34,21 @@ extern lcd_t *keyhandler;
 extern unsigned int client_handles_keys;
 extern plugin_info_t *generic_info;
 
-lcd_t static * ll_create_lcd () {
+lcd_t static * ll_create_lcd (const g15_geometry_t *geometry) {
 
     lcd_t *lcd = g15daemon_xmalloc (sizeof (lcd_t));
-    lcd->max_x = LCD_WIDTH;
-    lcd->max_y = LCD_HEIGHT;
+    int i;
+
+    for(i = 0; i < 3; i++)
+        lcd->frames[i] = g15daemon_xmalloc(geometry->bufsize);
+    lcd->back = 0;
+    lcd->pending = 1;
+    lcd->front = 2;
+    lcd->buf = lcd->frames[lcd->back];
+    lcd->stats.recv_to_swap = g15daemon_xmalloc(sizeof(g15_histogram_t));
+    lcd->events = g15daemon_xmalloc(sizeof(g15_evring_t));
+    lcd->max_x = geometry->width;
+    lcd->max_y = geometry->height;
     lcd->backlight_state = G15_BRIGHTNESS_MEDIUM;
     lcd->mkey_state = 0;
     lcd->contrast_state = G15_CONTRAST_MEDIUM;
@@ -47,44 +57,209 @@ lcd_t static * ll_create_lcd () {
     lcd->g15plugin = g15daemon_xmalloc(sizeof (plugin_s)); 
     lcd->g15plugin->plugin_handle = NULL;
     lcd->g15plugin->info = (void*)&generic_info;
+    pthread_mutex_init(&lcd->layers_lock, NULL);
     
     return (lcd);
 }
 
-static void ll_quit_lcd (lcd_t * lcd) {
+/* screens are kept on a circular list in the order they were added, for walking with lcdlist_mutex held,
+   and in a registry of slots so that they can be found by id.  the cycle key's route through the screens
+   is worked out whenever they change, so cycling is a single step.
+
+   the keyboard & lcd threads read masterlist->current without the lock, so a removed screen isn't freed
+   straight away.  it is retired with the count of removals so far, and freed once every reader thread has
+   either left the current screen alone or started looking at it after the removal */
+
+static void ll_free_lcd (lcd_t *lcd) {
+    uf_layers_free(lcd);
+    /* a kept screen's frames are all one */
+    if(lcd->frames[1] != lcd->frames[0])
+        free (lcd->frames[1]);
+    if(lcd->frames[2] != lcd->frames[0])
+        free (lcd->frames[2]);
+    free (lcd->frames[0]);
+    free (lcd->stats.recv_to_swap);
+    free (lcd->events);
     free (lcd->g15plugin);
     free (lcd);
 }
 
+static void ll_free_node (lcdnode_t *node) {
+    ll_free_lcd(node->lcd);
+    free (node);
+}
+
+/* lcdlist_mutex must be held */
+static void ll_reclaim (g15daemon_t *masterlist) {
+    unsigned long oldest = ~0UL;
+    lcdnode_t **pnode, *node;
+    int i;
+
+    /* pairs with the barrier in uf_lcdnode_enter() */
+    __sync_synchronize();
+    for(i = 0; i < G15_SCREEN_READERS; i++)
+        if(masterlist->reader_epoch[i] < oldest)
+            oldest = masterlist->reader_epoch[i];
+    for(pnode = &masterlist->retired_screens; (node = *pnode) != NULL; ) {
+        if(node->retired_epoch <= oldest) {
+            *pnode = node->next_retired;
+            ll_free_node(node);
+        } else
+            pnode = &node->next_retired;
+    }
+}
+
+static void ll_retire (g15daemon_t *masterlist, lcdnode_t *node) {
+    /* the node is off the list and no longer current before the count moves on */
+    node->retired_epoch = __sync_add_and_fetch(&masterlist->screen_epoch, 1);
+    node->next_retired = masterlist->retired_screens;
+    masterlist->retired_screens = node;
+    ll_reclaim(masterlist);
+}
+
+lcdnode_t *uf_lcdnode_enter(g15daemon_t *masterlist, int reader) {
+    masterlist->reader_epoch[reader] = masterlist->screen_epoch;
+    __sync_synchronize();
+    return masterlist->current;
+}
+
+void uf_lcdnode_leave(g15daemon_t *masterlist, int reader) {
+    __sync_synchronize();
+    masterlist->reader_epoch[reader] = ~0UL;
+}
+
+/* readers stay between enter & leave only long enough to snapshot the screen, so this is a short wait */
+void uf_lcdnode_synchronize(g15daemon_t *masterlist) {
+    unsigned long epoch = __sync_add_and_fetch(&masterlist->screen_epoch, 1);
+    int i;
+
+    for(i = 0; i < G15_SCREEN_READERS; i++)
+        while(masterlist->reader_epoch[i] < epoch)
+            g15daemon_msleep(1);
+}
+
+static int ll_slot_add (g15daemon_t *masterlist, lcdnode_t *node) {
+    g15_slot_t *slot;
+    int i;
+
+    if(masterlist->free_slot < 0) {
+        unsigned int nslots = masterlist->nslots ? masterlist->nslots * 2 : 16;
+
+        if(nslots > G15_SLOT_MASK + 1)
+            return -1;
+        masterlist->slots = realloc(masterlist->slots, nslots * sizeof(g15_slot_t));
+        for(i = nslots - 1; i >= (int)masterlist->nslots; i--) {
+            masterlist->slots[i].node = NULL;
+            masterlist->slots[i].generation = 0;
+            masterlist->slots[i].next_free = masterlist->free_slot;
+            masterlist->free_slot = i;
+        }
+        masterlist->nslots = nslots;
+    }
+    i = masterlist->free_slot;
+    slot = &masterlist->slots[i];
+    masterlist->free_slot = slot->next_free;
+    slot->node = node;
+    node->id = (slot->generation << G15_SLOT_BITS) | i;
+    return 0;
+}
+
+static void ll_slot_remove (g15daemon_t *masterlist, lcdnode_t *node) {
+    g15_slot_t *slot = &masterlist->slots[node->id & G15_SLOT_MASK];
+
+    slot->node = NULL;
+    slot->generation++;
+    slot->next_free = masterlist->free_slot;
+    masterlist->free_slot = node->id & G15_SLOT_MASK;
+}
+
+lcdnode_t *uf_lcdnode_lookup(g15daemon_t *masterlist, unsigned int id) {
+    g15_slot_t *slot;
+
+    if((id & G15_SLOT_MASK) >= masterlist->nslots)
+        return NULL;
+    slot = &masterlist->slots[id & G15_SLOT_MASK];
+    return slot->node && slot->node->id == id ? slot->node : NULL;
+}
+
+/* the keyboard registry is filled in before any thread starts and never changes afterwards */
+g15daemon_t *g15daemon_device(g15daemon_t *masterlist, unsigned int devno) {
+    return devno < masterlist->ndevices ? masterlist->devices[devno] : NULL;
+}
+
+/* background screens, like the clock, are only selectable when there are no others */
+int ll_selectable (g15daemon_t *masterlist, lcdnode_t *node) {
+    unsigned int *counts = masterlist->arbiter.counts;
+
+    return !node->lcd->never_select &&
+        (node->lcd->priority != G15_PRIORITY_BACKGROUND || counts[G15_PRIORITY_NORMAL] + counts[G15_PRIORITY_ALERT] == 0);
+}
+
+/* point every screen at the first selectable screen before it in the list, wrapping round to itself if
+   need be, or at the clock screen if nothing is selectable.  walking forwards twice round means every
+   screen has passed a selectable screen by the second time */
+void ll_relink_cycle (g15daemon_t *masterlist) {
+    lcdnode_t *node = masterlist->tail, *last = NULL;
+    unsigned int count = masterlist->numclients + 1, i;
+
+    for(i = 0; i < count * 2; i++) {
+        node->cycle_next = last ? last : masterlist->tail;
+        if(ll_selectable(masterlist, node))
+            last = node;
+        node = node->next;
+    }
+}
 
-/* initialise a new masterlist, and add an initial node at the tail (used for the clock) */
-g15daemon_t *ll_lcdlist_init () {
+void uf_lcdnode_set_current(g15daemon_t *masterlist, lcdnode_t *node) {
+    masterlist->current->lcd->foreground = 0;
+    node->lcd->foreground = 1;
+    /* the screen must be complete before the readers can see it */
+    __sync_synchronize();
+    masterlist->current = node;
+}
+
+/* initialise a new masterlist for a keyboard with a 'geometry' panel, and add an initial node at the tail (used for the clock) */
+g15daemon_t *ll_lcdlist_init (const g15_geometry_t *geometry) {
     
     g15daemon_t *masterlist = NULL;
-    
-    pthread_mutex_init(&lcdlist_mutex, NULL);
-    pthread_mutex_lock(&lcdlist_mutex);
+    int i;
     
     masterlist = g15daemon_xmalloc(sizeof(g15daemon_t));
+    pthread_mutex_init(&masterlist->lcdlist_mutex, NULL);
+    pthread_mutex_lock(&masterlist->lcdlist_mutex);
+    masterlist->free_slot = -1;
+    masterlist->geometry = geometry;
+    masterlist->retired.recv_to_swap = g15daemon_xmalloc(sizeof(g15_histogram_t));
+    for(i = 0; i < G15_SCREEN_READERS; i++)
+        masterlist->reader_epoch[i] = ~0UL;
     
     masterlist->head = g15daemon_xmalloc(sizeof(lcdnode_t));
     
     masterlist->tail = masterlist->head;
     masterlist->current = masterlist->head;
     
-    masterlist->head->lcd = ll_create_lcd();
+    masterlist->head->lcd = ll_create_lcd(masterlist->geometry);
     masterlist->head->lcd->mkey_state = 0;
     masterlist->head->lcd->masterlist = masterlist;
+    masterlist->head->lcd->foreground = 1;
     /* first screen is the clock/menu */
     masterlist->head->lcd->g15plugin->info = NULL;
     
     masterlist->head->prev = masterlist->head;
     masterlist->head->next = masterlist->head;
     masterlist->head->list = masterlist;
-    masterlist->keyboard_handler = NULL;
     masterlist->numclients = 0;
+    ll_slot_add(masterlist, masterlist->head);
+    /* the clock is the first background screen */
+    masterlist->head->lcd->node = masterlist->head;
+    masterlist->head->lcd->priority = G15_PRIORITY_BACKGROUND;
+    masterlist->head->class_prev = masterlist->head->class_next = masterlist->head;
+    masterlist->arbiter.classes[G15_PRIORITY_BACKGROUND] = masterlist->head;
+    masterlist->arbiter.counts[G15_PRIORITY_BACKGROUND] = 1;
+    ll_relink_cycle(masterlist);
+    g15daemon_init_refresh(masterlist);
     
-    pthread_mutex_unlock(&lcdlist_mutex);
+    pthread_mutex_unlock(&masterlist->lcdlist_mutex);
     return masterlist;
 }
 
@@ -92,23 +267,30 @@ lcdnode_t *g15daemon_lcdnode_add(g15daemon_t **masterlist) {
     
     lcdnode_t *new = NULL;
     
-    pthread_mutex_lock(&lcdlist_mutex);
+    pthread_mutex_lock(&(*masterlist)->lcdlist_mutex);
     new = g15daemon_xmalloc(sizeof(lcdnode_t));
+    if(ll_slot_add(*masterlist, new) < 0) {
+        pthread_mutex_unlock(&(*masterlist)->lcdlist_mutex);
+        g15daemon_log(LOG_WARNING,"Too many screens - unable to add another");
+        free(new);
+        return NULL;
+    }
     new->prev = (*masterlist)->head;
     new->next = (*masterlist)->tail; 
-    new->lcd = ll_create_lcd();
+    new->lcd = ll_create_lcd((*masterlist)->geometry);
     new->lcd->masterlist = (*masterlist);
     new->last_priority = NULL;
     new->list = *masterlist;
     
     (*masterlist)->head->next=new;
-    (*masterlist)->current = new;
     
     (*masterlist)->head = new;
     (*masterlist)->head->list = *masterlist;
     (*masterlist)->numclients++;
+    /* the new screen is brought to the front, if at all, when its first frame arrives */
+    uf_arbiter_add(*masterlist, new);
     
-    pthread_mutex_unlock(&lcdlist_mutex);
+    pthread_mutex_unlock(&(*masterlist)->lcdlist_mutex);
     
     return new;
 }
@@ -116,66 +298,53 @@ lcdnode_t *g15daemon_lcdnode_add(g15daemon_t **masterlist) {
 /* cycle through connected client displays */
 void g15daemon_lcdnode_cycle(g15daemon_t *masterlist)
 {
-    lcdnode_t *current_screen = NULL;
-    pthread_mutex_lock(&lcdlist_mutex);
+    lcdnode_t *current_screen = NULL, *next_screen = NULL;
+    pthread_mutex_lock(&masterlist->lcdlist_mutex);
 
-skip:
     current_screen = masterlist->current;
-    
+    /* the cycle key dismisses an alert, rather than moving on from it */
+    if(uf_arbiter_dismiss(masterlist)) {
+        pthread_mutex_unlock(&masterlist->lcdlist_mutex);
+        return;
+    }
     g15daemon_send_event(current_screen->lcd, G15_EVENT_VISIBILITY_CHANGED, SCR_HIDDEN);
-    do
-    {
-        masterlist->current->lcd->usr_foreground=0;        
-
-        if(masterlist->tail == masterlist->current){
-            masterlist->current = masterlist->head;
-        }else{
-            masterlist->current = masterlist->current->prev;
-        }
-    } 
-    while (current_screen != masterlist->current);
+    current_screen->lcd->usr_foreground=0;
 
-    if(masterlist->tail == masterlist->current) {
-        masterlist->current = masterlist->head;
-    } else {
-        masterlist->current = masterlist->current->prev;
+    next_screen = current_screen->cycle_next;
+    /* plugins may have set never_select on a screen since the route was worked out */
+    if(!ll_selectable(masterlist, next_screen)) {
+        ll_relink_cycle(masterlist);
+        next_screen = current_screen->cycle_next;
     }
-    
-    if(masterlist->current->lcd->never_select==1 || (masterlist->numclients>0 && masterlist->current==masterlist->tail)) {
-       goto skip;
-    }
-
-    masterlist->current->last_priority =  masterlist->current;
-    pthread_mutex_unlock(&lcdlist_mutex);
-
-    masterlist->current->lcd->usr_foreground=1;
-    g15daemon_send_event(masterlist->current->lcd, G15_EVENT_VISIBILITY_CHANGED, SCR_VISIBLE);
+    next_screen->last_priority = next_screen;
+    next_screen->lcd->usr_foreground=1;
+    uf_lcdnode_set_current(masterlist, next_screen);
+    uf_arbiter_selected(masterlist, next_screen);
+    pthread_mutex_unlock(&masterlist->lcdlist_mutex);
 
+    g15daemon_send_event(next_screen->lcd, G15_EVENT_VISIBILITY_CHANGED, SCR_VISIBLE);
 }
 
 void g15daemon_lcdnode_remove (lcdnode_t *oldnode) {
     
     g15daemon_t **masterlist = NULL;
+    g15daemon_t *list;
     lcdnode_t **prev = NULL;
     lcdnode_t **next = NULL;
     if(oldnode == oldnode->list->tail)
         return;    
-    pthread_mutex_lock(&lcdlist_mutex);
+    pthread_mutex_lock(&oldnode->list->lcdlist_mutex);
     
     masterlist = &oldnode->list;
     prev = &oldnode->prev;
     next = &oldnode->next;
     
-    ll_quit_lcd(oldnode->lcd);
+    uf_stats_retire(*masterlist, oldnode->lcd);
+    if((*masterlist)->remote_keyhandler == oldnode->lcd)
+        (*masterlist)->remote_keyhandler = NULL;
+    if(oldnode->lcd->events)
+        uf_evring_unsubscribe(oldnode->lcd->events);
     (*masterlist)->numclients--;
-    if((*masterlist)->current == oldnode) {
-        if((*masterlist)->current!=(*masterlist)->head){
-            (*masterlist)->current = oldnode->next;
-        } else {
-            (*masterlist)->current = oldnode->prev;
-        }
-        (*masterlist)->current->lcd->state_changed = 1;
-    }
     
     if(&oldnode->lcd == (void*)keyhandler) {
         client_handles_keys = 0;
@@ -190,11 +359,54 @@ void g15daemon_lcdnode_remove (lcdnode_t *oldnode) {
         (*prev)->next = (*masterlist)->tail;
         (*masterlist)->head = oldnode->prev;
     }
-    g15daemon_send_refresh((*masterlist)->current->lcd);
+    ll_slot_remove(*masterlist, oldnode);
+    /* picks the screen to show instead, if this one was showing */
+    uf_arbiter_remove(*masterlist, oldnode);
+    uf_wake_lcd_thread(*masterlist);
 
-    free(oldnode);
+    /* the keyboard or lcd thread may still be looking at it.  it may be freed at once, and oldnode->list with it */
+    list = *masterlist;
+    ll_retire(list, oldnode);
     
-    pthread_mutex_unlock(&lcdlist_mutex);
+    pthread_mutex_unlock(&list->lcdlist_mutex);
+}
+
+void g15daemon_lcd_detach(lcd_t *lcd) {
+    g15daemon_t *masterlist = lcd->masterlist;
+    g15_histogram_t *recv_to_swap;
+    g15_evring_t *events;
+
+    pthread_mutex_lock(&masterlist->lcdlist_mutex);
+    /* if the client comes back, its counters start again from 0 */
+    uf_stats_retire(masterlist, lcd);
+    lcd->stats.frames = 0;
+    lcd->stats.dropped = 0;
+    lcd->stats.bytes = 0;
+    lcd->stats.recv_time = 0;
+    events = lcd->events;
+    recv_to_swap = lcd->stats.recv_to_swap;
+    if(events)
+        uf_evring_unsubscribe(events);
+    lcd->events = NULL;
+    lcd->stats.recv_to_swap = NULL;
+    pthread_mutex_unlock(&masterlist->lcdlist_mutex);
+
+    /* waits for the keyboard thread too, which looks at the event queue of the current screen unlocked */
+    uf_lcd_frames_retain(lcd);
+    free(events);
+    free(recv_to_swap);
+}
+
+void g15daemon_lcd_reattach(lcd_t *lcd) {
+    g15daemon_t *masterlist = lcd->masterlist;
+
+    if(lcd->events)
+        return;
+    uf_lcd_frames_resume(lcd);
+    pthread_mutex_lock(&masterlist->lcdlist_mutex);
+    lcd->stats.recv_to_swap = g15daemon_xmalloc(sizeof(g15_histogram_t));
+    lcd->events = g15daemon_xmalloc(sizeof(g15_evring_t));
+    pthread_mutex_unlock(&masterlist->lcdlist_mutex);
 }
 
 void ll_lcdlist_destroy(g15daemon_t **masterlist) {
@@ -205,10 +417,15 @@ void ll_lcdlist_destroy(g15daemon_t **masterlist) {
         g15daemon_lcdnode_remove((*masterlist)->head);
     }
     
-    free((*masterlist)->tail->lcd);
+    g15daemon_quit_refresh(*masterlist);
+    /* every thread has gone, so nothing retired can still be in use */
+    for(i = 0; i < G15_SCREEN_READERS; i++)
+        (*masterlist)->reader_epoch[i] = ~0UL;
+    ll_reclaim(*masterlist);
+    ll_free_lcd((*masterlist)->tail->lcd);
     free((*masterlist)->tail);
+    free((*masterlist)->slots);
+    free((*masterlist)->retired.recv_to_swap);
+    pthread_mutex_destroy(&(*masterlist)->lcdlist_mutex);
     free(*masterlist);
-    
-    pthread_mutex_destroy(&lcdlist_mutex);
 }
-
@@ -58,9 +58,36 @@ static unsigned int set_backlight = 0;
 struct lcd_t *keyhandler = NULL;
 
 static int loaded_plugins = 0;
+/* the cycle key was given on the command line, so the config file doesn't set it */
+static int cycle_cmdline_override = 0;
 
-/* send event to foreground client's eventlistener */
-int g15daemon_send_event(void *caller, unsigned int event, unsigned long value)
+/* hand an event to the screen 'lcd'.  if the screen's plugin or client drains its own event ring the event is
+   queued for it, otherwise its handler is called directly */
+static void screen_event(lcd_t *lcd, unsigned int event, unsigned long value, unsigned long long timestamp)
+{
+    plugin_event_t newevent;
+    int *(*plugin_listener)(plugin_event_t *newevent);
+
+    if(lcd->events && lcd->events->subscribed) {
+        pthread_mutex_lock(&lcd->masterlist->lcdlist_mutex);
+        if(lcd->events)
+            uf_evring_publish(lcd->events, lcd, event, value, timestamp);
+        pthread_mutex_unlock(&lcd->masterlist->lcdlist_mutex);
+        return;
+    }
+    if(!lcd->g15plugin->info)
+        return;
+    plugin_listener = (void*)lcd->g15plugin->info->event_handler;
+    newevent.event = event;
+    newevent.value = value;
+    newevent.lcd = lcd;
+    newevent.timestamp = timestamp;
+    (*plugin_listener)(&newevent);
+}
+
+/* send event to foreground client's eventlistener.  'timestamp' is when the event happened - for keypresses,
+   when the key state was read from the keyboard */
+static int send_event_at(void *caller, unsigned int event, unsigned long value, unsigned long long timestamp)
 {
 
     if(caller==NULL) {
@@ -69,76 +96,52 @@ int g15daemon_send_event(void *caller, unsigned int event, unsigned long value)
   
     switch(event) {
         case G15_EVENT_KEYPRESS: {
-            static unsigned long lastkeys;
-            if(!(value & cycle_key) && !(lastkeys & cycle_key)){
-                lcd_t *lcd = (lcd_t*)caller;
- 
+            lcd_t *lcd = (lcd_t*)caller;
+            g15daemon_t *masterlist = lcd->masterlist;
+
+            if(!(value & cycle_key) && !(masterlist->last_keys & cycle_key)){
                 if(!lcd->g15plugin->info)
                   break;
 
-                int *(*plugin_listener)(plugin_event_t *newevent) = (void*)lcd->g15plugin->info->event_handler;
-                plugin_event_t *newevent=g15daemon_xmalloc(sizeof(plugin_event_t));
-                newevent->event = event;
-                newevent->value = value;
-                newevent->lcd = lcd;
-                (*plugin_listener)((void*)newevent);
+                screen_event(lcd, event, value, timestamp);
         	/* hack - keyboard events are always sent from the foreground even when they aren't 
-                send keypress event to the OS keyboard_handler plugin */
-                if(lcd->masterlist->keyboard_handler != NULL && lcd->masterlist->remote_keyhandler_sock==0) {
-                    int *(*keyboard_handler)(plugin_event_t *newevent) = (void*)lcd->masterlist->keyboard_handler;
-                    (*keyboard_handler)((void*)newevent);
-                }
-                // if we have a remote keyhandler, send the key. FIXME: we should do this from the net plugin
-                if(lcd->masterlist->remote_keyhandler_sock!=0) {
-                          if((send(lcd->masterlist->remote_keyhandler_sock,(void *)&newevent->value,sizeof(newevent->value),0))<0)
-                                              g15daemon_log(LOG_WARNING,"Error in send: %s\n",strerror(errno));
-                }
+                send keypress event to the OS keyboard_handler plugin, or to the client which has taken over the keys */
+                pthread_mutex_lock(&masterlist->lcdlist_mutex);
+                if(masterlist->remote_keyhandler_sock==0)
+                    uf_evring_publish(&masterlist->kb_events, masterlist->tail->lcd, event, value, timestamp);
+                else if(masterlist->remote_keyhandler != NULL && masterlist->remote_keyhandler != lcd &&
+                        masterlist->remote_keyhandler->events)
+                    uf_evring_publish(masterlist->remote_keyhandler->events, masterlist->remote_keyhandler, event, value, timestamp);
+                pthread_mutex_unlock(&masterlist->lcdlist_mutex);
                 if(value & G15_KEY_LIGHT){ // the backlight key was pressed - maintain user-selected state 
-                  lcd_t *displaying = lcd->masterlist->current->lcd;  
-                  lcd->masterlist->kb_backlight_state++;
-                  lcd->masterlist->kb_backlight_state %= 3;
+                  lcd_t *displaying = masterlist->current->lcd;  
+                  masterlist->kb_backlight_state++;
+                  masterlist->kb_backlight_state %= 3;
                   displaying->backlight_state++;  
                   displaying->backlight_state %= 3; // limit to 0-2 inclusive 
                 }
-                if(value & G15_KEY_M1 && value & G15_KEY_M3) {
-                  static int scr_num=0;
-                  char filename[128];
-                  lcd_t *displaying = lcd->masterlist->current->lcd;
-                  sprintf(filename,"/tmp/g15daemon-sc-%i.pbm",scr_num);
-                  uf_screendump_pbm(displaying->buf,filename);
-                  scr_num++;
+                if(value & G15_KEY_M1 && value & G15_KEY_M3 && masterlist->devno == 0) {
+                  /* the lcd thread hands what is actually on the lcd to the capture thread to be saved.
+                     only the first keyboard is captured */
+                  uf_capture_screenshot();
+                  uf_wake_lcd_thread(masterlist);
                 }
-                free(newevent);
             }else{
                 /* hacky attempt to double-time the use of L1, if the key is pressed less than half a second, it cycles the screens.  If held for longer, the key is sent to the application for use instead */
-                lcd_t *lcd = (lcd_t*)caller;
-                g15daemon_t* masterlist = lcd->masterlist;
-                static unsigned int clicktime;
-                
                 if(value & cycle_key) {
-                    clicktime=g15daemon_gettime_ms();
+                    masterlist->cycle_pressed=timestamp;
                 }else{
-                    unsigned int unclick=g15daemon_gettime_ms();
-                    if ((unclick-clicktime)<500) {
+                    if ((timestamp-masterlist->cycle_pressed)<500000) {
                         g15daemon_lcdnode_cycle(masterlist);
                     }
-                    else 
+                    else if(lcd->g15plugin->info)
                     {
-                        plugin_event_t *clickevent=g15daemon_xmalloc(sizeof(plugin_event_t));
-                        int *(*plugin_listener)(plugin_event_t *clickevent) = (void*)lcd->g15plugin->info->event_handler;
-                        clickevent->event = event;
-                	clickevent->value = value|cycle_key;
-                	clickevent->lcd = lcd;
-                        (*plugin_listener)((void*)clickevent);
-                        clickevent->event = event;
-                	clickevent->value = value&~cycle_key;
-                	clickevent->lcd = lcd;
-                        (*plugin_listener)((void*)clickevent);
-                        free(clickevent);
+                        screen_event(lcd, event, value|cycle_key, masterlist->cycle_pressed);
+                        screen_event(lcd, event, value&~cycle_key, timestamp);
                     }
                 }
             }
-            lastkeys = value;
+            masterlist->last_keys = value;
             break;
         }
         case G15_EVENT_CYCLE_PRIORITY:{
@@ -151,133 +154,241 @@ int g15daemon_send_event(void *caller, unsigned int event, unsigned long value)
         case G15_EVENT_REQ_PRIORITY: {
             lcdnode_t *lcdnode=(lcdnode_t*)caller;
             /* client wants to switch priorities */
-            pthread_mutex_lock(&lcdlist_mutex);
+            pthread_mutex_lock(&lcdnode->list->lcdlist_mutex);
             if(lcdnode->list->current != lcdnode){
                 lcdnode->last_priority = lcdnode->list->current;
-                lcdnode->list->current = lcdnode;
+                uf_arbiter_request(lcdnode->list, lcdnode);
             }
             else {
                 if(lcdnode->list->current == lcdnode->last_priority){
-                    lcdnode->list->current = lcdnode->list->current->prev;
+                    uf_arbiter_request(lcdnode->list, lcdnode->list->current->prev);
                 } else{
                     if(lcdnode->last_priority != NULL) {
-                        lcdnode->list->current = lcdnode->last_priority;
+                        uf_arbiter_request(lcdnode->list, lcdnode->last_priority);
                         lcdnode->last_priority = NULL;
                     }
                     else
-                        lcdnode->list->current = lcdnode->list->current->prev;
+                        uf_arbiter_request(lcdnode->list, lcdnode->list->current->prev);
                 }
             }
-            pthread_mutex_unlock(&lcdlist_mutex);
-            g15daemon_send_refresh((lcd_t*)lcdnode->list->current->lcd);
+            pthread_mutex_unlock(&lcdnode->list->lcdlist_mutex);
+            uf_wake_lcd_thread(lcdnode->list);
             break;
         }
         case G15_EVENT_VISIBILITY_CHANGED:
-            g15daemon_send_refresh((lcd_t*)caller);
+            uf_wake_lcd_thread(((lcd_t*)caller)->masterlist);
         default: {
             lcd_t *lcd = (lcd_t*)caller;
             if(!lcd->g15plugin->info)
               break;
+            /* these can come from any thread, so they can't go through the screen's event ring */
             int *(*plugin_listener)(plugin_event_t *newevent) = (void*)lcd->g15plugin->info->event_handler;
-            plugin_event_t *newevent=g15daemon_xmalloc(sizeof(plugin_event_t));
-            newevent->event = event;
-            newevent->value = value;
-            newevent->lcd = lcd;
-            (*plugin_listener)((void*)newevent);
-            free(newevent);
+            plugin_event_t newevent;
+            newevent.event = event;
+            newevent.value = value;
+            newevent.lcd = lcd;
+            newevent.timestamp = timestamp;
+            (*plugin_listener)(&newevent);
         }
     }
     return 0;
 }
 
+int g15daemon_send_event(void *caller, unsigned int event, unsigned long value)
+{
+    return send_event_at(caller, event, value, uf_gettime_us());
+}
+
+int uf_send_key_event(lcd_t *lcd, unsigned long keys, unsigned long long time)
+{
+    return send_event_at(lcd, G15_EVENT_KEYPRESS, keys, time);
+}
+
 static void *keyboard_watch_thread(void *lcdlist){
     
     g15daemon_t *masterlist = (g15daemon_t*)(lcdlist);
     
     unsigned int keypresses = 0;
     int retval = 0;
-    static int lastkeys = 0;
+    unsigned long long key_time;
 
+    /* the device thread only passes on changes of key state, so there's nothing to do but wait for the next */
     while (!leaving) {
 
-        retval = uf_read_keypresses(&keypresses, 20);
-        /* every 2nd packet contains the codes we want.. immediately try again */
-        while (retval == G15_ERROR_TRY_AGAIN){
-            retval = uf_read_keypresses(&keypresses, 20);
-        }
+        retval = uf_read_keypresses(masterlist->device, &keypresses, &key_time, 500);
 
-        if(retval == G15_NO_ERROR && lastkeys != keypresses) {
-            g15daemon_send_event(masterlist->current->lcd, 
-                                 G15_EVENT_KEYPRESS, keypresses);
-            lastkeys = keypresses;
+        if(retval == G15_NO_ERROR) {
+            /* the subscribers record the latency as they handle the keypress */
+            uf_send_key_event(uf_lcdnode_enter(masterlist, G15_READER_KEYBOARD)->lcd, keypresses, key_time);
+            uf_lcdnode_leave(masterlist, G15_READER_KEYBOARD);
 
         }else if(retval == -ENODEV && LIBG15_VERSION>=1200) {
-          pthread_mutex_lock(&g15lib_mutex);
-          while((retval=re_initLibG15() != G15_NO_ERROR) && !leaving){
-             g15daemon_log(LOG_WARNING,"Keyboard has gone.. Retrying\n");
+          while((retval=uf_backend_reinit(masterlist->device) != G15_NO_ERROR) && !leaving){
+             g15daemon_log(LOG_WARNING,"Keyboard %u has gone.. Retrying\n",masterlist->devno);
              sleep(1);
           }
           if(!leaving) { 
-            masterlist->current->lcd->state_changed=1; 
-            g15daemon_send_refresh(masterlist->current->lcd);
+            /* the keyboard has lost its display contents */
+            masterlist->shadow_valid=0;
+            uf_lcdnode_enter(masterlist, G15_READER_KEYBOARD)->lcd->state_changed=1; 
+            uf_lcdnode_leave(masterlist, G15_READER_KEYBOARD);
+            uf_wake_lcd_thread(masterlist);
           }
-          pthread_mutex_unlock(&g15lib_mutex); 
         }
-      g15daemon_msleep(40);
     }
     return NULL;
 }
 
+/* return the earliest time at which the next frame for 'lcd' may be sent to the keyboard */
+static unsigned long long lcd_frame_deadline(g15_pacer_t *pacer, lcd_t *lcd) {
+    unsigned long long interval = 0;
+    unsigned int fps = pacer->max_fps;
+
+    if(lcd->max_fps && (fps == 0 || lcd->max_fps < fps))
+        fps = lcd->max_fps;
+    if(fps)
+        interval = 1000000ULL / fps;
+    /* if the keyboard is slow to accept frames, stretch the interval so the bus is never saturated */
+    if(pacer->max_load && pacer->write_avg * 100 / pacer->max_load > interval)
+        interval = pacer->write_avg * 100 / pacer->max_load;
+
+    return pacer->last_submit + interval;
+}
+
 static void *lcd_draw_thread(void *lcdlist){
 
     g15daemon_t *masterlist = (g15daemon_t*)(lcdlist);
-    /* unsigned int fps = 0; */
+    g15_pacer_t *pacer = &masterlist->pacer;
+    unsigned long long deadline, published, write_start, write_time, layers_expire = 0;
+    unsigned char *frame;
     lcd_t *displaying = masterlist->tail->lcd;
-    memset(displaying->buf,0,1024);
-    static int prev_state=0;
-    g15daemon_sleep(2);
+    memset(displaying->buf,0,masterlist->geometry->bufsize);
+    int first_row = 0, last_row = 0;
+    unsigned int backlight_state, contrast_state, mkey_state, state_changed;
 
     while (!leaving) {
-        /* wait until a client has updated */
-        g15daemon_wait_refresh();
-
-        pthread_mutex_lock(&lcdlist_mutex);
-        displaying = masterlist->current->lcd;
-                
-        /* monitor 'fps' - due to the TCP protocol, some frames will be bunched up.
-           discard excess to reduce load on the bus */
-        /* fps = 1000 / (g15daemon_gettime_ms() - lastscreentime); */
-        /* if the current screen is less than 20ms from the previous (equivelant to 50fps) delay it */
-        /* this allows a real-world fps of 40fps with no almost frame loss and reduces peak usb bus-load */
-                        
-        g15daemon_log(LOG_DEBUG,"Updating LCD");        
-        uf_write_buf_to_g15(displaying);
-        g15daemon_log(LOG_DEBUG,"LCD Update Complete");
+        /* wait until a client has updated, or an overlay on the screen showing expires. refreshes which
+           arrived while we were busy are collapsed into this one - the newest frame is the only one worth sending */
+        if(uf_wait_refresh_until(masterlist, layers_expire)<0)
+            break;
+
+        /* due to the TCP protocol, some frames will be bunched up.  rather than writing each as it 
+           arrives, hold the newest until its deadline - anything arriving in the meantime replaces it */
+        deadline = lcd_frame_deadline(pacer, uf_lcdnode_enter(masterlist, G15_READER_LCD)->lcd);
+        uf_lcdnode_leave(masterlist, G15_READER_LCD);
+        if(uf_gettime_us() < deadline) {
+            pacer->deferred++;
+            uf_sleep_until_us(deadline);
+            uf_collect_refresh(masterlist);
+        }
+
+        /* snapshot the newest frame and the screen state, without taking the list lock, so neither slow
+           usb transfers nor clients coming and going hold each other up */
+        displaying = uf_lcdnode_enter(masterlist, G15_READER_LCD)->lcd;
+        frame = uf_lcd_take_frame(displaying,&published);
+        if(displaying->nlayers)
+            layers_expire = uf_layers_compose(displaying, frame, published != 0, masterlist->staging_buf);
+        else {
+            memcpy(masterlist->staging_buf,frame,masterlist->geometry->bufsize);
+            layers_expire = 0;
+        }
+        backlight_state = displaying->backlight_state;
+        contrast_state = displaying->contrast_state;
+        mkey_state = displaying->mkey_state;
+        state_changed = __sync_lock_test_and_set(&displaying->state_changed, 0);
+        uf_lcdnode_leave(masterlist, G15_READER_LCD);
+
+        /* most clients resend static content on a timer - only frames which differ from
+           what is already on the lcd are sent across the bus */
+        if(!masterlist->shadow_valid || masterlist->geometry->damage(masterlist->shadow_buf,masterlist->staging_buf,&first_row,&last_row)) {
+            G15_DEBUG("Updating LCD (rows %i-%i damaged)",first_row,last_row);
+            pacer->last_submit = write_start = uf_gettime_us();
+            if(published)
+                uf_hist_record(&masterlist->swap_to_write, write_start - published);
+            if(uf_write_buf_to_g15(masterlist->device,masterlist->staging_buf)==G15_NO_ERROR) {
+                memcpy(masterlist->shadow_buf,masterlist->staging_buf,masterlist->geometry->bufsize);
+                masterlist->shadow_valid = 1;
+            } else
+                masterlist->shadow_valid = 0;
+            write_time = uf_gettime_us() - write_start;
+            uf_hist_record(&masterlist->usb_write, write_time);
+            pacer->write_avg = pacer->write_avg ? (pacer->write_avg * 7 + write_time) / 8 : write_time;
+            if(masterlist->frames_written++ == 0) {
+                masterlist->first_frame = write_start + write_time - masterlist->started;
+                g15daemon_log(LOG_INFO,"First frame on LCD %u %llums after startup",masterlist->devno,masterlist->first_frame/1000);
+            }
+            G15_DEBUG("LCD Update Complete (%lluus, average %lluus)",write_time,pacer->write_avg);
+        } else {
+            write_start = 0;
+            masterlist->frames_skipped++;
+            G15_DEBUG("LCD unchanged - frame skipped (%lu skipped so far)",masterlist->frames_skipped);
+        }
+        /* pass the frame on to be recorded, or saved if a screenshot is wanted */
+        if(masterlist->shadow_valid && masterlist->devno == 0)
+            uf_capture_frame(masterlist->shadow_buf, write_start);
         
-        if(prev_state!=displaying->backlight_state && set_backlight!=0) {
-              prev_state=displaying->backlight_state;
-              pthread_mutex_lock(&g15lib_mutex);
-              setLCDBrightness(displaying->backlight_state);
-              usleep(5);
-              setLCDBrightness(displaying->backlight_state);
-              setKBBrightness(displaying->backlight_state);
-              pthread_mutex_unlock(&g15lib_mutex);
-        }
-
-        if(displaying->state_changed){
-            pthread_mutex_lock(&g15lib_mutex);
-            setLCDContrast(displaying->contrast_state);
-            if(displaying->masterlist->remote_keyhandler_sock==0) // only allow mled control if the macro recorder isnt running
-              setLEDs(displaying->mkey_state);
-            pthread_mutex_unlock(&g15lib_mutex);
-            displaying->state_changed = 0;
-        }
-            
-        pthread_mutex_unlock(&lcdlist_mutex);
+        /* device settings are cached by the backend, so only real changes reach the keyboard.
+           a transfer which fails is retried on the next frame */
+        if(set_backlight!=0) {
+              uf_set_lcd_brightness(masterlist->device,backlight_state);
+              g15daemon_set_kb_backlight(masterlist,backlight_state);
+        }
+
+        if(state_changed){
+            uf_set_lcd_contrast(masterlist->device,contrast_state);
+            if(masterlist->remote_keyhandler_sock==0) // only allow mled control if the macro recorder isnt running
+              g15daemon_set_mleds(masterlist,mkey_state);
+        }
     }
     return NULL;
 }
 
+/* settings from the Global section which can be changed while the daemon runs */
+static void load_global_config(g15daemon_t *masterlist) {
+    config_section_t *global_cfg=g15daemon_cfg_load_section(masterlist,"Global");
+    int alert_secs, rotate_secs, new_to_front;
+
+    if(!cycle_cmdline_override){
+        cycle_key = 1==g15daemon_cfg_read_bool(global_cfg,"Use MR as Cycle Key",0)?G15_KEY_MR:G15_KEY_L1;
+    }
+    /* frame pacing: 0 disables the limit */
+    masterlist->pacer.max_fps = g15daemon_cfg_read_int(global_cfg,"Max FPS",40);
+    masterlist->pacer.max_load = g15daemon_cfg_read_int(global_cfg,"Max USB Load (percent)",50);
+    if(masterlist->pacer.max_load > 100)
+        masterlist->pacer.max_load = 100;
+    /* foreground arbitration.  alerts always give the lcd back, after a second at least.  0 disables rotation */
+    alert_secs = g15daemon_cfg_read_int(global_cfg,"Alert Time (seconds)",10);
+    rotate_secs = g15daemon_cfg_read_int(global_cfg,"Rotate Screens Every (seconds)",0);
+    new_to_front = g15daemon_cfg_read_bool(global_cfg,"New Screens Take Foreground",1);
+    pthread_mutex_lock(&masterlist->lcdlist_mutex);
+    masterlist->arbiter.alert_msecs = (alert_secs < 1 ? 1 : alert_secs) * 1000;
+    masterlist->arbiter.rotate_msecs = (rotate_secs < 0 ? 0 : rotate_secs) * 1000;
+    masterlist->arbiter.new_to_front = new_to_front;
+    pthread_mutex_unlock(&masterlist->lcdlist_mutex);
+}
+
+/* called by the config watcher after the file has been edited.  the screens & clients are left as they are */
+static void config_changed(g15daemon_t *masterlist) {
+    g15daemon_t *device;
+    lcdnode_t *node;
+    unsigned int d;
+
+    /* every keyboard shares the one config */
+    for(d = 0; (device = g15daemon_device(masterlist, d)) != NULL; d++) {
+        load_global_config(device);
+        pthread_mutex_lock(&device->lcdlist_mutex);
+        node = device->tail;
+        do {
+            lcd_t *lcd = node->lcd;
+            if(lcd->g15plugin && lcd->g15plugin->info && lcd->g15plugin->info->name)
+                uf_lcd_config_fps(lcd, lcd->g15plugin->info->name);
+            node = node->next;
+        } while(node != device->tail);
+        pthread_mutex_unlock(&device->lcdlist_mutex);
+    }
+    uf_plugins_reload(masterlist, PLUGINDIR);
+}
+
 void g15daemon_sighandler(int sig) {
     switch(sig){
          case SIGUSR1:
@@ -331,15 +442,24 @@ int main (int argc, char *argv[])
     pid_t daemonpid;
     int retval;
     int i;
-    int cycle_cmdline_override=0;
     struct sigaction new_action;
     cycle_key = G15_KEY_L1;
     unsigned char user[256];
     unsigned int lcdlevel = 1;
     
-    pthread_t keyboard_thread;
-    pthread_t lcd_thread;
+    /* one of each per keyboard, in the order given on the command line */
+    g15_device_t *backends[G15_MAX_DEVICES];
+    g15daemon_t *devices[G15_MAX_DEVICES];
+    pthread_t keyboard_threads[G15_MAX_DEVICES];
+    pthread_t lcd_threads[G15_MAX_DEVICES];
+    unsigned int ndevices = 0, d;
+    pthread_t stats_thread;
+    int stats_running = 0;
+    int joined = 0;
+    unsigned long long started = uf_gettime_us();
+    char stats_path[108];
     memset(user,0,256); 
+    memset(stats_path,0,sizeof(stats_path));
 
     for (i=0;i<argc;i++) {
         char daemonargs[20];
@@ -370,7 +490,7 @@ int main (int argc, char *argv[])
         
         if (!strncmp(daemonargs, "-h",2) || !strncmp(daemonargs, "--help",6)) {
             printf("G15Daemon version %s - %s\n",VERSION,uf_return_running() >= 0 ?"Loaded & Running":"Not Running");
-            printf("%s -h (--help) or -k (--kill) or -s (--switch) or -d (--debug) [level] or -v (--version) or -l (--lcdlevel) [0-2] \n\n -k\twill kill a previous incarnation",argv[0]);
+            printf("%s -h (--help) or -k (--kill) or -s (--switch) or -d (--debug) [level] or -v (--version) or -l (--lcdlevel) [0-2] or -b (--backend) name[@panel][:arg] \n\n -k\twill kill a previous incarnation",argv[0]);
             #ifdef LIBG15_VERSION
             #if LIBG15_VERSION >= 1200
             printf("\n -K\tturn off the keyboard backlight on the way out.");
@@ -378,6 +498,13 @@ int main (int argc, char *argv[])
             #endif
             printf("\n -h\tshows this help\n -s\tchanges the screen-switch key from L1 to MR (beware)\n -d\tdebug mode - stay in foreground and output all debug messages to STDERR\n -v\tshow version\n -l\tset default LCD backlight level\n");
             printf(" --set-backlight sets backlight individually for currently shown screen.\n\t\tDefault is to set backlight globally (keyboard default).\n");
+            printf(" -b\tselect the device backend (default libg15).  available backends: ");
+            uf_backend_list();
+            printf("\n\tnull[:usecs] runs without a keyboard, taking usecs per lcd write\n\trecord:file also appends every frame written to file\n\tscript:file also replays the key events in file\n");
+            printf("\tgiven more than once, drives a keyboard with each backend (up to %i)\n",G15_MAX_DEVICES);
+            printf("\t@panel sets the keyboard's lcd panel (default g15).  available panels: ");
+            uf_geometry_list();
+            printf("\n");
             exit(0);
         }
 
@@ -406,6 +533,21 @@ int main (int argc, char *argv[])
             }
         }
 
+        if (!strncmp(daemonargs, "-b",2) || !strncmp(daemonargs, "--backend",9)) {
+            if(argv[i+1]!=NULL){
+                if(ndevices==G15_MAX_DEVICES) {
+                    printf("No more than %i keyboards can be driven\n",G15_MAX_DEVICES);
+                    exit(1);
+                }
+                if((backends[ndevices]=uf_backend_new(argv[i+1]))==NULL) {
+                    printf("Unknown device backend or panel %s\n",argv[i+1]);
+                    exit(1);
+                }
+                ndevices++;
+                i++;
+            }
+        }
+
         if (!strncmp(daemonargs, "-l",2) || !strncmp(daemonargs, "--lcdlevel",7)) {
             if((argv[i+1])!=NULL)
              if(isdigit(argv[i+1][0])){
@@ -413,6 +555,8 @@ int main (int argc, char *argv[])
             }
         }
     }
+    uf_log_init(g15daemon_debug);
+    uf_geometry_init();
     if(g15daemon_debug){
         g15daemon_log(LOG_INFO, "G15Daemon %s Build Date: %s",PACKAGE_VERSION,BUILD_DATE);
         g15daemon_log(LOG_DEBUG, "Build OS: %s",BUILD_OS_NAME);
@@ -427,10 +571,6 @@ int main (int argc, char *argv[])
         exit(0);
     }
 
-    /* set libg15 debugging to our debug setting */
-    if(LIBG15_VERSION>=1200)
-        libg15Debug(g15daemon_debug);
-    
 #ifdef OSTYPE_DARWIN
      /* OS X: load codeless kext */
      retval = system("/sbin/kextload " "/System/Library/Extensions/libusbshield.kext");
@@ -447,14 +587,30 @@ int main (int argc, char *argv[])
 #endif
 
     /* init stuff here..  */
-    if((retval=initLibG15())!=G15_NO_ERROR){
-        g15daemon_log(LOG_ERR,"Unable to attach to the G15 Keyboard... exiting");
-        exit(1);
+    if(ndevices==0)
+        backends[ndevices++]=uf_backend_new("libg15");
+    for(d=0;d<ndevices;d++) {
+        if((retval=uf_backend_init(backends[d]))!=G15_NO_ERROR){
+            g15daemon_log(LOG_ERR,"Unable to attach to G15 Keyboard %u... exiting",d);
+            exit(1);
+        }
     }
 
     if(!g15daemon_debug)
         daemon(0,0);
 
+    /* /etc/g15daemon.conf belongs to root, and the daemon runs as nobody, so it is saved by a process of its own */
+    if(geteuid()==0 && uf_conf_writer_start("/etc/g15daemon.conf")<0)
+        g15daemon_log(LOG_WARNING,"Unable to start the config writer - the config will be saved at exit only");
+
+    /* from here on each keyboard is driven from its own thread */
+    for(d=0;d<ndevices;d++) {
+        if(uf_backend_start(backends[d])<0){
+            g15daemon_log(LOG_ERR,"Unable to start the device thread... exiting");
+            exit(1);
+        }
+    }
+
     if(uf_create_pidfile() == 0) {
         
         g15daemon_t *lcdlist;
@@ -464,6 +620,7 @@ int main (int argc, char *argv[])
         unsigned char location[1024];
 
         openlog("g15daemon", LOG_PID, LOG_USER);
+        uf_log_start();
         if(strlen((char*)user)==0){
             nobody = getpwnam("nobody");
         }else {
@@ -475,27 +632,42 @@ int main (int argc, char *argv[])
             g15daemon_log(LOG_WARNING,"BEWARE: running as effective uid %i\n",nobody->pw_uid);
         }
         
-        /* initialise the linked list */
-        lcdlist = ll_lcdlist_init();
-        lcdlist->nobody = nobody;
-
-        setLCDContrast(1); 
-        setLEDs(0);
-        lcdlist->kb_backlight_state=1;
-        lcdlist->current->lcd->backlight_state=lcdlevel;
-        setLCDBrightness(lcdlevel);
-
-#ifdef LIBG15_VERSION
-#if LIBG15_VERSION >= 1200
-        setKBBrightness(lcdlist->kb_backlight_state);
-#endif
-#endif                      
+        /* initialise a screen list for each keyboard.  the first is the one the daemon-wide services
+           (config, stats, capture & plugins) hang off */
+        for(d=0;d<ndevices;d++) {
+            devices[d] = ll_lcdlist_init(uf_backend_geometry(backends[d]));
+            devices[d]->device = backends[d];
+            devices[d]->devno = d;
+            devices[d]->devices = devices;
+            devices[d]->ndevices = ndevices;
+            devices[d]->nobody = nobody;
+            devices[d]->started = started;
+
+            uf_set_lcd_contrast(backends[d],1); 
+            g15daemon_set_mleds(devices[d],0);
+            devices[d]->kb_backlight_state=1;
+            devices[d]->current->lcd->backlight_state=lcdlevel;
+            uf_set_lcd_brightness(backends[d],lcdlevel);
+            g15daemon_set_kb_backlight(devices[d],devices[d]->kb_backlight_state);
+        }
+        lcdlist = devices[0];
         
         uf_conf_open(lcdlist, "/etc/g15daemon.conf");
         global_cfg=g15daemon_cfg_load_section(lcdlist,"Global");
-        if(!cycle_cmdline_override){
-            cycle_key = 1==g15daemon_cfg_read_bool(global_cfg,"Use MR as Cycle Key",0)?G15_KEY_MR:G15_KEY_L1;
+        for(d=0;d<ndevices;d++) {
+            devices[d]->config = lcdlist->config;
+            load_global_config(devices[d]);
         }
+        /* the stats socket lives in /var/run, so must be created before we drop privileges */
+        strncpy(stats_path,g15daemon_cfg_read_string(global_cfg,"Stats Socket","/var/run/g15daemon.stats"),sizeof(stats_path)-1);
+        if(uf_stats_open(lcdlist,stats_path)<0)
+            stats_path[0]=0;
+        /* as may the capture file */
+        uf_capture_open(lcdlist->geometry,g15daemon_cfg_read_string(global_cfg,"Capture File",""));
+        /* and the plugin cache lives in /var/cache, so its directory is handed to the user we run as now */
+        if(nobody!=NULL && (mkdir(G15_CACHE_DIR,0755)==0 || errno==EEXIST) &&
+           chown(G15_CACHE_DIR,nobody->pw_uid,nobody->pw_gid)<0 && geteuid()==0)
+            g15daemon_log(LOG_WARNING,"Unable to hand %s to uid %i: %s",G15_CACHE_DIR,nobody->pw_uid,strerror(errno));
 
 #ifndef OSTYPE_SOLARIS
                /* all other processes/threads should be seteuid nobody */
@@ -504,25 +676,19 @@ int main (int argc, char *argv[])
             setegid(nobody->pw_gid);
         }
 #endif
-        /* initialise the pthread condition for the LCD thread */
-        g15daemon_init_refresh(); 
-        pthread_mutex_init(&g15lib_mutex, NULL);
         pthread_attr_init(&attr);
 
         pthread_attr_setstacksize(&attr,512*1024); /* set stack to 512k - dont need 8Mb !! */
-        if (pthread_create(&keyboard_thread, &attr, keyboard_watch_thread, lcdlist) != 0) {
-            g15daemon_log(LOG_ERR,"Unable to create keyboard listener thread.  Exiting");
-            goto exitnow;
+        for(d=0;d<ndevices;d++) {
+            if (pthread_create(&keyboard_threads[d], &attr, keyboard_watch_thread, devices[d]) != 0) {
+                g15daemon_log(LOG_ERR,"Unable to create keyboard listener thread.  Exiting");
+                goto exitnow;
+            }
         }
 
         pthread_attr_setstacksize(&attr,128*1024); 
 
-        if (pthread_create(&lcd_thread, &attr, lcd_draw_thread, lcdlist) != 0) {
-            g15daemon_log(LOG_ERR,"Unable to create display thread.  Exiting");
-            goto exitnow;
-        }
-        g15daemon_log(LOG_INFO,"%s loaded\n",PACKAGE_STRING);
-        
+        /* the splash stays up until the first client frame replaces it */
         snprintf((char*)location,1024,"%s/%s",DATADIR,"g15daemon/splash/g15logo2.wbmp");
 	g15canvas *canvas = (g15canvas *)g15daemon_xmalloc (sizeof (g15canvas));
 	memset (canvas->buffer, 0, G15_BUFFER_LEN);
@@ -530,13 +696,44 @@ int main (int argc, char *argv[])
 	canvas->mode_reverse = 0;
 	canvas->mode_xor = 0;
         g15r_loadWbmpSplash(canvas,(char*)location);
-	memcpy (lcdlist->tail->lcd->buf, canvas->buffer, G15_BUFFER_LEN);
+        /* the splash is drawn for the g15's own panel */
+        for(d=0;d<ndevices;d++) {
+            if(devices[d]->geometry!=uf_geometry_default())
+                continue;
+            memcpy (devices[d]->tail->lcd->buf, canvas->buffer, G15_BUFFER_LEN);
+            uf_write_buf_to_g15(backends[d],devices[d]->tail->lcd->buf);
+        }
 	free (canvas);
-        uf_write_buf_to_g15(lcdlist->tail->lcd);
-	
+
+        /* each keyboard's lcd is drawn by a thread of its own, so one slow to take frames holds up no other */
+        for(d=0;d<ndevices;d++) {
+            if (pthread_create(&lcd_threads[d], &attr, lcd_draw_thread, devices[d]) != 0) {
+                g15daemon_log(LOG_ERR,"Unable to create display thread.  Exiting");
+                goto exitnow;
+            }
+        }
+
+        uf_capture_start();
+        for(d=0;d<ndevices;d++)
+            uf_arbiter_start(devices[d]);
+
+        if (lcdlist->stats_sock >= 0) {
+            if (pthread_create(&stats_thread, &attr, uf_stats_thread, lcdlist) != 0) {
+                g15daemon_log(LOG_WARNING,"Unable to create stats thread.");
+                close(lcdlist->stats_sock);
+                lcdlist->stats_sock = -1;
+            } else
+                stats_running = 1;
+        }
+        g15daemon_log(LOG_INFO,"%s loaded\n",PACKAGE_STRING);
+        
         snprintf((char*)location,1024,"%s",PLUGINDIR);
 
+        /* plugins are run by a pool of worker threads, one per core unless configured otherwise */
+        uf_engine_start(g15daemon_cfg_read_int(global_cfg,"Plugin Workers",0));
         loaded_plugins = g15_open_all_plugins(lcdlist,(char*)location);
+        /* pick up edits to the config file from now on */
+        uf_conf_watch_start(lcdlist, "/etc/g15daemon.conf", config_changed);
         
         new_action.sa_handler = g15daemon_sighandler;
         new_action.sa_flags = 0;
@@ -550,37 +747,69 @@ int main (int argc, char *argv[])
         } while( leaving == 0);
 
         g15daemon_log(LOG_INFO,"Leaving by request");
+        uf_conf_watch_exit();
+        for(d=0;d<ndevices;d++)
+            g15daemon_log(LOG_INFO,"%lu frames written to LCD %u, %lu unchanged frames skipped, %lu refreshes coalesced, %lu frames paced",
+                          devices[d]->frames_written,d,devices[d]->frames_skipped,devices[d]->refresh.coalesced,devices[d]->pacer.deferred);
+        {
+            g15_histogram_t *key_latency=g15daemon_xmalloc(sizeof(g15_histogram_t));
+            unsigned long keys=0, lost=0;
+            for(d=0;d<ndevices;d++) {
+                pthread_mutex_lock(&devices[d]->lcdlist_mutex);
+                lost+=uf_stats_events(devices[d],key_latency);
+                pthread_mutex_unlock(&devices[d]->lcdlist_mutex);
+            }
+            for(i=0;i<G15_HIST_BUCKETS;i++)
+                keys+=key_latency->counts[i];
+            if(keys)
+                g15daemon_log(LOG_INFO,"%lu key events delivered, %lluus on average from keyboard to client (worst %lluus)",
+                              keys,key_latency->total/keys,key_latency->max);
+            if(lost)
+                g15daemon_log(LOG_WARNING,"%lu events lost to full event rings",lost);
+            free(key_latency);
+        }
 
-        pthread_join(lcd_thread,NULL);
-        pthread_join(keyboard_thread,NULL);
+        for(d=0;d<ndevices;d++) {
+            pthread_join(lcd_threads[d],NULL);
+            pthread_join(keyboard_threads[d],NULL);
+            uf_arbiter_exit(devices[d]);
+        }
+        uf_engine_exit();
+        uf_capture_exit();
+        if(stats_running)
+            pthread_join(stats_thread,NULL);
         /* switch off the lcd backlight */
-        char *blank=g15daemon_xmalloc(G15_BUFFER_LEN);
-        writePixmapToLCD((unsigned char*)blank);
+        char *blank=g15daemon_xmalloc(G15_MAX_BUFSIZE);
+        for(d=0;d<ndevices;d++) {
+            uf_write_buf_to_g15(backends[d],(unsigned char*)blank);
+            uf_set_lcd_brightness(backends[d],0);
+            /* if SIGUSR1 was sent to kill us, switch off the keyboard backlight as well */
+            if(keyboard_backlight_off_onexit==1)
+              g15daemon_set_kb_backlight(devices[d],0);
+            uf_backend_exit(backends[d]);
+        }
         free(blank);
-        setLCDBrightness(0);
-#ifdef LIBG15_VERSION
-#if LIBG15_VERSION >= 1200
-        /* if SIGUSR1 was sent to kill us, switch off the keyboard backlight as well */
-        if(keyboard_backlight_off_onexit==1)
-          setKBBrightness(0);
-#endif
-#endif
-            
-#ifdef LIBG15_VERSION
-#if LIBG15_VERSION >= 1100
-        exitLibG15(); 
-#endif
-#endif
-        ll_lcdlist_destroy(&lcdlist);
+        joined = 1;
 
 exitnow:
     /* return to root privilages for the final countdown */
     seteuid(0);
     setegid(0);
+    uf_log_exit();
     closelog();
-    g15daemon_quit_refresh();
-    uf_conf_write(lcdlist,"/etc/g15daemon.conf");
+    /* anything changed since the config was last saved.  the lists are freed after their shared config, and
+       only once every thread using them has been joined */
+    uf_conf_flush(lcdlist);
+    uf_conf_writer_exit();
     uf_conf_free(lcdlist);
+    if(joined) {
+        for(d=0;d<ndevices;d++) {
+            ll_lcdlist_destroy(&devices[d]);
+            uf_backend_free(backends[d]);
+        }
+    }
+    if(stats_path[0])
+        unlink(stats_path);
     unlink("/var/run/g15daemon.pid");
     }
     return 0;
@@ -37,21 +37,21 @@
 #include <ctype.h>
 
 #include <sys/time.h>
+#include <time.h>
+#include <poll.h>
 
 #ifdef HAVE_CONFIG_H
 #include <config.h>
 #endif
 #include "g15daemon.h"
 #include <libg15.h>
-#include <stdarg.h>
-#include <libg15render.h>
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
 
-extern unsigned int g15daemon_debug;
 extern volatile int leaving;
 #define G15DAEMON_PIDFILE "/var/run/g15daemon.pid"
 
-pthread_cond_t lcd_refresh = PTHREAD_COND_INITIALIZER;
-
 
 /* if no exitfunc or eventhandler, member should be NULL */
 const plugin_info_t generic_info[] = {
@@ -75,43 +75,215 @@ void *g15daemon_xmalloc(size_t size) {
     return ptr;
 }
 
-static int refresh_pending=0;
-void g15daemon_init_refresh() {
-  pthread_condattr_t attr;
-  pthread_cond_init(&lcd_refresh, &attr);
+int uf_mailbox_init(g15_mailbox_t *mbox) {
+    mbox->posted = mbox->taken = mbox->coalesced = 0;
+#ifdef HAVE_SYS_EVENTFD_H
+    if((mbox->fd[0] = eventfd(0, EFD_NONBLOCK)) >= 0) {
+        mbox->fd[1] = mbox->fd[0];
+        return 0;
+    }
+#endif
+    if(pipe(mbox->fd) < 0) {
+        g15daemon_log(LOG_ERR, "Unable to create mailbox: %s", strerror(errno));
+        mbox->fd[0] = mbox->fd[1] = -1;
+        return -1;
+    }
+    fcntl(mbox->fd[0], F_SETFL, O_NONBLOCK);
+    fcntl(mbox->fd[1], F_SETFL, O_NONBLOCK);
+    return 0;
 }
 
-void g15daemon_send_refresh(lcd_t *lcd) {
-    if(lcd==lcd->masterlist->current->lcd||lcd->state_changed) {
-      pthread_cond_broadcast(&lcd_refresh);
-      refresh_pending++;
+void uf_mailbox_post(g15_mailbox_t *mbox) {
+    __sync_add_and_fetch(&mbox->posted, 1);
+#ifdef HAVE_SYS_EVENTFD_H
+    if(mbox->fd[0] == mbox->fd[1]) {
+        uint64_t one = 1;
+        write(mbox->fd[1], &one, sizeof(one));
+        return;
+    }
+#endif
+    /* if the pipe is full a wakeup is already pending */
+    write(mbox->fd[1], "", 1);
+}
+
+/* take whatever has been posted to the mailbox, returning the number of posts taken */
+unsigned long uf_mailbox_take(g15_mailbox_t *mbox) {
+    unsigned long gen, count;
+    char drain[64];
+
+    /* drain before sampling the generation, so that a post we miss here leaves the fd readable */
+    while(read(mbox->fd[0], drain, sizeof(drain)) > 0 && mbox->fd[0] != mbox->fd[1])
+        ;
+    __sync_synchronize();
+    gen = mbox->posted;
+    count = gen - mbox->taken;
+    mbox->taken = gen;
+    return count;
+}
+
+unsigned long uf_mailbox_wait(g15_mailbox_t *mbox, int timeout) {
+    struct pollfd pfd;
+    unsigned long count;
+
+    if((count = uf_mailbox_take(mbox)) > 0)
+        return count;
+    pfd.fd = mbox->fd[0];
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    poll(&pfd, 1, timeout);
+    return uf_mailbox_take(mbox);
+}
+
+void uf_mailbox_close(g15_mailbox_t *mbox) {
+    if(mbox->fd[0] >= 0)
+        close(mbox->fd[0]);
+    if(mbox->fd[1] >= 0 && mbox->fd[1] != mbox->fd[0])
+        close(mbox->fd[1]);
+    mbox->fd[0] = mbox->fd[1] = -1;
+}
+
+int g15daemon_init_refresh(g15daemon_t *masterlist) {
+    return uf_mailbox_init(&masterlist->refresh);
+}
+
+void uf_wake_lcd_thread(g15daemon_t *masterlist) {
+    uf_mailbox_post(&masterlist->refresh);
+}
+
+/* swap the back buffer with the published frame.  no locks are taken, so a client
+   never waits on the lcd thread or the usb bus to hand over a frame */
+static void uf_lcd_publish_frame(lcd_t *lcd) {
+    g15_lcdstats_t *stats = &lcd->stats;
+    unsigned int published = lcd->back;
+    unsigned int old;
+    unsigned long long now = uf_gettime_us();
+
+    stats->frame_time[published] = now;
+    do {
+        old = lcd->pending;
+    } while(!__sync_bool_compare_and_swap(&lcd->pending, old, published | LCD_FRAME_FRESH));
+
+    /* count the frame, and any it replaced before the lcd thread got to it */
+    stats->frames++;
+    if(old & LCD_FRAME_FRESH)
+        stats->dropped++;
+    if(stats->recv_time) {
+        uf_hist_record(stats->recv_to_swap, now - stats->recv_time);
+        stats->recv_time = 0;
+    }
+    stats->fps_frames++;
+    if(now - stats->fps_start >= 1000000) {
+        stats->fps = stats->fps_start ? stats->fps_frames * 1000000ULL / (now - stats->fps_start) : 0;
+        stats->fps_start = now;
+        stats->fps_frames = 0;
     }
+
+    lcd->back = old & LCD_FRAME_INDEX;
+    lcd->buf = lcd->frames[lcd->back];
+    /* clients may update their screen piecemeal, so the new back buffer starts as a copy of the last frame */
+    memcpy(lcd->buf, lcd->frames[published], lcd->masterlist->geometry->bufsize);
+}
+
+unsigned char *uf_lcd_take_frame(lcd_t *lcd, unsigned long long *published) {
+    unsigned int old;
+
+    *published = 0;
+    do {
+        old = lcd->pending;
+        /* nothing new, or withdrawn by uf_lcd_frames_resume() */
+        if(!(old & LCD_FRAME_FRESH))
+            return lcd->frames[lcd->front];
+    } while(!__sync_bool_compare_and_swap(&lcd->pending, old, lcd->front));
+    lcd->front = old & LCD_FRAME_INDEX;
+    *published = lcd->stats.frame_time[lcd->front];
+    return lcd->frames[lcd->front];
+}
+
+/* the back buffer is a copy of the frame last published, so every slot is pointed at it.  whichever frame
+   the lcd thread takes is then that one, and the other two are freed once it can't be reading them */
+void uf_lcd_frames_retain(lcd_t *lcd) {
+    unsigned char *keep = lcd->frames[lcd->back], *old[2];
+    int i, n = 0;
+
+    for(i = 0; i < 3; i++)
+        if(lcd->frames[i] != keep) {
+            old[n++] = lcd->frames[i];
+            lcd->frames[i] = keep;
+        }
+    uf_lcdnode_synchronize(lcd->masterlist);
+    for(i = 0; i < n; i++)
+        free(old[i]);
+}
+
+/* the lcd thread reads the front buffer, which is the one left, and takes the published frame only while it
+   is marked fresh.  once the mark is withdrawn, the back & published slots are ours to fill */
+void uf_lcd_frames_resume(lcd_t *lcd) {
+    unsigned int bufsize = lcd->masterlist->geometry->bufsize;
+    unsigned char *keep = lcd->frames[0];
+    unsigned int old;
+
+    if(lcd->frames[1] != keep)
+        return;
+    do {
+        old = lcd->pending;
+    } while((old & LCD_FRAME_FRESH) && !__sync_bool_compare_and_swap(&lcd->pending, old, old & LCD_FRAME_INDEX));
+    lcd->frames[lcd->back] = g15daemon_xmalloc(bufsize);
+    memcpy(lcd->frames[lcd->back], keep, bufsize);
+    lcd->frames[lcd->pending & LCD_FRAME_INDEX] = g15daemon_xmalloc(bufsize);
+    memcpy(lcd->frames[lcd->pending & LCD_FRAME_INDEX], keep, bufsize);
+    lcd->buf = lcd->frames[lcd->back];
+}
+
+void g15daemon_frame_received(lcd_t *lcd, unsigned int bytes) {
+    lcd->stats.bytes += bytes;
+    lcd->stats.recv_time = uf_gettime_us();
+}
+
+void g15daemon_send_refresh(lcd_t *lcd) {
+    uf_lcd_publish_frame(lcd);
+    if(lcd->wants_foreground)
+        uf_arbiter_first_frame(lcd);
+    if(lcd->foreground||lcd->state_changed)
+        uf_wake_lcd_thread(lcd->masterlist);
+}
+
+int uf_collect_refresh(g15daemon_t *masterlist) {
+    unsigned long count = uf_mailbox_take(&masterlist->refresh);
+
+    masterlist->refresh.coalesced += count;
+    return (int)count;
 }
 
-void g15daemon_wait_refresh() {
-    pthread_mutex_t dummy_mutex;
-    struct timespec timeout;
-    int retval;
-    if(refresh_pending<1) {
-      /* Create a dummy mutex which doesn't unlock for sure while waiting. */
-      pthread_mutex_init(&dummy_mutex, NULL);
-      pthread_mutex_lock(&dummy_mutex);
-start:
-      time(&timeout.tv_sec);
-      timeout.tv_sec += 1;
-      timeout.tv_nsec = 0L;
-
-      retval=pthread_cond_timedwait(&lcd_refresh, &dummy_mutex, &timeout);
-      if(!leaving && retval == ETIMEDOUT)
-        goto start;
-      pthread_mutex_unlock(&dummy_mutex);
-      pthread_mutex_destroy(&dummy_mutex);
+int uf_wait_refresh_until(g15daemon_t *masterlist, unsigned long long deadline) {
+    g15_mailbox_t *mbox = &masterlist->refresh;
+    unsigned long long now;
+    unsigned long count;
+    int timeout;
+
+    while(!leaving) {
+        timeout = 1000;
+        if(deadline) {
+            if((now = g15daemon_time_ns()) >= deadline)
+                return 0;
+            if(deadline - now < 1000 * G15_NSEC_PER_MSEC)
+                timeout = (deadline - now + G15_NSEC_PER_MSEC - 1) / G15_NSEC_PER_MSEC;
+        }
+        if((count = uf_mailbox_wait(mbox, timeout)) > 0) {
+            mbox->coalesced += count - 1;
+            return (int)count;
+        }
     }
-    refresh_pending--;
+    return -1;
+}
+
+int g15daemon_wait_refresh(g15daemon_t *masterlist) {
+    int count = uf_wait_refresh_until(masterlist, 0);
+
+    return count < 0 ? -1 : count - 1;
 }
 
-void g15daemon_quit_refresh() {
-    pthread_cond_destroy(&lcd_refresh);
+void g15daemon_quit_refresh(g15daemon_t *masterlist) {
+    uf_mailbox_close(&masterlist->refresh);
 }
 
 int uf_return_running(){
@@ -174,126 +346,70 @@ int uf_create_pidfile() {
 }
 
 
-/* syslog wrapper */
-int g15daemon_log (int priority, const char *fmt, ...) {
-   va_list argp;
-   va_start (argp, fmt);
-   int real_prio=0;
-   
-   switch(g15daemon_debug) {
-     case 0:
-     case 1:
-      real_prio = LOG_WARNING;
-      break;
-     case 2:
-      real_prio = LOG_INFO;
-      break;
-     default:
-      real_prio = LOG_DEBUG;
-   }
-
-   if(real_prio>=priority) {
-    if(g15daemon_debug == 0) {
-     vsyslog(priority, fmt, argp);
-    } else {
-     vfprintf(stderr,fmt,argp);
-     fprintf(stderr,"\n");
-    }
-   }
-   va_end (argp);
-   
-   return 0;
-}
-
-/* takes a 6880 byte (1byte==1pixel) buffer and packs it into libg15 format. */
-void g15daemon_convert_buf(lcd_t *lcd, unsigned char * orig_buf)
-{
-    unsigned int x,y,val;
-    for(x=0;x<160;x++)
-        for(y=0;y<43;y++)
-	  {
-		unsigned int pixel_offset = y * LCD_WIDTH + x;
-    		unsigned int byte_offset = pixel_offset / 8;
-    		unsigned int bit_offset = 7-(pixel_offset % 8);
-
-		val = orig_buf[x+(y*160)];
-
-    		if (val)
-        		lcd->buf[byte_offset] = lcd->buf[byte_offset] | 1 << bit_offset;
-    		else
-        		lcd->buf[byte_offset] = lcd->buf[byte_offset]  &  ~(1 << bit_offset);
-	  }
-}
-
-/* wrap the libg15 functions */
-int uf_write_buf_to_g15(lcd_t *lcd)
-{
-    int retval = 0;
-#ifdef LIBUSB_BLOCKS
-    retval = writePixmapToLCD(lcd->buf);
-#else
-    pthread_mutex_lock(&g15lib_mutex);
-    retval = writePixmapToLCD(lcd->buf);
-    pthread_mutex_unlock(&g15lib_mutex);
-#endif    
-    return retval;
+/* nanoseconds on the monotonic clock (wallclock where there is none) */
+unsigned long long g15daemon_time_ns() {
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+    if(clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+        return (unsigned long long)ts.tv_sec * G15_NSEC_PER_SEC + ts.tv_nsec;
+#endif
+    struct timeval tv;
+    gettimeofday(&tv,NULL);
+    return (unsigned long long)tv.tv_sec * G15_NSEC_PER_SEC + tv.tv_usec * 1000ULL;
 }
 
-int uf_read_keypresses(unsigned int *keypresses, unsigned int timeout) 
-{
-    int retval=0;
-#ifdef LIBUSB_BLOCKS
-    retval = getPressedKeys(keypresses, timeout);
+int g15daemon_sleep_until_ns(unsigned long long deadline) {
+    struct timespec ts;
+#if defined(HAVE_CLOCK_NANOSLEEP) && defined(CLOCK_MONOTONIC)
+    ts.tv_sec = deadline / G15_NSEC_PER_SEC;
+    ts.tv_nsec = deadline % G15_NSEC_PER_SEC;
+    /* a signal interrupts the sleep - carry on unless it was telling us to exit */
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        if(leaving)
+            return -1;
 #else
-    pthread_mutex_lock(&g15lib_mutex);
-    retval = getPressedKeys(keypresses, timeout);
-    pthread_mutex_unlock(&g15lib_mutex);
-#endif    
-    return retval;
-}
-
-/* Sleep routine (hackish). */
-void g15daemon_sleep(int seconds) {
-    pthread_mutex_t dummy_mutex;
-    static pthread_cond_t dummy_cond = PTHREAD_COND_INITIALIZER;
-    struct timespec timeout;
-
-    /* Create a dummy mutex which doesn't unlock for sure while waiting. */
-    pthread_mutex_init(&dummy_mutex, NULL);
-    pthread_mutex_lock(&dummy_mutex);
+    unsigned long long now;
 
-    timeout.tv_sec = time(NULL) + seconds;
-    timeout.tv_nsec = 0;
+    while((now = g15daemon_time_ns()) < deadline) {
+        ts.tv_sec = (deadline - now) / G15_NSEC_PER_SEC;
+        ts.tv_nsec = (deadline - now) % G15_NSEC_PER_SEC;
+        if(nanosleep(&ts, NULL) < 0 && leaving)
+            return -1;
+    }
+#endif
+    return 0;
+}
 
-    pthread_cond_timedwait(&dummy_cond, &dummy_mutex, &timeout);
+int g15daemon_sleep_ns(unsigned long long nsecs) {
+    return g15daemon_sleep_until_ns(g15daemon_time_ns() + nsecs);
+}
 
-    /*    pthread_cond_destroy(&dummy_cond); */
-    pthread_mutex_unlock(&dummy_mutex);
-    pthread_mutex_destroy(&dummy_mutex);
+void g15daemon_sleep(int seconds) {
+    g15daemon_sleep_ns(seconds * G15_NSEC_PER_SEC);
 }
 
 /* microsecond sleep routine. */
 int g15daemon_usleep(int useconds) {
-    
-    struct timeval timeout;
-    if(useconds < 10000)
-      useconds = 10000;
-    timeout.tv_sec = useconds / 1000000;
-    timeout.tv_usec = useconds % 1000000;
-    return select (0,0,0,0,&timeout);
+    return g15daemon_sleep_ns(useconds * 1000ULL);
 }
 
 /* millisecond sleep routine. */
 int g15daemon_msleep(int milliseconds) {
-    
-    return g15daemon_usleep(milliseconds*1000);
+    return g15daemon_sleep_ns(milliseconds * G15_NSEC_PER_MSEC);
+}
+
+unsigned long long uf_gettime_us() {
+    return g15daemon_time_ns() / 1000;
 }
 
+void uf_sleep_until_us(unsigned long long deadline) {
+    if(!leaving)
+        g15daemon_sleep_until_ns(deadline * 1000ULL);
+}
 
+/* kept for older plugins.  wraps every 49 days - use g15daemon_time_ns() */
 unsigned int g15daemon_gettime_ms(){
-    struct timeval tv;
-    gettimeofday(&tv,NULL);
-    return (tv.tv_sec*1000+tv.tv_usec/1000);
+    return g15daemon_time_ns() / G15_NSEC_PER_MSEC;
 }
 
 /* generic event handler used unless overridden (only loading a plugin will override currently)*/
@@ -318,373 +434,29 @@ int internal_generic_eventhandler(plugin_event_t *event) {
 }
 
 
-/* free all memory used by the config subsystem */
-void uf_conf_free(g15daemon_t *list)
-{
-    config_section_t *section=list->config->sections;
-    config_items_t *tmpitem=NULL;
-    config_section_t *tmpsection=section;
-    
-    while(tmpsection!=NULL){
-        tmpitem=section->items;
-        
-        if(section->sectionname){
-            free(section->sectionname);
-            while(section->items!=NULL){
-                if(tmpitem->key!=NULL) 
-                    free(tmpitem->key);
-                if(tmpitem->value!=NULL)
-                    free(tmpitem->value);
-                tmpitem=section->items->next;
-                free(section->items);
-                section->items=tmpitem;
-            }
-        }
-        tmpsection=section->next;
-        free(section);
-        section=tmpsection;
-    }
-    free(section);
-    free(list->config);
-}
-
-/* write the config file with all keys/sections */
-int uf_conf_write(g15daemon_t *list,char *filename)
-{
-    int config_fd=-1;
-    config_section_t *foo=list->config->sections;
-    config_items_t * item=NULL;
-    char line[1024];
-    
-    config_fd = open(filename,O_CREAT|O_RDWR|O_TRUNC,0644);
-    if(config_fd){
-    snprintf(line,1024,"# G15Daemon Configuration File\n# any items entered before a [section] header\n# will be in the Global config space\n# comments you wish to keep should start with a semicolon';'\n");
-    write(config_fd,line,strlen(line));
-    while(foo!=NULL){
-        item=foo->items;
-        memset(line,0,1024);
-        if(foo->sectionname!=NULL){
-            snprintf(line,1024,"\n[%s]\n",foo->sectionname);
-            write(config_fd,line,strlen(line));
-            while(item!=NULL){
-                memset(line,0,1024);
-                if(item->key!=NULL){
-                    if(item->key[0]==';') // comment
-                        snprintf(line,1024,"%s\n",item->key);
-                    else
-                        snprintf(line,1024,"%s: %s\n",item->key, item->value);
-                    write(config_fd,line,strlen(line));
-                }
-                item=item->next;
-            }
-        }
-        foo=foo->next;
-    }
-
-    fsync(config_fd);
-    close(config_fd);
-    return 0;
-    }
-    return -1;
-}
+/* screens belonging to a plugin may be given their own frame rate limit with a "Max FPS (pluginname)" key in the Global section */
+void uf_lcd_config_fps(lcd_t *lcd, char *name) {
+    config_section_t *global_cfg = g15daemon_cfg_load_section(lcd->masterlist,"Global");
+    char key[256];
 
-/* search the list for valid section name return pointer to section, or NULL otherwise */
-config_section_t* uf_search_confsection(g15daemon_t *list,char *sectionname){
-    config_section_t *section=list->config->sections;
-    
-    while(section!=NULL){
-        if(0==strcmp((char*)section->sectionname,(char*)sectionname))
-            break;
-        section=section->next;
-    }
-    return section;
+    snprintf(key,256,"Max FPS (%s)",name);
+    lcd->max_fps = uf_search_confitem(global_cfg,key) ? g15daemon_cfg_read_int(global_cfg,key,0) : 0;
 }
 
-/* search the list for valid key called "key" in section named "section" return pointer to item or NULL */
-config_items_t* uf_search_confitem(config_section_t *section, char *key){
-    
-    config_items_t * item=NULL;
-    
-    if(section!=NULL){
-        item=section->items;
-        while(item!=NULL){
-            if(0==strcmp((char*)item->key,(char*)key))
-                break;
-            item=item->next;
-        }
-    }
-    return item;
-}
-
-
-/* return pointer to section, or create a new section if it doesnt exist */
-config_section_t *g15daemon_cfg_load_section(g15daemon_t *masterlist,char *name) {
-    
-    config_section_t *new = NULL;
-    if((new=uf_search_confsection(masterlist,name))!=NULL)
-        return new;
-    new = g15daemon_xmalloc(sizeof(config_section_t));
-    new->head = new;
-    new->next = NULL;;
-    new->sectionname=strdup(name);
-    if(!masterlist->config->sections){
-        masterlist->config->sections=new;
-        masterlist->config->sections->head = new;
-    } else {
-        masterlist->config->sections->head->next=new;
-        masterlist->config->sections->head = new;
-    }
-    return new;
-}
-
-/* cleanup whitespace */
-char * uf_remove_whitespace(char *str){
-    int z=0;
-    if(str==NULL)
-        str=strdup(" ");
-    while(isspace(str[z])&&str[z])
-        z++;
-    str+=z;
-    return str;
-}
-
-/* add a new key, or update the value of an already existing key, or return -1 if section doesnt exist */
-int g15daemon_cfg_write_string(config_section_t *section, char *key, char *val){
-    
-    config_items_t *new = NULL;
-
-    if(section==NULL)
-        return -1;
-    
-    if((uf_search_confitem(section, key))){
-        free(new);
-        new=uf_search_confitem(section, key);
-        new->value=strdup(val);
-    }else{
-        new=g15daemon_xmalloc(sizeof(config_items_t));
-        new->head=new;
-        new->next=NULL;
-        
-        new->key=strdup(key);
-        new->value=strdup(val);
-        if(!section->items){
-            new->prev=NULL;
-            section->items=new;
-            section->items->head=new;
-        }else{
-            new->prev=section->items->head;
-            section->items->head->next=new;
-            section->items->head=new;
-        }
-    }
-    return 0;
-}
-
-/* remoe a key/value pair from named section */
-int g15daemon_cfg_remove_key(config_section_t *section, char *key){
-    
-    config_items_t *new = NULL;
-    config_items_t *next = NULL;
-    config_items_t *prev = NULL;
-    if(section==NULL)
-        return -1;
-    
-    if((uf_search_confitem(section, key))){
-        new=uf_search_confitem(section, key);
-        prev=new->prev;
-        next=new->next;
-        if(prev){
-            prev->next=new->next;
-        }else{
-             if(!next) {
-                    free(section->items);
-                    section->items=NULL;
-                }
-                else
-                    section->items=next;
-            }
-
-        if(new->head==new){
-            if(prev){
-                prev->head = prev;
-                section->items->head=prev;
-            }
-            if(!prev){
-                if(!next) {
-                    free(section->items);
-                    section->items=NULL;
-                }
-            }
-        }
-        if(next){
-            if(prev)
-            	next->prev=prev;
-            else
-                next->prev=NULL;
-        }
-        free(new->key);
-        free(new->value);
-        free(new);
-    }
-    return 0;
-}
-
-int g15daemon_cfg_write_int(config_section_t *section, char *key, int val) {
-    char tmp[1024];
-    snprintf(tmp,1024,"%i",val);
-    return g15daemon_cfg_write_string(section, key, tmp);
-}
-
-int g15daemon_cfg_write_float(config_section_t *section, char *key, double val) {
-    char tmp[1024];
-    snprintf(tmp,1024,"%f",val);
-    return g15daemon_cfg_write_string(section, key, tmp);
-}
-
-/* simply write value as On or Off depending on whether val>0 */
-int g15daemon_cfg_write_bool(config_section_t *section, char *key, unsigned int val) {
-    char tmp[1024];
-    snprintf(tmp,1024,"%s",val?"On":"Off");
-    return g15daemon_cfg_write_string(section, key, tmp);
-}
-
-/* the config read functions will either return a value from the config file, or the default value, which will be written to the config file if the key doesnt exist */
-
-/* return bool as int from key in sectionname */
-int g15daemon_cfg_read_bool(config_section_t *section, char *key, int defaultval) {
-    
-    int retval=0;
-    config_items_t *item = uf_search_confitem(section, key);
-    if(item){
-        retval = 1^retval?(strncmp(item->value,"On",2)==0):1;
-           return retval;
-    }
-    g15daemon_cfg_write_bool(section, key, defaultval);
-    return defaultval;
-}
-
-/* return int from key in sectionname */
-int g15daemon_cfg_read_int(config_section_t *section, char *key, int defaultval) {
-    
-    config_items_t *item = uf_search_confitem(section, key);
-    if(item){
-           return atoi(item->value);
-    }
-    g15daemon_cfg_write_int(section, key, defaultval);
-    return defaultval;
-}
-
-/* return float from key in sectionname */
-double g15daemon_cfg_read_float(config_section_t *section, char *key, double defaultval) {
-    
-    config_items_t *item = uf_search_confitem(section, key);
-    if(item){
-           return atof(item->value);
-    }
-    g15daemon_cfg_write_float(section, key, defaultval);
-    return defaultval;
-}
-
-/* return string value from key in sectionname */
-char* g15daemon_cfg_read_string(config_section_t *section, char *key, char *defaultval) {
-    
-    config_items_t *item = uf_search_confitem(section, key);
-    if(item){
-           return item->value;
-    }
-    g15daemon_cfg_write_string(section, key, defaultval);
-    return defaultval;
-}
-
-
-int uf_conf_open(g15daemon_t *list, char *filename) {
-
-    char *buffer, *lines;
-    int config_fd=-1;
-    char *sect;
-    char *start;
-    char *bar = NULL;
-    int i;
-    struct stat stats;
-	
-    list->config=g15daemon_xmalloc(sizeof(configfile_t));
-    list->config->sections=NULL;
-
-    if (lstat(filename, &stats) == -1)
-        return -1;
-    if (!(config_fd = open(filename, O_RDWR)))
-        return -1;
+int uf_screendump_pbm(const g15_geometry_t *geometry, unsigned char *buffer,char *filename) {
+    FILE *f;
+    int retval = 0;
 
-    buffer = g15daemon_xmalloc(stats.st_size + 1);
-        
-    if (read(config_fd, buffer, stats.st_size) != stats.st_size)
-    {
-        free(buffer);
-        close(config_fd);
+    /* the lcd buffer is already laid out as the raster of a binary pbm */
+    if((f = fopen(filename,"wb")) == NULL) {
+        g15daemon_log(LOG_WARNING,"Unable to write screendump %s: %s",filename,strerror(errno));
         return -1;
     }
-    close(config_fd);
-    buffer[stats.st_size] = '\0';
-        
-    lines=strtok_r(buffer,"\n",&bar);
-    config_section_t *section=NULL;
-    while(lines!=NULL){
-        sect=strdup(lines);
-        
-        i=0;
-        while(isspace(sect[i])){
-            i++;
-        }
-        start=sect+i;
-        if(start[0]=='#'){
-	   /* header - ignore */
-           /* comments start with ; and can be produced like so:
-             g15daemon_cfg_write_string(noload_cfg,"; Plugins in this section will not be loaded on start","");
-             the value parameter must not be used.
-           */
-        } else if(strrchr(start,']')) { /* section title */
-            char sectiontitle[1024];
-            memset(sectiontitle,0,1024);
-            strncpy(sectiontitle,start+1,strlen(start)-2);
-            section = g15daemon_cfg_load_section(list,sectiontitle);
-        }else{
-            /*section keys */
-            if(section==NULL){
-                /* create an internal section "Global" which is the default for items not under a [section] header */
-                section=g15daemon_cfg_load_section(list,"Global");
-            }
-            char *foo=NULL;
-            char *key = uf_remove_whitespace( strtok_r(start,":=",&foo) );
-            char *val = uf_remove_whitespace( strtok_r(NULL,":=", &foo) );
-            
-            g15daemon_cfg_write_string(section,key,val);
-        }        
-        free(sect);
-        lines=strtok_r(NULL,"\n",&bar);
-    }
-
-    free(buffer);
-    return 0;
-}
-
-int uf_screendump_pbm(unsigned char *buffer,char *filename) {
-    FILE *f;
-    int x,y;
-    #define WIDTH 40
-    g15canvas *canvas=g15daemon_xmalloc(sizeof(g15canvas));
-    memcpy(canvas->buffer,buffer,LCD_BUFSIZE);
-    f = fopen(filename,"w+");
-    fprintf(f,"P1\n160 43\n");
-    fprintf(f,"# G15 screendump - %s\n\n",filename);
-    for(y=0;y<43;y++)
-      for(x=0;x<160;x++) {
-        fprintf(f,"%i",g15r_getPixel(canvas,x,y));
-            if(x%WIDTH==WIDTH-1)
-              fprintf(f,"\n");
-        }
-
-        fclose(f);
-    free(canvas);
-    return 0;
+    fprintf(f,"P4\n# G15 screendump - %s\n%u %u\n",filename,geometry->width,geometry->height);
+    if(fwrite(buffer,geometry->rowbytes,geometry->height,f) != geometry->height)
+        retval = -1;
+    if(fclose(f) != 0)
+        retval = -1;
+    return retval;
 }
 
@@ -32,6 +32,8 @@ extern "C"
 #define G15_HEIGHT 43
 
 #define G15_BUFSIZE 6880
+/* size of a libg15render buffer, as sent to G15_G15RBUF & G15_LAYERBUF screens */
+#define G15_RBUFSIZE 1048
 #define G15DAEMON_VERSION g15daemon_version()
 
 #define G15_PIXELBUF 0
@@ -39,6 +41,8 @@ extern "C"
 #define G15_WBMPBUF 2
 #define G15_G15RBUF 3
 #define G15_SHMRBUF 4
+/* libg15render buffers, sent with g15_send_layer() along with overlay layers */
+#define G15_LAYERBUF 5
 
 /* client / server commands - see README.devel for details on use */
  #define G15DAEMON_KEY_HANDLER 0x10
@@ -51,6 +55,13 @@ extern "C"
  #define G15DAEMON_IS_FOREGROUND 'v'
  #define G15DAEMON_IS_USER_SELECTED 'u'
  #define G15DAEMON_NEVER_SELECT 'n' 
+ /* the screen's priority class - background screens are only shown when there's nothing else, and alerts
+    take the lcd from other screens for a while */
+ #define G15DAEMON_PRIORITY_BACKGROUND 'b'
+ #define G15DAEMON_PRIORITY_NORMAL 'o'
+ #define G15DAEMON_PRIORITY_ALERT 'a'
+ /* when the daemon rotates screens, show this one for 'value' seconds (up to 63, 0 for the default) */
+ #define G15DAEMON_ROTATE 0xc0
 
 const char *g15daemon_version();
 
@@ -59,6 +70,19 @@ const char *g15daemon_version();
    supported in this version */
 int new_g15_screen(int screentype);
 
+/* as new_g15_screen(), but the daemon keeps the screen for 'ttl' seconds after the connection closes.  'token'
+   points to G15_SESSION_TOKEN_LEN bytes - all zeroes for a new screen, or the token from an earlier call to get
+   that screen back if it is still being kept.  on return 'token' holds the token of the screen in use, which
+   differs from the one passed in if a new screen was made, and is all zeroes if the daemon can't keep it */
+#define G15_SESSION_TOKEN_LEN 16
+int new_g15_screen_session(int screentype, unsigned int ttl, unsigned char *token);
+
+/* as new_g15_screen_session(), but puts the screen on keyboard 'device' of those the daemon drives, counting from
+   0 in the order they were given with -b.  screens go on the first keyboard otherwise.  'token' may be NULL for a
+   screen which isn't kept */
+#define G15DAEMON_MAX_DEVICES 8
+int new_g15_screen_device(int screentype, unsigned int device, unsigned int ttl, unsigned char *token);
+
 /* close connection - just calls close() */
 int g15_close_screen(int sock);
 
@@ -67,6 +91,27 @@ int g15_close_screen(int sock);
 int g15_send(int sock, char *buf, unsigned int len);
 int g15_recv(int sock, char *buf, unsigned int len);
 
+/* overlay layers, for G15_LAYERBUF screens.  the daemon draws up to G15DAEMON_LAYERS of them over the screen,
+   in order, combining their lit pixels with those beneath in one of these ways */
+#define G15DAEMON_LAYERS 8
+#define G15DAEMON_ROP_COPY 0
+#define G15DAEMON_ROP_OR 1
+#define G15DAEMON_ROP_XOR 2
+#define G15DAEMON_ROP_ANDNOT 3
+#define G15DAEMON_ROP_REMOVE 0xff
+/* send layer 'layer' (1 to G15DAEMON_LAYERS), 'width' x 'height' pixels at x,y, packed as for libg15render in
+   rows of (width+7)/8 bytes.  the layer replaces any already there, and is removed after 'ttl_msecs' unless
+   that is 0.  a G15DAEMON_ROP_REMOVE layer removes the layer instead.  layer 0 is the screen's own frame, a
+   whole G15_RBUFSIZE libg15render buffer when 'width' and 'height' are 0 or G15_WIDTH x G15_HEIGHT.  on a
+   keyboard with another panel, give the panel's size and send width/8*height bytes.  the other arguments
+   are ignored for layer 0.  returns -1 on error */
+int g15_send_layer(int sock, unsigned int layer, int x, int y, unsigned int width, unsigned int height,
+                   unsigned int rop, unsigned char *pixels, unsigned int ttl_msecs);
+/* as g15_send_layer(), but only the part of the layer inside the given rectangle is drawn */
+int g15_send_layer_clipped(int sock, unsigned int layer, int x, int y, unsigned int width, unsigned int height,
+                           unsigned int rop, unsigned char *pixels, unsigned int ttl_msecs,
+                           unsigned int clip_x, unsigned int clip_y, unsigned int clip_width, unsigned int clip_height);
+
 /* send a command (defined above) to the daemon.  any replies from the daemon are returned */
 unsigned long g15_send_cmd (int sock, unsigned char command, unsigned char value);
 /* receive an oob byte from the daemon, used internally by g15_send_cmd, but useful elsewhere */
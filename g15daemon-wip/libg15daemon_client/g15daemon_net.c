@@ -24,6 +24,7 @@
     Client screens can be cycled through by pressing the 'L1' key.
 */
 
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <sys/socket.h>
@@ -91,6 +92,16 @@ void g15_sighandler(int sig) {
 #endif
 
 int new_g15_screen(int screentype)
+{
+    return new_g15_screen_session(screentype, 0, NULL);
+}
+
+int new_g15_screen_session(int screentype, unsigned int ttl, unsigned char *token)
+{
+    return new_g15_screen_device(screentype, 0, ttl, token);
+}
+
+int new_g15_screen_device(int screentype, unsigned int device, unsigned int ttl, unsigned char *token)
 {
     struct sigaction new_sigaction;
     int g15screen_fd;
@@ -100,6 +111,11 @@ int new_g15_screen(int screentype)
     int tos = 0x6;
 
     char buffer[256];
+    unsigned int nttl = htonl(ttl);
+
+    if(device >= G15DAEMON_MAX_DEVICES)
+        return -1;
+
     if(sighandler_init==0) {
 #ifdef HAVE_BACKTRACE
       new_sigaction.sa_handler = g15_sighandler;
@@ -133,12 +149,30 @@ int new_g15_screen(int screentype)
     /* here we check that we're really talking to the g15daemon */
     if(strcmp(buffer,"G15 daemon HELLO") != 0)
         return -1;
+    if(device != 0) {
+        /* put the screen on another keyboard than the first */
+        snprintf(buffer, sizeof(buffer), "DEV%u", device);
+        if(g15_send(g15screen_fd, buffer, 4) < 0)
+            return -1;
+    }
+    if(token != NULL) {
+        /* ask for the screen to be kept, or for the one we kept last time back */
+        memcpy(buffer, "SES1", 4);
+        memcpy(buffer + 4, &nttl, 4);
+        memcpy(buffer + 8, token, G15_SESSION_TOKEN_LEN);
+        if(g15_send(g15screen_fd, buffer, 8 + G15_SESSION_TOKEN_LEN) < 0)
+            return -1;
+        if(g15_recv(g15screen_fd, (char*)token, G15_SESSION_TOKEN_LEN) < G15_SESSION_TOKEN_LEN)
+            return -1;
+    }
     if(screentype == G15_TEXTBUF) /* txt buffer - not supported yet */
         g15_send(g15screen_fd,"TBUF",4);
     else if(screentype == G15_WBMPBUF) /* wbmp buffer */
         g15_send(g15screen_fd,"WBUF",4);
     else if(screentype == G15_G15RBUF)
         g15_send(g15screen_fd,"RBUF",4);
+    else if(screentype == G15_LAYERBUF)
+        g15_send(g15screen_fd,"LBUF",4);
     else 
         g15_send(g15screen_fd,"GBUF",4);
     
@@ -204,6 +238,52 @@ int g15_recv(int sock, char *buf, unsigned int len)
     return total;
 } 
 
+int g15_send_layer_clipped(int sock, unsigned int layer, int x, int y, unsigned int width, unsigned int height,
+                           unsigned int rop, unsigned char *pixels, unsigned int ttl_msecs,
+                           unsigned int clip_x, unsigned int clip_y, unsigned int clip_width, unsigned int clip_height)
+{
+    unsigned char header[16];
+    unsigned int len;
+
+    /* sizes travel as a byte each.  the daemon checks them against the keyboard's panel */
+    if(layer > G15DAEMON_LAYERS || width > 255 || height > 255)
+        return -1;
+    header[0] = layer;
+    header[1] = rop;
+    header[2] = (x >> 8) & 0xff;
+    header[3] = x & 0xff;
+    header[4] = (y >> 8) & 0xff;
+    header[5] = y & 0xff;
+    header[6] = width;
+    header[7] = height;
+    header[8] = clip_x;
+    header[9] = clip_y;
+    header[10] = clip_width;
+    header[11] = clip_height;
+    header[12] = ttl_msecs >> 24;
+    header[13] = (ttl_msecs >> 16) & 0xff;
+    header[14] = (ttl_msecs >> 8) & 0xff;
+    header[15] = ttl_msecs & 0xff;
+    if(layer == 0)
+        /* sized as the daemon reads it: a whole libg15render buffer for the g15's panel, or when no size is
+           given.  a frame for another panel is sized by the width & height given */
+        len = (width == 0 && height == 0) || (width == G15_WIDTH && height == G15_HEIGHT) ? G15_RBUFSIZE
+              : width / 8 * height;
+    else if(rop == G15DAEMON_ROP_REMOVE)
+        len = 0;
+    else
+        len = (width + 7) / 8 * height;
+    if(g15_send(sock, (char *)header, sizeof(header)) < 0)
+        return -1;
+    return len ? g15_send(sock, (char *)pixels, len) : 0;
+}
+
+int g15_send_layer(int sock, unsigned int layer, int x, int y, unsigned int width, unsigned int height,
+                   unsigned int rop, unsigned char *pixels, unsigned int ttl_msecs)
+{
+    return g15_send_layer_clipped(sock, layer, x, y, width, height, rop, pixels, ttl_msecs, 0, 0, 0, 0);
+}
+
 /* receive a byte from a priority, out-of-band packet */
 int g15_recv_oob_answer(int sock) {
     int packet[2];
@@ -267,9 +347,18 @@ unsigned long g15_send_cmd (int sock, unsigned char command, unsigned char value
             retval = send( sock, packet, 1, MSG_OOB );
             break;
         case G15DAEMON_NEVER_SELECT:
+        case G15DAEMON_PRIORITY_BACKGROUND:
+        case G15DAEMON_PRIORITY_NORMAL:
+        case G15DAEMON_PRIORITY_ALERT:
             packet[0] = (unsigned char)command;
             retval = send( sock, packet, 1, MSG_OOB );
             break;
+        case G15DAEMON_ROTATE:
+            if (value > 63)
+                value = 63;
+            packet[0] = (unsigned char)command | (unsigned char)value;
+            retval = send( sock, packet, 1, MSG_OOB );
+            break;
         case G15DAEMON_GET_KEYSTATE:{
             retval = 0;
             unsigned long keystate = 0;
@@ -290,6 +290,12 @@ static int myeventhandler(plugin_event_t *myevent) {
         case G15_EVENT_VISIBILITY_CHANGED:
 //        printf("Clock received new visibility status (%i)\n",myevent->value);
           break;
+        case G15_EVENT_CONFIG_CHANGED:
+            clockcfg = g15daemon_cfg_load_section(lcd->masterlist,"Clock");
+            mode=g15daemon_cfg_read_bool(clockcfg, "24hrFormat",1);
+            showdate=g15daemon_cfg_read_bool(clockcfg, "ShowDate",0);
+            digital=g15daemon_cfg_read_bool(clockcfg, "Digital",1);
+            break;
         default:
           break;
     }
@@ -27,6 +27,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <ctype.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -54,6 +55,50 @@ static int server_events(plugin_event_t *myevent);
 /* any more than this number of simultaneous clients will be rejected. */
 #define MAX_CLIENTS 10
 
+/* a client may send "SES1", a time-to-live in seconds (4 bytes, network order) and a 16 byte resume token before
+   its buffer type.  its screen is then kept on the lcd for ttl seconds after it hangs up, and a client
+   connecting again with the token before then gets the same screen back.  a token of all zeroes asks for a new
+   screen.  the daemon answers with the screen's token, or zeroes if it couldn't keep the screen */
+#define SESSION_HELO "SES1"
+/* a client may first send "DEV" and a digit to put its screen on that keyboard, counting from 0 in the order
+   the keyboards were given to the daemon.  without it the screen goes on the first.  the daemon hangs up on a
+   client asking for a keyboard it doesn't drive */
+#define DEVICE_HELO "DEV"
+#define SESSION_TOKEN_LEN 16
+/* an "LBUF" client sends a 16 byte header before each frame or overlay layer:
+     layer (1 byte, 0 for the screen's frame), raster op (1 byte, G15_ROP_* or LAYER_REMOVE), x & y (2 bytes
+     each, signed), width & height (1 byte each), clip rectangle x, y, width & height (1 byte each, a width of
+     0 for none), time-to-live in milliseconds (4 bytes, 0 to keep the layer).  all in network order.
+   a frame is followed by a frame buffer as for "RBUF", a layer by its (width+7)/8 * height bytes of pixels.
+   raster op and geometry are ignored for frames, and everything but the layer for removals */
+#define LAYER_HEADER_LEN 16
+#define LAYER_REMOVE 0xff
+/* screens which can be kept at once, and the longest they can be kept for */
+#define MAX_SESSIONS 32
+#define MAX_SESSION_TTL 86400
+
+typedef struct session_s
+{
+    /* NULL if the slot is free */
+    lcdnode_t *node;
+    unsigned char token[SESSION_TOKEN_LEN];
+    unsigned int ttl;
+    /* set while a client is connected to the screen */
+    int attached;
+    /* when a detached screen is removed, in g15daemon_time_ns() */
+    unsigned long long expires;
+} session_t;
+
+static session_t sessions[MAX_SESSIONS];
+static pthread_mutex_t sessions_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* a newly accepted connection, handed to its thread */
+typedef struct client_s
+{
+    g15daemon_t *masterlist;
+    int sock;
+} client_t;
+
 /* custom plugininfo for clients... */
 plugin_info_t lcdclient_info[] = {
         /* TYPE, 	   name, 	initfunc, updatefreq, exitfunc, eventhandler, initfunc */
@@ -70,46 +115,61 @@ static void process_client_cmds(lcdnode_t *lcdnode, int sock, unsigned int *msgb
         break;
     }
     case CLIENT_CMD_NEVER_SELECT: { /* client can never be user-selected */
-        pthread_mutex_lock(&lcdlist_mutex);
+        pthread_mutex_lock(&lcdnode->list->lcdlist_mutex);
         lcdnode->lcd->never_select = 1;
-        pthread_mutex_unlock(&lcdlist_mutex);
+        pthread_mutex_unlock(&lcdnode->list->lcdlist_mutex);
         break;
     }
     case CLIENT_CMD_IS_FOREGROUND:  { /* client wants to know if it's currently viewable */
-        pthread_mutex_lock(&lcdlist_mutex);
+        pthread_mutex_lock(&lcdnode->list->lcdlist_mutex);
         memset(msgbuf,0,2);
         if(lcdnode->list->current == lcdnode){
             msgbuf[0] = '1';
         }else{
             msgbuf[0] = '0';
         }
-        pthread_mutex_unlock(&lcdlist_mutex);
+        pthread_mutex_unlock(&lcdnode->list->lcdlist_mutex);
         send(sock,msgbuf,1,MSG_OOB);
         break;
     }
+    case CLIENT_CMD_PRIORITY_BACKGROUND:
+        g15daemon_lcd_set_priority(lcdnode->lcd, G15_PRIORITY_BACKGROUND);
+        break;
+    case CLIENT_CMD_PRIORITY_NORMAL:
+        g15daemon_lcd_set_priority(lcdnode->lcd, G15_PRIORITY_NORMAL);
+        break;
+    case CLIENT_CMD_PRIORITY_ALERT:
+        g15daemon_lcd_set_priority(lcdnode->lcd, G15_PRIORITY_ALERT);
+        break;
     case CLIENT_CMD_IS_USER_SELECTED: { /* client wants to know if it was set to foreground by the user */
-        pthread_mutex_lock(&lcdlist_mutex);
+        pthread_mutex_lock(&lcdnode->list->lcdlist_mutex);
         if(lcdnode->lcd->usr_foreground==1)  /* user manually selected this lcd */
             msgbuf[0] = 1;
         else
             msgbuf[0] = 0;
-        pthread_mutex_unlock(&lcdlist_mutex);
+        pthread_mutex_unlock(&lcdnode->list->lcdlist_mutex);
         send(sock,msgbuf,1,MSG_OOB);
         break;
     }
     default:
-       if(msgbuf[0] & CLIENT_CMD_MKEY_LIGHTS)
+       if((msgbuf[0] & CLIENT_CMD_ROTATE) == CLIENT_CMD_ROTATE)
+       { /* client wants its screen shown for a while before the next is rotated in */
+          g15daemon_lcd_set_rotation(lcdnode->lcd, (msgbuf[0] & ~CLIENT_CMD_ROTATE) * 1000);
+       } else if(msgbuf[0] & CLIENT_CMD_MKEY_LIGHTS)
        { /* client wants to change the M-key backlights */
           lcdnode->lcd->mkey_state = msgbuf[0]-0x20;
           lcdnode->lcd->state_changed = 1;
           //if the client is the keyhandler, allow full, direct control over the mled status
           if(lcdnode->lcd->masterlist->remote_keyhandler_sock==lcdnode->lcd->connection)
-            setLEDs(msgbuf[0]-0x20);
+            g15daemon_set_mleds(lcdnode->list,msgbuf[0]-0x20);
        } else if (msgbuf[0] & CLIENT_CMD_KEY_HANDLER)
       {
         g15daemon_log(LOG_WARNING, "Client is taking over keystate");
 
+        pthread_mutex_lock(&lcdnode->list->lcdlist_mutex);
+        lcdnode->list->remote_keyhandler = lcdnode->lcd;
         lcdnode->list->remote_keyhandler_sock = sock;
+        pthread_mutex_unlock(&lcdnode->list->lcdlist_mutex);
         g15daemon_log(LOG_WARNING, "Client has taken over keystate");
       }
       else if (msgbuf[0] & CLIENT_CMD_BACKLIGHT)
@@ -121,7 +181,7 @@ static void process_client_cmds(lcdnode_t *lcdnode, int sock, unsigned int *msgb
       }
       else if (msgbuf[0] & CLIENT_CMD_KB_BACKLIGHT)
       {
-        setKBBrightness((unsigned int)msgbuf[0]-0x8);
+        g15daemon_set_kb_backlight(lcdnode->list,(unsigned int)msgbuf[0]-0x8);
       }
       else if (msgbuf[0] & CLIENT_CMD_CONTRAST)
       {
@@ -203,8 +263,11 @@ static int g15_recv(lcdnode_t *lcdnode, int sock, char *buf, unsigned int len)
 	int retval = 0;
 	int msgret = 0;
 	int bytesleft = len;
-	struct pollfd pfd[1];
+	struct pollfd pfd[2];
 	unsigned int msgbuf[20];
+	/* keypresses for this client are sent from here, while waiting for its data.  there's no screen yet
+	   while the client is still saying which one it wants */
+	int event_fd = lcdnode ? g15daemon_event_subscribe(lcdnode->lcd) : -1;
 
 	int flags = 0;
 	flags = fcntl(sock,F_GETFL,0);
@@ -216,27 +279,32 @@ static int g15_recv(lcdnode_t *lcdnode, int sock, char *buf, unsigned int len)
 		memset(pfd,0,sizeof(pfd));
 		pfd[0].fd = sock;
 		pfd[0].events = POLLIN | POLLPRI | POLLERR | POLLHUP | POLLNVAL;
-		if(poll(pfd,1,500)>0)
+		pfd[1].fd = event_fd;
+		pfd[1].events = POLLIN;
+		if(poll(pfd,event_fd<0?1:2,500)>0)
 		{
+			if(pfd[1].revents & POLLIN)
+				g15daemon_event_dispatch(lcdnode->lcd);
 			if(pfd[0].revents & POLLPRI && !(pfd[0].revents & POLLERR || pfd[0].revents & POLLHUP || pfd[0].revents & POLLNVAL))
 			{
 				/* receive out-of-band request from client and deal with it */
 				memset(msgbuf,0,20);
-				g15daemon_log(LOG_INFO, "Receiving OOB dataupdate.");
+				G15_INFO("Receiving OOB dataupdate.");
 				msgret = recv(sock, msgbuf, 10 , MSG_OOB);
-				g15daemon_log(LOG_INFO, "Received OOB dataupdate.");
+				G15_INFO("Received OOB dataupdate.");
 				if (msgret < 1)
 				{
 					break;
 				}
-				process_client_cmds(lcdnode, sock, msgbuf,len);
+				if(lcdnode)
+					process_client_cmds(lcdnode, sock, msgbuf,len);
 			}
 			else if(pfd[0].revents & POLLIN && !(pfd[0].revents & POLLERR || pfd[0].revents & POLLHUP || pfd[0].revents & POLLNVAL || pfd[0].revents & POLLPRI))
 			{
 
-				g15daemon_log(LOG_INFO, "Receiving normal dataupdate.");
+				G15_DEBUG("Receiving normal dataupdate.");
 				retval = recv(sock, buf+total, bytesleft, 0);
-				g15daemon_log(LOG_INFO, "Received normal dataupdate.");
+				G15_DEBUG("Received normal dataupdate.");
 				if (retval == 0)
 				{
 					break;
@@ -273,60 +341,238 @@ static int g15_recv(lcdnode_t *lcdnode, int sock, char *buf, unsigned int len)
 }
 
 
-/* the client must send 6880 bytes for each lcd screen.  This thread will continue to copy data
+static void session_new_token(unsigned char *token)
+{
+    static unsigned long long counter = 0;
+    unsigned long long seed;
+    int fd, i;
+
+    if((fd = open("/dev/urandom", O_RDONLY)) >= 0) {
+        i = read(fd, token, SESSION_TOKEN_LEN);
+        close(fd);
+        if(i == SESSION_TOKEN_LEN)
+            return;
+    }
+    /* no urandom - not secret, but still won't match another screen's token */
+    seed = g15daemon_time_ns() ^ ((unsigned long long)getpid() << 32) ^ ++counter;
+    for(i = 0; i < SESSION_TOKEN_LEN; i++) {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        token[i] = seed >> 56;
+    }
+}
+
+/* compare every byte whatever the outcome, so the time taken gives nothing away */
+static int session_token_matches(const unsigned char *a, const unsigned char *b)
+{
+    unsigned char diff = 0;
+    int i;
+
+    for(i = 0; i < SESSION_TOKEN_LEN; i++)
+        diff |= a[i] ^ b[i];
+    return diff == 0;
+}
+
+/* find the detached screen with 'token', or make a new screen which will be kept for 'ttl' seconds.  the
+   screen's token is copied to 'token'.  returns NULL if there is no room to keep another screen */
+static session_t *session_attach(g15daemon_t *masterlist, unsigned char *token, unsigned int ttl)
+{
+    session_t *session = NULL;
+    unsigned char zero[SESSION_TOKEN_LEN];
+    int i;
+
+    if(ttl > MAX_SESSION_TTL)
+        ttl = MAX_SESSION_TTL;
+    memset(zero, 0, SESSION_TOKEN_LEN);
+
+    pthread_mutex_lock(&sessions_mutex);
+    if(!session_token_matches(token, zero)) {
+        for(i = 0; i < MAX_SESSIONS; i++)
+            if(sessions[i].node && !sessions[i].attached && session_token_matches(sessions[i].token, token)) {
+                session = &sessions[i];
+                break;
+            }
+    }
+    if(session == NULL) {
+        for(i = 0; i < MAX_SESSIONS; i++)
+            if(sessions[i].node == NULL) {
+                session = &sessions[i];
+                break;
+            }
+        if(session == NULL || (session->node = g15daemon_lcdnode_add(&masterlist)) == NULL) {
+            pthread_mutex_unlock(&sessions_mutex);
+            return NULL;
+        }
+        session_new_token(session->token);
+    } else
+        G15_INFO("Client reattached to its screen");
+    session->attached = 1;
+    session->ttl = ttl;
+    memcpy(token, session->token, SESSION_TOKEN_LEN);
+    pthread_mutex_unlock(&sessions_mutex);
+    return session;
+}
+
+/* the client of 'session' has hung up.  returns 1 if its screen is kept, 0 if it should be removed */
+static int session_detach(session_t *session)
+{
+    int kept = 0;
+
+    if(session == NULL)
+        return 0;
+    /* nothing is left but the screen and its last frame.  this waits on the keyboard & lcd threads, so is
+       done before the session can be found again */
+    if(session->ttl && !leaving)
+        g15daemon_lcd_detach(session->node->lcd);
+    pthread_mutex_lock(&sessions_mutex);
+    if(session->ttl && !leaving) {
+        session->expires = g15daemon_time_ns() + (unsigned long long)session->ttl * G15_NSEC_PER_SEC;
+        session->attached = 0;
+        kept = 1;
+    } else
+        session->node = NULL;
+    pthread_mutex_unlock(&sessions_mutex);
+    return kept;
+}
+
+/* remove the screens whose clients didn't come back in time */
+static void sessions_expire()
+{
+    unsigned long long now = g15daemon_time_ns();
+    lcdnode_t *expired[MAX_SESSIONS];
+    int i, n = 0;
+
+    pthread_mutex_lock(&sessions_mutex);
+    for(i = 0; i < MAX_SESSIONS; i++)
+        if(sessions[i].node && !sessions[i].attached && sessions[i].expires <= now) {
+            expired[n++] = sessions[i].node;
+            sessions[i].node = NULL;
+        }
+    pthread_mutex_unlock(&sessions_mutex);
+    for(i = 0; i < n; i++)
+        g15daemon_lcdnode_remove(expired[i]);
+}
+
+/* the client must send 6880 bytes for each lcd screen (1 per pixel - a panel other than the g15's takes
+* width*height bytes, and an "RBUF" frame the panel's buffer size).  This thread will continue to copy data
 * into the clients LCD buffer for as long as the connection remains open.
 * so, the client should open a socket, check to ensure that the server is a g15daemon,
 * and send multiple 6880 byte packets (1 for each screen update)
 * once the client disconnects by closing the socket, the LCD buffer is
-* removed and will no longer be displayed.
+* removed and will no longer be displayed, unless the client asked for it to be kept (see SESSION_HELO).
 */
-static void *lcd_client_thread(void *display) {
-
-    lcdnode_t *g15node = display;
-    lcd_t *client_lcd = g15node->lcd;
+static void *lcd_client_thread(void *arg) {
+
+    client_t *client = arg;
+    g15daemon_t *masterlist = client->masterlist;
+    int client_sock = client->sock;
+    lcdnode_t *g15node = NULL;
+    lcd_t *client_lcd = NULL;
+    const g15_geometry_t *geometry;
+    session_t *session = NULL;
     int retval;
     unsigned int width, height, buflen,header=4;
+    unsigned int ttl;
 
-    int client_sock = client_lcd->connection;
     char helo[]=SERV_HELO;
-    unsigned char *tmpbuf=g15daemon_xmalloc(6880);
+    /* large enough for a 1 byte per pixel frame for any panel, which is larger than anything else received */
+    unsigned char *tmpbuf=g15daemon_xmalloc(G15_MAX_PIXELS);
 
+    free(client);
     if(g15_send(client_sock, (char*)helo, strlen(SERV_HELO))<0){
         goto exitthread;
     }
     /* check for requested buffer type.. we only handle pixel buffers atm */
-    if(g15_recv(g15node, client_sock,(char*)tmpbuf,4)<4)
+    if(g15_recv(NULL, client_sock,(char*)tmpbuf,4)<4)
+        goto exitthread;
+
+    if(memcmp(tmpbuf, DEVICE_HELO, 3) == 0) {
+        if(!isdigit(tmpbuf[3]) || (masterlist = g15daemon_device(masterlist, tmpbuf[3] - '0')) == NULL)
+            goto exitthread;
+        if(g15_recv(NULL, client_sock, (char*)tmpbuf, 4) < 4)
+            goto exitthread;
+    }
+    if(memcmp(tmpbuf, SESSION_HELO, 4) == 0) {
+        if(g15_recv(NULL, client_sock, (char*)tmpbuf, 4 + SESSION_TOKEN_LEN) < 4 + SESSION_TOKEN_LEN)
+            goto exitthread;
+        memcpy(&ttl, tmpbuf, 4);
+        if((session = session_attach(masterlist, tmpbuf + 4, ntohl(ttl))) != NULL)
+            g15node = session->node;
+        else
+            memset(tmpbuf + 4, 0, SESSION_TOKEN_LEN);
+        if(g15_send(client_sock, (char*)tmpbuf + 4, SESSION_TOKEN_LEN) < 0)
+            goto exitthread;
+        if(g15_recv(NULL, client_sock, (char*)tmpbuf, 4) < 4)
+            goto exitthread;
+    }
+    if(g15node == NULL && (g15node = g15daemon_lcdnode_add(&masterlist)) == NULL)
         goto exitthread;
+    client_lcd = g15node->lcd;
+    /* a resumed screen has only its last frame */
+    g15daemon_lcd_reattach(client_lcd);
+    geometry = g15node->list->geometry;
+    /* override the default (generic handler and use our own for our clients */
+    client_lcd->g15plugin->info=(void*)(&lcdclient_info);
+    client_lcd->connection = client_sock;
 
     /* we will in the future handle txt buffers gracefully but for now we just hangup */
     if(tmpbuf[0]=='G') {
         while(!leaving) {
-            retval = g15_recv(g15node, client_sock,(char *)tmpbuf,6880);
-            if(retval!=6880){
+            retval = g15_recv(g15node, client_sock,(char *)tmpbuf,geometry->width*geometry->height);
+            if(retval!=geometry->width*geometry->height){
                 break;
             }
-            pthread_mutex_lock(&lcdlist_mutex);
-            memset(client_lcd->buf,0,1024);
+            g15daemon_frame_received(client_lcd,retval);
             g15daemon_convert_buf(client_lcd,tmpbuf);
             g15daemon_send_refresh(client_lcd);
-            pthread_mutex_unlock(&lcdlist_mutex);
         }
     }
     else if (tmpbuf[0]=='R') { /* libg15render buffer */
         while(!leaving) {
-            retval = g15_recv(g15node, client_sock, (char *)tmpbuf, 1048);
-            if(retval != 1048) {
+            /* receive straight into our back buffer, it is only published once complete */
+            retval = g15_recv(g15node, client_sock, (char *)client_lcd->buf, geometry->bufsize);
+            if(retval != geometry->bufsize) {
                 break;
             }
-            pthread_mutex_lock(&lcdlist_mutex);
-            memcpy(client_lcd->buf,tmpbuf,sizeof(client_lcd->buf));
+            g15daemon_frame_received(client_lcd,retval);
             g15daemon_send_refresh(client_lcd);
-            pthread_mutex_unlock(&lcdlist_mutex);
         }
     }
-    else if (tmpbuf[0]=='W'){ /* wbmp buffer - we assume (stupidly) that it's 160 pixels wide */
+    else if (tmpbuf[0]=='L') { /* libg15render buffer, with overlay layers */
+        unsigned short x, y;
+
+        while(!leaving) {
+            if(g15_recv(g15node, client_sock, (char *)tmpbuf, LAYER_HEADER_LEN) != LAYER_HEADER_LEN)
+                break;
+            if(tmpbuf[0] == 0) {
+                retval = g15_recv(g15node, client_sock, (char *)client_lcd->buf, geometry->bufsize);
+                if(retval != geometry->bufsize)
+                    break;
+                g15daemon_frame_received(client_lcd,retval);
+                g15daemon_send_refresh(client_lcd);
+                continue;
+            }
+            if(tmpbuf[1] == LAYER_REMOVE) {
+                g15daemon_layer_remove(client_lcd, tmpbuf[0]);
+                continue;
+            }
+            width = tmpbuf[6];
+            height = tmpbuf[7];
+            if(width > geometry->width || height > geometry->height) /* no way of telling where the next header is */
+                goto exitthread;
+            buflen = (width + 7) / 8 * height;
+            if(g15_recv(g15node, client_sock, (char *)tmpbuf + LAYER_HEADER_LEN, buflen) != buflen)
+                break;
+            memcpy(&x, tmpbuf + 2, 2);
+            memcpy(&y, tmpbuf + 4, 2);
+            memcpy(&ttl, tmpbuf + 12, 4);
+            if(g15daemon_layer_set(client_lcd, tmpbuf[0], (short)ntohs(x), (short)ntohs(y), width, height, tmpbuf[1],
+                                   tmpbuf + LAYER_HEADER_LEN, ntohl(ttl)) == 0)
+                g15daemon_layer_clip(client_lcd, tmpbuf[0], tmpbuf[8], tmpbuf[9], tmpbuf[10], tmpbuf[11]);
+        }
+    }
+    else if (tmpbuf[0]=='W'){ /* wbmp buffer - we assume (stupidly) that it's as wide as the panel */
         while(!leaving) {
-            retval = g15_recv(g15node, client_sock,(char*)tmpbuf, 865);
+            retval = g15_recv(g15node, client_sock,(char*)tmpbuf, geometry->framesize+5);
             if(!retval)
                 break;
 
@@ -342,27 +588,35 @@ static void *lcd_client_thread(void *display) {
 
             buflen = (width/8)*height;
 
-            if(buflen>860){ /* grab the remainder of the image and discard excess bytes */
-                /*  retval=g15_recv(client_sock,(char*)tmpbuf+865,buflen-860);  */
-                retval=g15_recv(g15node, client_sock,NULL,buflen-860);
-                buflen = 860;
+            if(buflen>geometry->framesize){ /* grab the remainder of the image and discard excess bytes */
+                retval=g15_recv(g15node, client_sock,NULL,buflen-geometry->framesize);
+                buflen = geometry->framesize;
             }
 
-            if(width!=160) /* FIXME - we ought to scale images I suppose */
+            if(width!=geometry->width) /* FIXME - we ought to scale images I suppose */
                 goto exitthread;
 
-            pthread_mutex_lock(&lcdlist_mutex);
-            memcpy(client_lcd->buf,tmpbuf+header,buflen+header);
+            g15daemon_frame_received(client_lcd,retval);
+            memcpy(client_lcd->buf,tmpbuf+header,buflen);
             g15daemon_send_refresh(client_lcd);
-            pthread_mutex_unlock(&lcdlist_mutex);
         }
     }
 exitthread:
-    if(client_lcd->masterlist->remote_keyhandler_sock==client_sock)
-      client_lcd->masterlist->remote_keyhandler_sock=0;
+    if(client_lcd) {
+        /* a resumed screen may be on another keyboard than the one asked for */
+        masterlist = g15node->list;
+        pthread_mutex_lock(&masterlist->lcdlist_mutex);
+        if(masterlist->remote_keyhandler_sock==client_sock) {
+          masterlist->remote_keyhandler_sock=0;
+          masterlist->remote_keyhandler=NULL;
+        }
+        client_lcd->connection = 0;
+        pthread_mutex_unlock(&masterlist->lcdlist_mutex);
+    }
     close(client_sock);
     free(tmpbuf);
-    g15daemon_lcdnode_remove(display);
+    if(g15node && !session_detach(session))
+        g15daemon_lcdnode_remove(g15node);
 
     pthread_exit(NULL);
 }
@@ -374,7 +628,7 @@ static int g15_clientconnect (g15daemon_t **g15daemon, int listening_socket) {
     struct pollfd pfd[1];
     pthread_t client_connection;
     pthread_attr_t attr;
-    lcdnode_t *clientnode;
+    client_t *client;
 
     memset(pfd,0,sizeof(pfd));
     pfd[0].fd = listening_socket;
@@ -393,17 +647,18 @@ static int g15_clientconnect (g15daemon_t **g15daemon, int listening_socket) {
             }
         }
 
-        clientnode = g15daemon_lcdnode_add(g15daemon);
-        clientnode->lcd->connection = conn_s;
-        /* override the default (generic handler and use our own for our clients */
-        clientnode->lcd->g15plugin->info=(void*)(&lcdclient_info);
+        /* the screen is made (or found again) by the client's thread, once it knows which the client wants */
+        client = g15daemon_xmalloc(sizeof(client_t));
+        client->masterlist = *g15daemon;
+        client->sock = conn_s;
 
         memset(&attr,0,sizeof(pthread_attr_t));
         pthread_attr_init(&attr);
         pthread_attr_setdetachstate(&attr,PTHREAD_CREATE_DETACHED);
         pthread_attr_setstacksize(&attr,256*1024); /* set stack to 768k - dont need 8Mb - this is probably rather excessive also */
-        if (pthread_create(&client_connection, &attr, lcd_client_thread, clientnode) != 0) {
+        if (pthread_create(&client_connection, &attr, lcd_client_thread, client) != 0) {
             g15daemon_log(LOG_WARNING,"Unable to create client thread.");
+            free(client);
             if (close(conn_s) < 0 ) {
                 g15daemon_log(LOG_WARNING, "error calling close()\n");
                 return -1;
@@ -434,6 +689,7 @@ static void lcdserver_thread(void *lcdlist){
 
     while ( !leaving ) {
         g15_clientconnect(&masterlist,g15_socket);
+        sessions_expire();
     }
 
     close(g15_socket);
@@ -447,7 +703,7 @@ static int server_events(plugin_event_t *event) {
     switch (event->event)
     {
         case G15_EVENT_KEYPRESS:{
-            if(lcd->connection && lcd->masterlist->remote_keyhandler_sock!=lcd->connection) { /* server client */
+            if(lcd->connection) { /* server client */
                 if((send(lcd->connection,(void *)&event->value,sizeof(event->value),0))<0)
                     g15daemon_log(LOG_WARNING,"Error in send: %s\n",strerror(errno));
             }
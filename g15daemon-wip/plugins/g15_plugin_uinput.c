@@ -317,6 +317,10 @@ static int keyevents(plugin_event_t *myevent) {
             lastkeys = myevent->value;
             break;
         }
+        case G15_EVENT_CONFIG_CHANGED:
+            /* the device stays open - only the key mapping can change */
+            map_Lkeys=g15daemon_cfg_read_int(uinput_cfg, "Lkeys.mapped",0);
+            break;
         case G15_EVENT_VISIBILITY_CHANGED:
         case G15_EVENT_USER_FOREGROUND:
 	case G15_EVENT_MLED: